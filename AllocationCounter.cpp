@@ -0,0 +1,91 @@
+#include "AllocationCounter.h"
+
+#ifdef COUNT_ALLOCATIONS
+
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+namespace {
+
+/** On a cache line of its own, so counting does not also slow down whatever would share it */
+struct alignas(64) Counter {
+	std::atomic<long long> value;
+};
+
+Counter allocations = { { 0 } };
+
+/** malloc, calling the new_handler until it succeeds as the standard operator new does */
+void* allocate(size_t size) {
+	allocations.value.fetch_add(1, std::memory_order_relaxed);
+	if(size == 0){
+		size = 1;
+	}
+	for(;;){
+		void *memory = malloc(size);
+		if(memory != NULL){
+			return memory;
+		}
+		std::new_handler handler = std::get_new_handler();
+		if(handler == NULL){
+			throw std::bad_alloc();
+		}
+		handler();
+	}
+}
+
+void* allocateNoThrow(size_t size) throw() {
+	try {
+		return allocate(size);
+	} catch(const std::bad_alloc&) {
+		return NULL;
+	}
+}
+
+}
+
+long long allocationCount() {
+	return allocations.value.load(std::memory_order_relaxed);
+}
+
+void* operator new(size_t size) {
+	return allocate(size);
+}
+
+void* operator new[](size_t size) {
+	return allocate(size);
+}
+
+void* operator new(size_t size, const std::nothrow_t&) throw() {
+	return allocateNoThrow(size);
+}
+
+void* operator new[](size_t size, const std::nothrow_t&) throw() {
+	return allocateNoThrow(size);
+}
+
+void operator delete(void *memory) throw() {
+	free(memory);
+}
+
+void operator delete[](void *memory) throw() {
+	free(memory);
+}
+
+void operator delete(void *memory, size_t) throw() {
+	free(memory);
+}
+
+void operator delete[](void *memory, size_t) throw() {
+	free(memory);
+}
+
+void operator delete(void *memory, const std::nothrow_t&) throw() {
+	free(memory);
+}
+
+void operator delete[](void *memory, const std::nothrow_t&) throw() {
+	free(memory);
+}
+
+#endif
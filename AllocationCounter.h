@@ -0,0 +1,18 @@
+#pragma once
+
+/**
+  Number of heap allocations made through operator new since startup, on any
+  thread.  Only the Profile configuration, which defines COUNT_ALLOCATIONS,
+  replaces the global operator new to count them; App then reports the count
+  per frame along with each pass.  Other builds keep the standard allocator
+  and always return 0.
+ */
+#ifdef COUNT_ALLOCATIONS
+const bool COUNTING_ALLOCATIONS = true;
+long long allocationCount();
+#else
+const bool COUNTING_ALLOCATIONS = false;
+inline long long allocationCount() {
+	return 0;
+}
+#endif
@@ -4,6 +4,11 @@
 #include "App.h"
 #include "World.h"
 #include "RayTraceCommon.h"
+#include "Benchmarks.h"
+#include "AllocationCounter.h"
+#include "BatchRender.h"
+#include "BenchmarkSuite.h"
+#include "QuadTreeNode.h"
 
 #include <G3D/Image3.h>
 #include <G3D/Color4.h>
@@ -24,6 +29,7 @@
 #include <math.h>
 #include <random>
 #include <cstdlib>
+#include <cstring>
 #include <set>
 
 G3D_START_AT_MAIN();
@@ -33,102 +39,198 @@ int main(int argc, char** argv) {
     settings.window.caption     = "Progressive Ray Tracer Demo";
     settings.window.width       = 960; 
     settings.window.height      = 640;
+    settings.window.resizable   = true;
+
+	int latencyBenchmarkMoves = 0;
+	bool packetBenchmark = false;
+	bool bvhBenchmark = false;
+	bool shadowBenchmark = false;
+	bool wavefrontBenchmark = false;
+	bool compactBenchmark = false;
+	bool instanceBenchmark = false;
+	bool refitBenchmark = false;
+	bool batch = false;
+	bool reproject = true;
+	BatchSettings batchSettings;
+	for(int i = 1; i < argc; i++){
+		if(strcmp(argv[i], "-contentionbench") == 0){
+			benchmarkRenderOrderContention();
+			return 0;
+		} else if(strcmp(argv[i], "-quadtreebench") == 0){
+			benchmarkQuadTreeBuild();
+			return 0;
+		} else if(strcmp(argv[i], "-sortbench") == 0){
+			benchmarkRenderOrderSort();
+			return 0;
+		} else if(strcmp(argv[i], "-latencybench") == 0){
+			latencyBenchmarkMoves = (i + 1 < argc) ? atoi(argv[++i]) : 20;
+		} else if(strcmp(argv[i], "-packetbench") == 0){
+			packetBenchmark = true;
+		} else if(strcmp(argv[i], "-bvhbench") == 0){
+			bvhBenchmark = true;
+		} else if(strcmp(argv[i], "-shadowbench") == 0){
+			shadowBenchmark = true;
+		} else if(strcmp(argv[i], "-wavefrontbench") == 0){
+			wavefrontBenchmark = true;
+		} else if(strcmp(argv[i], "-compactbench") == 0){
+			compactBenchmark = true;
+		} else if(strcmp(argv[i], "-instancebench") == 0){
+			instanceBenchmark = true;
+		} else if(strcmp(argv[i], "-refitbench") == 0){
+			refitBenchmark = true;
+		} else if(strcmp(argv[i], "-benchsuite") == 0){
+			return runBenchmarkSuite((i + 1 < argc && argv[i + 1][0] != '-') ? argv[i + 1] : "benchmark.json");
+		} else if(strcmp(argv[i], "-noreproject") == 0){
+			reproject = false;
+		} else if(strcmp(argv[i], "-aligntiles") == 0){
+			batchSettings.alignTiles = true;
+		} else if(strcmp(argv[i], "-batch") == 0 && i + 1 < argc){
+			batch = true;
+			batchSettings.output = argv[++i];
+		} else if(strcmp(argv[i], "-camera") == 0 && i + 6 < argc){
+			float xyzypr[6];
+			for(int k = 0; k < 6; k++){
+				xyzypr[k] = (float)atof(argv[++i]);
+			}
+			batchSettings.cameraFrame = G3D::CFrame::fromXYZYPRDegrees(xyzypr[0], xyzypr[1], xyzypr[2], xyzypr[3], xyzypr[4], xyzypr[5]);
+			batchSettings.sceneCamera = false;
+		} else if(strcmp(argv[i], "-scene") == 0 && i + 1 < argc){
+			batchSettings.scene = argv[++i];
+		} else if(strcmp(argv[i], "-resolution") == 0 && i + 2 < argc){
+			batchSettings.width = atoi(argv[++i]);
+			batchSettings.height = atoi(argv[++i]);
+		} else if(strcmp(argv[i], "-spp") == 0 && i + 1 < argc){
+			batchSettings.raysPerPixel = G3D::max(1, atoi(argv[++i]));
+		} else if(strcmp(argv[i], "-bounces") == 0 && i + 1 < argc){
+			batchSettings.maxBounces = atoi(argv[++i]);
+		} else if(strcmp(argv[i], "-budget") == 0 && i + 1 < argc){
+			batchSettings.timeBudget = atof(argv[++i]);
+		} else if(strcmp(argv[i], "-error") == 0 && i + 1 < argc){
+			batchSettings.errorTarget = (float)atof(argv[++i]);
+		} else if(strcmp(argv[i], "-maxspp") == 0 && i + 1 < argc){
+			batchSettings.maxSamplesPerPixel = G3D::clamp(atoi(argv[++i]), 1, (int)QuadTreeNode::MAX_SAMPLES);
+		} else if(strcmp(argv[i], "-inlineshadows") == 0){
+			batchSettings.batchShadowRays = false;
+		} else if(strcmp(argv[i], "-wavefront") == 0){
+			batchSettings.wavefront = true;
+		} else if(strcmp(argv[i], "-noreorder") == 0){
+			batchSettings.reorderRays = false;
+		} else if(strcmp(argv[i], "-nocache") == 0){
+			batchSettings.useCache = false;
+		} else if(strcmp(argv[i], "-compact") == 0){
+			batchSettings.compact = true;
+		} else if(strcmp(argv[i], "-lightsamples") == 0 && i + 1 < argc){
+			batchSettings.lightSamples = G3D::max(1, atoi(argv[++i]));
+		} else if(strcmp(argv[i], "-threads") == 0 && i + 1 < argc){
+			batchSettings.numThreads = atoi(argv[++i]);
+		}
+	}
+
+	if(batch){
+		return runBatchRender(batchSettings);
+	}
 
-    return App(settings).run();
+    App app(settings);
+	app.latencyBenchmarkMoves = latencyBenchmarkMoves;
+	app.packetBenchmark = packetBenchmark;
+	app.bvhBenchmark = bvhBenchmark;
+	app.shadowBenchmark = shadowBenchmark;
+	app.wavefrontBenchmark = wavefrontBenchmark;
+	app.compactBenchmark = compactBenchmark;
+	app.instanceBenchmark = instanceBenchmark;
+	app.refitBenchmark = refitBenchmark;
+	app.sceneFile = batchSettings.scene;
+	app.useCache = batchSettings.useCache;
+	app.compact = batchSettings.compact;
+	app.refineBudget = batchSettings.timeBudget;
+	app.renderer->reproject = reproject;
+	app.renderer->setAlignTiles(batchSettings.alignTiles);
+	app.renderer->errorTarget = batchSettings.errorTarget;
+	app.renderer->maxSamplesPerPixel = batchSettings.maxSamplesPerPixel;
+	app.renderer->lightSamples = batchSettings.lightSamples;
+	app.renderer->batchShadowRays = batchSettings.batchShadowRays;
+	app.renderer->wavefront = batchSettings.wavefront;
+	app.renderer->reorderRays = batchSettings.reorderRays;
+    return app.run();
 }
 
 static G3D::Random rnd(0xF018B4D3, false);
 
 App::App(const G3D::GApp::Settings& settings) : 
     GApp(settings),
-    m_raysPerPixel(1),
-	m_maxBounces(3),
+	m_moveTime(0.0),
+	m_awaitingFirstPixels(false),
+	m_benchmarkFrame(0),
+	m_frameStart(0.0),
+	m_resized(false),
+	m_animating(false),
+	m_animationTime(0.0),
+	m_animationClock(0.0),
+	m_lastAllocationCount(0),
+	m_passAllocations(0),
+	m_maxFrameAllocations(0),
+	m_passFrames(0),
+	m_passUploadBytes(0),
+	m_maxFrameUploadBytes(0),
     m_world(NULL),
-	threshold(0.05f){
+	latencyBenchmarkMoves(0),
+	packetBenchmark(false),
+	bvhBenchmark(false),
+	shadowBenchmark(false),
+	wavefrontBenchmark(false),
+	compactBenchmark(false),
+	instanceBenchmark(false),
+	refitBenchmark(false),
+	sceneFile(World::DEFAULT_SCENE),
+	useCache(true),
+	compact(false),
+	refineBudget(0.0){
     catchCommonExceptions = false;
 	
 	this->message("Building the QuadTree...");
-	this->tree = new QuadTree(0.0f, 0.0f, settings.window.width, settings.window.height);
-
-	for(int j = 0; j < settings.window.height; j++){
-		for(int i = 0; i < settings.window.width; i++){
-			this->tree->insert(G3D::Point2(i + 0.5, j + 0.5));
-		}
-	}
-
-	// The minus one is to remove the very top level node, which we aren't really interested
-	this->render_order = std::vector<QuadTree*>(this->tree->size());
-	this->tmp_render_order = new std::vector<QuadTree*>();
-	this->m_currentImage = G3D::Image3::createEmpty(settings.window.width, settings.window.height);
+	this->renderer = new Renderer(settings.window.width, settings.window.height);
 }
 
 void App::onCleanup() {
+	delete renderer;
+	renderer = NULL;
     delete m_world;
     m_world = NULL;
 }
 
-void App::start_threads(){
-	bool started = false;
-	if(this->ne_thread) {
-		started = this->ne_thread->start();
-	}
-	if(started) {
-		G3D::debugPrintf("%s started\n", this->ne_thread->name());
-	} else {
-		G3D::debugPrintf("ne_thread NOT started\n");
-	}
-	started = false;
-	if(this->nw_thread) {
-		started = this->nw_thread->start();
-	}
-	if(started) {
-		G3D::debugPrintf("%s started\n", this->nw_thread->name());
-	} else {
-		G3D::debugPrintf("nw_thread NOT started\n");
-	}
-	started = false;
-	if(this->sw_thread) {
-		started = this->sw_thread->start();
-	}
-	if(started) {
-		G3D::debugPrintf("%s started\n", this->sw_thread->name());
-	} else {
-		G3D::debugPrintf("sw_thread NOT started\n");
-	}
-	started = false;
-	if(this->se_thread) {
-		started = this->se_thread->start();
-	}
-	if(started) {
-		G3D::debugPrintf("%s started\n", this->se_thread->name());
-	} else {
-		G3D::debugPrintf("se_thread NOT started\n");
-	}
-}
-
-void App::check_threads(){
-	if(this->ne_thread && this->ne_thread->completed()){
-		this->threads.remove(this->ne_thread);
-		this->ne_thread = NULL;
-	}
-	if(this->nw_thread && this->nw_thread->completed()){
-		this->threads.remove(this->nw_thread);
-		this->nw_thread = NULL;
-	}
-	if(this->se_thread && this->se_thread->completed()){
-		this->threads.remove(this->se_thread);
-		this->se_thread = NULL;
-	}
-	if(this->sw_thread && this->sw_thread->completed()){
-		this->threads.remove(this->sw_thread);
-		this->sw_thread = NULL;
+bool App::onEvent(const G3D::GEvent& event) {
+	if(event.type == G3D::GEventType::VIDEO_RESIZE && this->renderer != NULL){
+		// Nothing is sorted for the new tree yet, so the next frame traces every leaf in the slow pass
+		this->renderer->pool->cancel();
+		this->renderer->pool->waitForCompletion();
+		this->renderer->resize(event.resize.w, event.resize.h);
+		this->m_framebuffer.resize(event.resize.w, event.resize.h);
+		this->m_resized = true;
+	} else if(event.type == G3D::GEventType::KEY_DOWN && event.key.keysym.sym == 'o' && this->renderer != NULL){
+		if(!this->renderer->wavefront){
+			G3D::debugPrintf("Secondary ray reordering only applies with -wavefront\n");
+			return GApp::onEvent(event);
+		}
+		// Restarts the frame like a camera move, so no pass sees the flag change under it, and
+		// from a blank image so every pixel of the next frame is traced with the new setting
+		this->renderer->pool->cancel();
+		this->renderer->pool->waitForCompletion();
+		this->renderer->reorderRays = !this->renderer->reorderRays;
+		this->renderer->discardAllHistory();
+		G3D::debugPrintf("Secondary ray reordering %s\n", this->renderer->reorderRays ? "on" : "off");
+		this->m_resized = true;
+	} else if(event.type == G3D::GEventType::KEY_DOWN && event.key.keysym.sym == 'p' && this->m_world != NULL && !this->m_world->spins.empty()){
+		this->m_animating = !this->m_animating;
+		this->m_animationClock = G3D::System::time();
+		G3D::debugPrintf("Animation %s\n", this->m_animating ? "on" : "off");
 	}
+	return GApp::onEvent(event);
 }
 
 void App::onInit() {
     message("Loading...");
 	
-    m_world = new World();
+    m_world = new World(this->sceneFile, this->useCache, this->compact);
 	
     showRenderingStats = false;
     createDeveloperHUD();
@@ -138,25 +240,53 @@ void App::onInit() {
     m_debugCamera->filmSettings().setContrastToneCurve();
 
     // Starting position
-    m_debugCamera->setFrame(G3D::CFrame::fromXYZYPRDegrees(24.3f, 0.4f, 2.5f, 68.7f, 1.2f, 0.0f));
+    m_debugCamera->setFrame(m_world->cameraFrame);
     m_debugCamera->frame();
 
+	this->renderer->world = this->m_world;
+	this->renderer->camera = this->m_debugCamera;
+	this->m_framebuffer.resize(this->renderer->width(), this->renderer->height());
+
     //makeGUI();
 
-	this->renderFirstFrame();
-	this->start_threads();
-	this->threads.waitForCompletion();
-	this->check_threads();
+	if(this->packetBenchmark || this->bvhBenchmark || this->shadowBenchmark || this->wavefrontBenchmark || this->compactBenchmark || this->instanceBenchmark || this->refitBenchmark){
+		if(this->bvhBenchmark){
+			benchmarkAccelerationStructures(this->m_world, this->m_debugCamera, this->renderDevice->viewport());
+		}
+		if(this->packetBenchmark){
+			benchmarkPacketTracing(this->m_world, this->m_debugCamera, this->renderDevice->viewport());
+		}
+		if(this->shadowBenchmark){
+			benchmarkShadowRays(this->m_world, this->m_debugCamera, this->renderDevice->viewport());
+		}
+		if(this->wavefrontBenchmark){
+			benchmarkWavefront(this->m_world, this->m_debugCamera, this->renderDevice->viewport());
+		}
+		if(this->compactBenchmark){
+			benchmarkCompactGeometry(this->m_world, this->m_debugCamera, this->renderDevice->viewport());
+		}
+		if(this->instanceBenchmark){
+			benchmarkInstancing(this->m_world, this->m_debugCamera, this->renderDevice->viewport());
+		}
+		if(this->refitBenchmark){
+			benchmarkDynamicInstances(this->m_world, this->m_debugCamera, this->renderDevice->viewport());
+		}
+		this->current_mode = App::render_mode::NONE;
+		setExitCode(0);
+		return;
+	}
+
+	this->renderer->renderFirstFrame();
+	this->renderer->pool->waitForCompletion();
+	this->renderer->pool->printStats();
 
-	this->calculateNeighborDiff();
-	this->start_threads();
-	this->threads.waitForCompletion();
-	this->check_threads();
+	this->renderer->calculateNeighborDiff();
+	this->renderer->pool->waitForCompletion();
 
 	message("Sorting World...");
-	this->sort_render_order();
+	this->renderer->sortRenderOrder();
 
-	this->smallDiffStart = this->render_order.size();
+	this->renderer->smallDiffStart = this->renderer->render_order.size();
 
 	this->current_mode = App::render_mode::SORT;
 }
@@ -176,467 +306,191 @@ void App::message(const std::string& msg) const {
 void App::makeGUI() {
     shared_ptr<G3D::GuiWindow> window = G3D::GuiWindow::create("Controls", debugWindow->theme(), G3D::Rect2D::xywh(0,0,0,0), G3D::GuiTheme::TOOL_WINDOW_STYLE);
     G3D::GuiPane* pane = window->pane();
-	pane->addSlider("threshold", &threshold, 2.0f, 0.000005f);
+	pane->addSlider("threshold", &renderer->threshold, 2.0f, 0.000005f);
     window->pack();
 
     window->setVisible(true);
     addWidget(window);
 }
 
-void App::onGraphics(G3D::RenderDevice* rd, G3D::Array<shared_ptr<G3D::Surface> >& surface3D, G3D::Array<shared_ptr<G3D::Surface2D> >& surface2D) {
-    // Update the preview image only while moving
-	if (this->current_mode == App::render_mode::FINISH){
-		// Post-process
-		shared_ptr<G3D::Texture> src = G3D::Texture::fromImage("Source", m_currentImage);
-		m_film->exposeAndRender(renderDevice, m_debugCamera->filmSettings(), src, m_result);
-		m_prevCFrame = m_debugCamera->frame();
-		this->current_mode = App::render_mode::NONE;
-	} else if (this->current_mode != App::render_mode::START && !this->m_prevCFrame.fuzzyEq(this->m_debugCamera->frame())) {
-		this->current_mode = App::render_mode::INITIAL;
-
-		if(this->ne_thread != NULL && this->ne_thread->started()){
-			this->ne_thread->terminate();
-		}
-		if(this->nw_thread != NULL && this->nw_thread->started()){
-			this->nw_thread->terminate();
-		}
-		if(this->sw_thread != NULL && this->sw_thread->started()){
-			this->sw_thread->terminate();
-		}
-		if(this->se_thread != NULL && this->se_thread->started()){
-			this->se_thread->terminate();
-		}
-		this->threads.terminate();
-		this->threads.waitForCompletion();
-		this->threads.clear();
-
-		this->ne_thread = NULL;
-		this->nw_thread = NULL;
-		this->sw_thread = NULL;
-		this->se_thread = NULL;
-
-		this->tmp_render_order->clear();
-		this->smallDiffStart = this->render_order.size();
-		this->rayTraceImage(1);
-		this->m_prevCFrame = this->m_debugCamera->frame();
-		
-		// There is some bug that is keeping the threads from exiting if they are changed quickly.
-		// When this happens, the program stops working, and must be restarted.
-		// This is a hack to prevent this
-		G3D::System::sleep(.3);
-		this->timer.reset();
-		this->start_threads();
-	} else if(this->threads.size() > 0){
-		this->check_threads();
-		this->m_result = G3D::Texture::fromImage("Source", m_currentImage);
-	} else if (this->threads.size() == 0 && this->current_mode == App::render_mode::INITIAL) {
-		this->timer.after("color_quad");
-		this->current_mode = App::render_mode::FAST_COLOR;
-
-		this->fastColor();
-		this->timer.reset();
-		this->start_threads();
-	} else if (this->threads.size() == 0 && this->current_mode == App::render_mode::FAST_COLOR) {
-		this->timer.after("fast color");
-		this->current_mode = App::render_mode::SLOW_COLOR;
-
-		this->slowColor();
-		this->start_threads();
-	} else if (this->threads.size() == 0 && this->current_mode == App::render_mode::SLOW_COLOR) {
-		this->current_mode = App::render_mode::SORT;
-	} else if (this->current_mode == App::render_mode::START) {
-		this->current_mode = App::render_mode::FINISH;
-	} else if (this->threads.size() == 0 && this->current_mode == App::render_mode::SORT) {
-		this->current_mode = App::render_mode::SORT_WAITING;
+void App::runLatencyBenchmark() {
+	const int framesPerMove = 5;
 
-		this->calculateNeighborDiff();
-		this->start_threads();
-	} else if (this->threads.size() == 0 && this->current_mode == App::render_mode::SORT_WAITING) {
-		this->current_mode = App::render_mode::FINISH;
-		this->sort_render_order();
+	if(this->m_awaitingFirstPixels && this->renderer->pool->firstItemTime() > this->m_moveTime){
+		this->m_moveLatencies.append(this->renderer->pool->firstItemTime() - this->m_moveTime);
+		this->m_awaitingFirstPixels = false;
 	}
 
-    if (m_result) {
-        rd->push2D();
-        rd->setTexture(0, m_result);
-        G3D::Draw::rect2D(rd->viewport(), rd);
-        rd->pop2D();
-    }
-
-    G3D::Surface2D::sortAndRender(rd, surface2D);
-}
-
-void App::sort_render_order() {
-	std::priority_queue<QuadTree*, std::vector<QuadTree*>, QuadTreeDiffComparator> tmp(this->tmp_render_order->begin(), this->tmp_render_order->end());
-	int counter = 0;
-	while(!tmp.empty()){
-		this->render_order[counter++] = tmp.top();
-		tmp.pop();
-	}
-
-}
-
-struct Collector *ne_collector, *nw_collector, *sw_collector, *se_collector;
-
-void fstColor(void *arg) {
-	Collector *collector = (Collector*)arg;  
-	App *app = collector->app;
-	QuadTree *qt = collector->qt;
-
-	if(qt == NULL){
-		return;
-	} 
-
-	// No need to check for null because that really shouldn't happen
-	G3D::Rect2D boundary = app->m_currentImage->rect2DBounds();
-	G3D::Color3 average = G3D::Color3::black();
-	int index = collector->render_index;
-	while(index < app->render_order.size() && qt->neighborColorDiff > app->threshold) {
-		qt = app->render_order[index];
-		app->order_lock.lock();
-		app->tmp_render_order->push_back(qt);
-		app->order_lock.unlock();
-		
-		for(int i = 0; i < qt->points.size(); i++){
-			float x = qt->points[i].x;
-			float y = qt->points[i].y;
-			if(app->m_currentImage->fastGet(x, y) == G3D::Color3::black()){
-				G3D::Color3 sum = app->rayTrace(app->getDebugCamera()->worldRay(x, y, boundary), app->m_world);
-				qt->points[i].color = sum;
-				app->m_currentImage->fastSet(x, y, qt->points[i].color);
-				average += app->m_currentImage->fastGet(x, y);
-			}
+	if(this->latencyBenchmarkMoves > 0){
+		// Only move once the previous move has produced pixels, otherwise moves would just coalesce
+		if(!this->m_awaitingFirstPixels && ++this->m_benchmarkFrame % framesPerMove == 0){
+			const float offset = (this->latencyBenchmarkMoves % 2 == 0) ? 0.05f : -0.05f;
+			G3D::CFrame frame = this->m_debugCamera->frame();
+			frame.translation.x += offset;
+			this->m_debugCamera->setFrame(frame);
+			this->latencyBenchmarkMoves--;
 		}
-
-		qt->color = average / qt->points.size();
-		index += 4;
-	}
-
-	app->diff_lock.lock();
-	if(app->smallDiffStart > index){
-		app->smallDiffStart = index;
-	}
-	app->diff_lock.unlock();
-}
-
-void App::fastColor(){
-	if(this->ne_thread == NULL) {
-		if(ne_collector){
-			delete ne_collector;
-			delete nw_collector;
-			delete sw_collector;
-			delete se_collector;
+	} else if(!this->m_awaitingFirstPixels && this->m_moveLatencies.size() > 0){
+		double total = 0.0;
+		double worst = 0.0;
+		for(int i = 0; i < this->m_moveLatencies.size(); i++){
+			total += this->m_moveLatencies[i];
+			worst = G3D::max(worst, this->m_moveLatencies[i]);
 		}
-		ne_collector = new Collector(this, this->render_order[0], 0);
-		nw_collector = new Collector(this, this->render_order[1], 1);
-		sw_collector = new Collector(this, this->render_order[2], 2);
-		se_collector = new Collector(this, this->render_order[3], 3);
-
-		this->ne_thread = G3D::GThread::create("fastColor_ne_thread", &fstColor, (void*)ne_collector);
-		this->nw_thread = G3D::GThread::create("fastColor_nw_thread", &fstColor, (void*)nw_collector);
-		this->sw_thread = G3D::GThread::create("fastColor_sw_thread", &fstColor, (void*)sw_collector);
-		this->se_thread = G3D::GThread::create("fastColor_se_thread", &fstColor, (void*)se_collector);
-
-		this->threads.insert(this->ne_thread);
-		this->threads.insert(this->nw_thread);
-		this->threads.insert(this->sw_thread);
-		this->threads.insert(this->se_thread);
+		G3D::debugPrintf("Camera move to first pixels over %d moves: mean %f s, max %f s\n", 
+			this->m_moveLatencies.size(), total / this->m_moveLatencies.size(), worst);
+		this->m_moveLatencies.clear();
+		setExitCode(0);
 	}
 }
 
-void slwColor(void *arg){
-	Collector *collector = (Collector*)arg;  
-	App *app = collector->app;
-
-	G3D::Rect2D boundary = app->m_currentImage->rect2DBounds();
-
-	int index = collector->render_index;
-	while(index < app->render_order.size()){
-		QuadTree *qt = app->render_order[index];
-		if(qt != NULL) {
-			G3D::Color3 average = G3D::Color3::black();
-			app->order_lock.lock();
-			app->tmp_render_order->push_back(qt);
-			app->order_lock.unlock();
-
-			for(int i = 0; i < qt->points.size(); i++){
-				float x = qt->points[i].x;
-				float y = qt->points[i].y;
-				if(app->m_currentImage->fastGet(x, y) == G3D::Color3::black()){
-					G3D::Color3 sum = app->rayTrace(app->getDebugCamera()->worldRay(x, y, boundary), app->m_world);
-					qt->points[i].color = sum;
-					app->m_currentImage->fastSet(x, y, qt->points[i].color);
-				}
-
-				average += app->m_currentImage->fastGet(x, y) / qt->points.size();
-			}
-			qt->color = average;			
-		}
-		index += 4;
-	}
+void App::stepAnimation() {
+	// Workers drop the rest of the refinement, so this only waits for the leaves already being traced
+	this->renderer->pool->cancel();
+	this->renderer->pool->waitForCompletion();
+
+	double now = G3D::System::time();
+	this->m_animationTime += now - this->m_animationClock;
+	this->m_animationClock = now;
+	this->m_movedBoxes.clear();
+	this->m_world->animate(this->m_animationTime, this->m_movedBoxes);
+	int leaves = this->renderer->discardSeen(this->m_movedBoxes);
+	G3D::debugPrintf("%d instances moved in %f s; %d of %d leaves saw them\n", (int)this->m_world->spins.size(),
+		G3D::System::time() - now, leaves, this->renderer->tree->leafCount());
+
+	// The camera has not moved, so the render order and every other leaf stay as they are
+	this->m_frameStart = now;
+	this->current_mode = App::render_mode::RETRACE;
+	this->timer.reset();
+	this->renderer->retraceSeen();
 }
 
-void App::slowColor(){
-	if(this->ne_thread == NULL) {
-		if(ne_collector){
-			delete ne_collector;
-			delete nw_collector;
-			delete sw_collector;
-			delete se_collector;
-		}
-		ne_collector = new Collector(this, this->render_order[this->smallDiffStart], this->smallDiffStart);
-		nw_collector = new Collector(this, this->render_order[this->smallDiffStart + 1], this->smallDiffStart + 1);
-		sw_collector = new Collector(this, this->render_order[this->smallDiffStart + 2], this->smallDiffStart + 2);
-		se_collector = new Collector(this, this->render_order[this->smallDiffStart + 3], this->smallDiffStart + 3);
-
-		this->ne_thread = G3D::GThread::create("slowColor_ne_thread", &slwColor, (void*)ne_collector);
-		this->nw_thread = G3D::GThread::create("slowColor_nw_thread", &slwColor, (void*)nw_collector);
-		this->sw_thread = G3D::GThread::create("slowColor_sw_thread", &slwColor, (void*)sw_collector);
-		this->se_thread = G3D::GThread::create("slowColor_se_thread", &slwColor, (void*)se_collector);
-
-		this->threads.insert(this->ne_thread);
-		this->threads.insert(this->nw_thread);
-		this->threads.insert(this->sw_thread);
-		this->threads.insert(this->se_thread);
-	}
+void App::updateFramebuffer() {
+	this->renderer->updateImage(this->m_dirtyRects);
+	this->m_framebuffer.upload(*this->renderer->image, this->m_dirtyRects);
+	long long bytes = (long long)this->m_framebuffer.bytesUploaded();
+	this->m_passUploadBytes += bytes;
+	this->m_maxFrameUploadBytes = G3D::max(this->m_maxFrameUploadBytes, bytes);
 }
 
-void firstFrame(void *arg){
-	Collector *collector = (Collector*)arg;  
-	App *app = collector->app;
-	QuadTree *qt = collector->qt;
-
-	if(qt == NULL){
-		return;
-	}
-	app->order_lock.lock();
-	app->tmp_render_order->push_back(qt);
-	app->order_lock.unlock();
-
-	G3D::Rect2D boundary = app->window()->clientRect();
-	G3D::Color3 average = G3D::Color3::black();
-
-	for(int i = 0; i < qt->points.size(); i++){
-		G3D::Color3 sum = app->rayTrace(app->getDebugCamera()->worldRay(qt->points[i].x, qt->points[i].y, boundary), app->m_world);
-		qt->points[i].color = sum;
-		app->m_currentImage->fastSet(qt->points[i].x, qt->points[i].y, sum);
-		average += sum;
-	}
-
-	qt->color = average / qt->points.size();
-
-	struct Collector tmp;
-	tmp.app = app;
-
-	tmp.qt = qt->ne;
-	firstFrame((void*)&tmp);
-
-	tmp.qt = qt->nw;
-	firstFrame((void*)&tmp);
-
-	tmp.qt = qt->sw;
-	firstFrame((void*)&tmp);
-
-	tmp.qt = qt->se;
-	firstFrame((void*)&tmp);
+void App::postProcess() {
+	this->updateFramebuffer();
+	// The exposed image goes to its own texture, since m_result may be showing the framebuffer itself
+	m_film->exposeAndRender(renderDevice, m_debugCamera->filmSettings(), this->m_framebuffer.texture(), this->m_exposed);
+	m_result = this->m_exposed;
 }
 
-void App::renderFirstFrame() {
-	if(this->ne_thread == NULL) {
-		if(ne_collector){
-			delete ne_collector;
-			delete nw_collector;
-			delete sw_collector;
-			delete se_collector;
-		}
-		ne_collector = new Collector(this, this->tree->ne, 0);
-		nw_collector = new Collector(this, this->tree->nw, 0);
-		sw_collector = new Collector(this, this->tree->sw, 0);
-		se_collector = new Collector(this, this->tree->se, 0);
-
-		this->ne_thread = G3D::GThread::create("firstFrame_ne_thread", &firstFrame, (void*)ne_collector);
-		this->nw_thread = G3D::GThread::create("firstFrame_nw_thread", &firstFrame, (void*)nw_collector);
-		this->sw_thread = G3D::GThread::create("firstFrame_sw_thread", &firstFrame, (void*)sw_collector);
-		this->se_thread = G3D::GThread::create("firstFrame_se_thread", &firstFrame, (void*)se_collector);
-
-		this->threads.insert(this->ne_thread);
-		this->threads.insert(this->nw_thread);
-		this->threads.insert(this->sw_thread);
-		this->threads.insert(this->se_thread);
-	}
-}
-
-void color_quad(void *arg) {
-	Collector *collector = (Collector*)arg;  
-	App *app = collector->app;
-	QuadTree *qt = collector->qt;
-
-	if(qt == NULL){
-		return;
-	} 
-	
-	int index = collector->render_index;
-	while(index < app->render_order.size() && qt->neighborColorDiff > app->threshold) {
-		qt = app->render_order[index];
-		G3D::Color3 whole = app->rayTrace(app->getDebugCamera()->worldRay(qt->boundary->center().x, qt->boundary->center().y, app->m_currentImage->rect2DBounds()), app->m_world);
-
-		app->m_currentImage->fastSet(qt->boundary->center().x, qt->boundary->center().y, whole);
-		index += 4;
-	}
-
-	app->diff_lock.lock();
-	if(app->smallDiffStart > index){
-		app->smallDiffStart = index;
+void App::printPassStats() {
+	this->renderer->pool->printStats();
+	if(COUNTING_ALLOCATIONS){
+		G3D::debugPrintf("  %lld heap allocations over %d frames, at most %lld in one frame\n", this->m_passAllocations, this->m_passFrames, this->m_maxFrameAllocations);
 	}
-	app->diff_lock.unlock();
-}
-
-void App::rayTraceImage(int numRays) {
-	int width = int(window()->width());
-	int height = int(window()->height());
-
-	if(this->ne_thread == NULL){
-		if(ne_collector){
-			delete ne_collector;
-			delete nw_collector;
-			delete sw_collector;
-			delete se_collector;
+	G3D::debugPrintf("  %.2f MB uploaded, at most %.2f MB in one frame\n", this->m_passUploadBytes / (1024.0 * 1024.0), this->m_maxFrameUploadBytes / (1024.0 * 1024.0));
+	this->m_passUploadBytes = 0;
+	this->m_maxFrameUploadBytes = 0;
+
+	long long primary, shadow, secondary, primaryNodes, secondaryNodes;
+	this->renderer->rayCounts(primary, shadow, secondary);
+	this->renderer->nodeVisits(primaryNodes, secondaryNodes);
+	if(primary > 0){
+		G3D::debugPrintf("  %.1f BVH nodes per primary ray", primaryNodes / (double)primary);
+		if(this->renderer->wavefront && secondary > 0){
+			G3D::debugPrintf(", %.1f per secondary ray (reordering %s)", secondaryNodes / (double)secondary, this->renderer->reorderRays ? "on" : "off");
 		}
-
-		ne_collector = new Collector(this, this->render_order[0], 0);
-		nw_collector = new Collector(this, this->render_order[1], 1);
-		sw_collector = new Collector(this, this->render_order[2], 2);
-		se_collector = new Collector(this, this->render_order[3], 3);
-
-		this->ne_thread = G3D::GThread::create("rayTraceImage_ne_thread", &color_quad, (void*)ne_collector);
-		this->nw_thread = G3D::GThread::create("rayTraceImage_nw_thread", &color_quad, (void*)nw_collector);
-		this->sw_thread = G3D::GThread::create("rayTraceImage_sw_thread", &color_quad, (void*)sw_collector);
-		this->se_thread = G3D::GThread::create("rayTraceImage_se_thread", &color_quad, (void*)se_collector);
-
-		this->threads.insert(this->ne_thread);
-		this->threads.insert(this->nw_thread);
-		this->threads.insert(this->sw_thread);
-		this->threads.insert(this->se_thread);
+		G3D::debugPrintf("\n");
 	}
-
-	m_currentImage = G3D::Image3::createEmpty(width, height);
-    m_currentRays = numRays;
+	this->renderer->resetRayCounts();
+	this->m_passAllocations = 0;
+	this->m_maxFrameAllocations = 0;
+	this->m_passFrames = 0;
 }
 
-void calc_neighbor_diff(void *arg){
-	Collector *collector = (Collector*)arg;  
-	App *app = collector->app;
-	QuadTree *qt = collector->qt;
+void App::onGraphics(G3D::RenderDevice* rd, G3D::Array<shared_ptr<G3D::Surface> >& /*surface3D*/, G3D::Array<shared_ptr<G3D::Surface2D> >& surface2D) {
+	long long allocations = allocationCount();
+	long long frameAllocations = allocations - this->m_lastAllocationCount;
+	this->m_lastAllocationCount = allocations;
+	this->m_passAllocations += frameAllocations;
+	this->m_maxFrameAllocations = G3D::max(this->m_maxFrameAllocations, frameAllocations);
+	this->m_passFrames++;
 
-	if(qt == NULL){
-		return;
-	} else if(qt->ne == NULL){
-		qt->neighborColorDiff = 0.0;
-		return;
-	}
-
-	G3D::Color3 sum = qt->ne->color - qt->color;
-	sum += qt->nw->color - qt->color;
-	sum += qt->sw->color - qt->color;
-	sum += qt->sw->color - qt->color;
-
-	qt->neighborColorDiff = sqrt((sum / 4).squaredLength());
-	if(qt->neighborColorDiff > 10.0f){
-		qt->neighborColorDiff /= 100.0f;
-	}
-
-	struct Collector tmp;
-	tmp.app = app;
+	this->runLatencyBenchmark();
 
-	tmp.qt = qt->ne;
-	calc_neighbor_diff((void*)&tmp);
-
-	tmp.qt = qt->nw;
-	calc_neighbor_diff((void*)&tmp);
-
-	tmp.qt = qt->sw;
-	calc_neighbor_diff((void*)&tmp);
-
-	tmp.qt = qt->se;
-	calc_neighbor_diff((void*)&tmp);
-}
+    // Update the preview image only while moving
+	if (this->current_mode == App::render_mode::FINISH){
+		this->postProcess();
+		m_prevCFrame = m_debugCamera->frame();
 
-void App::calculateNeighborDiff(){
-	if(this->ne_thread == NULL) {
-		if(ne_collector){
-			delete ne_collector;
-			delete nw_collector;
-			delete sw_collector;
-			delete se_collector;
+		// Keep adding samples where the error is largest until the frame converges
+		this->current_mode = App::render_mode::REFINE;
+		if (this->renderer->refine() == 0) {
+			this->current_mode = App::render_mode::NONE;
 		}
-		ne_collector = new Collector(this, this->tree->ne, 0);
-		nw_collector = new Collector(this, this->tree->nw, 0);
-		sw_collector = new Collector(this, this->tree->sw, 0);
-		se_collector = new Collector(this, this->tree->se, 0);
-
-		this->ne_thread = G3D::GThread::create("neighborDiff_ne_thread", &calc_neighbor_diff, (void*)ne_collector);
-		this->nw_thread = G3D::GThread::create("neighborDiff_nw_thread", &calc_neighbor_diff, (void*)nw_collector);
-		this->sw_thread = G3D::GThread::create("neighborDiff_sw_thread", &calc_neighbor_diff, (void*)sw_collector);
-		this->se_thread = G3D::GThread::create("neighborDiff_se_thread", &calc_neighbor_diff, (void*)se_collector);
-
-		this->threads.insert(this->ne_thread);
-		this->threads.insert(this->nw_thread);
-		this->threads.insert(this->sw_thread);
-		this->threads.insert(this->se_thread);
-	}
-}
-
-G3D::Radiance3 App::rayTrace(const G3D::Ray& ray, World* world, int bounce) {
-    G3D::Radiance3 radiance = G3D::Radiance3::zero();
-	const G3D::Radiance3 white = G3D::Radiance3::white();
-    const float BUMP_DISTANCE = 0.0001f;
-
-    float dist = (float)G3D::inf();
-    const shared_ptr<G3D::Surfel>& surfel = world->intersect(ray, dist);
+	} else if (this->current_mode != App::render_mode::START && (this->m_resized || !this->m_prevCFrame.fuzzyEq(this->m_debugCamera->frame()))) {
+		this->m_resized = false;
+		this->m_moveTime = G3D::System::time();
+		this->m_frameStart = this->m_moveTime;
+		this->m_awaitingFirstPixels = true;
+		this->current_mode = App::render_mode::INITIAL;
 
-    if (G3D::notNull(surfel)) {
-		// Shade this point (direct illumination)
-		for (int L = 0; L < world->lightArray.size(); ++L) {
-			const shared_ptr<G3D::Light>& light = world->lightArray[L];
+		// Workers drop the rest of the stale pass, so this only waits for the leaves already being traced
+		this->renderer->pool->cancel();
+		this->renderer->pool->waitForCompletion();
 
-			// Shadow rays
-			if (world->lineOfSight(surfel->location + surfel->geometricNormal * BUMP_DISTANCE, light->position().xyz())) {
-				G3D::Vector3 w_i = light->position().xyz() - surfel->location;
-				const float distance2 = w_i.squaredLength();
-				w_i /= sqrt(distance2);
+		this->renderer->tmp_render_order.clear();
+		this->timer.reset();
+		this->renderer->rayTraceImage();
+		this->m_prevCFrame = this->m_debugCamera->frame();
+	} else if (this->m_animating && (this->current_mode == App::render_mode::REFINE || this->current_mode == App::render_mode::NONE)) {
+		// The next step waits for the first image of the last one, so it is never dropped unseen
+		this->stepAnimation();
+	} else if(this->renderer->pool->busy()){
+		this->updateFramebuffer();
+		this->m_result = this->m_framebuffer.texture();
+	} else if (this->current_mode == App::render_mode::RETRACE) {
+		this->timer.after("retrace");
+		this->printPassStats();
+		this->current_mode = App::render_mode::FINISH;
+	} else if (this->current_mode == App::render_mode::INITIAL) {
+		this->timer.after("color_quad");
+		this->printPassStats();
+		this->current_mode = App::render_mode::FAST_COLOR;
 
-				// Biradiance
-				const G3D::Biradiance3& B_i = light->color / (4.0f * G3D::pif() * distance2);
+		this->timer.reset();
+		this->renderer->fastColor();
+	} else if (this->current_mode == App::render_mode::FAST_COLOR) {
+		this->timer.after("fast color");
+		this->printPassStats();
+		this->current_mode = App::render_mode::SLOW_COLOR;
 
-				radiance += 
-					surfel->finiteScatteringDensity(w_i, -ray.direction()) * 
-					B_i *
-					G3D::max(0.0f, w_i.dot(surfel->shadingNormal));
+		this->renderer->slowColor();
+	} else if (this->current_mode == App::render_mode::SLOW_COLOR) {
+		this->printPassStats();
+		this->current_mode = App::render_mode::SORT;
+	} else if (this->current_mode == App::render_mode::START) {
+		this->current_mode = App::render_mode::FINISH;
+	} else if (this->current_mode == App::render_mode::SORT) {
+		this->current_mode = App::render_mode::SORT_WAITING;
 
-				debugAssert(radiance.isFinite());
-			}
+		this->renderer->calculateNeighborDiff();
+	} else if (this->current_mode == App::render_mode::SORT_WAITING) {
+		this->current_mode = App::render_mode::FINISH;
+		this->renderer->sortRenderOrder();
+	} else if (this->current_mode == App::render_mode::REFINE) {
+		bool outOfTime = this->refineBudget > 0.0 && G3D::System::time() - this->m_frameStart > this->refineBudget;
+		if (outOfTime || this->renderer->refine() == 0) {
+			this->printPassStats();
+			G3D::debugPrintf("Refinement stopped with a largest leaf error of %f\n", this->renderer->maxError());
+			this->postProcess();
+			this->current_mode = App::render_mode::NONE;
 		}
+	}
 
-        // Specular
-        if (bounce < m_maxBounces) {
-            // Perfect reflection and refraction
-            G3D::Surfel::ImpulseArray impulseArray;
-            surfel->getImpulses(G3D::PathDirection::EYE_TO_SOURCE, -ray.direction(), impulseArray);
-                
-            for (int i = 0; i < impulseArray.size(); ++i) {
-                const G3D::Surfel::Impulse& impulse = impulseArray[i];
-                // Bump along normal *in the outgoing ray direction*. 
-                const G3D::Vector3& offset = surfel->geometricNormal * G3D::sign(impulse.direction.dot(surfel->geometricNormal)) * BUMP_DISTANCE;
-                const G3D::Ray& secondaryRay = G3D::Ray::fromOriginAndDirection(surfel->location + offset, impulse.direction);
-                debugAssert(secondaryRay.direction().isFinite());
-                radiance += rayTrace(secondaryRay, world, bounce + 1) * impulse.magnitude;
-                debugAssert(radiance.isFinite());
-            }
-        }
-    } else {
-        // Hit the sky
-        radiance = world->ambient;
+    if (m_result) {
+        rd->push2D();
+        rd->setTexture(0, m_result);
+        G3D::Draw::rect2D(rd->viewport(), rd);
+        rd->pop2D();
     }
 
-    return radiance;
+    G3D::Surface2D::sortAndRender(rd, surface2D);
 }
@@ -12,10 +12,10 @@
 #include <G3D/Random.h>
 #include <G3D/CoordinateFrame.h>
 #include <G3D/Color3.h>
-#include <G3D/ThreadSet.h>
 #include <G3D/Image3.h>
 #include <G3D/Ray.h>
 #include <G3D/Stopwatch.h>
+#include <G3D/AABox.h>
 
 #include <GLG3D/GApp.h>
 #include <GLG3D/Texture.h>
@@ -26,68 +26,113 @@
 
 #include <queue>
 #include <set>
+#include <vector>
 
 #include "World.h"
-#include "QuadTree.h"
+#include "Renderer.h"
+#include "StreamingTexture.h"
 
 class World;
 
 class App : public G3D::GApp {
 private:
-    int                 m_raysPerPixel;
-	int					m_maxBounces;
-
-	QuadTree			*tree;
-
     G3D::Random         m_rng;
 	G3D::Stopwatch		timer;
 
     /** Position during the previous frame */
     G3D::CFrame         m_prevCFrame;
 
-	G3D::GThreadRef		ne_thread;
-	G3D::GThreadRef		nw_thread;
-	G3D::GThreadRef		sw_thread;
-	G3D::GThreadRef		se_thread;
+	/** Time at which the last camera move was noticed, and whether its first new pixels are still pending */
+	double				m_moveTime;
+	bool				m_awaitingFirstPixels;
+	int					m_benchmarkFrame;
+	G3D::Array<double>	m_moveLatencies;
+
+	/** Time at which the current frame was started */
+	double				m_frameStart;
+
+	/** Set by onEvent when the window size changes; forces a new frame like a camera move */
+	bool				m_resized;
+
+	/** Whether the world's spinning instances turn, toggled by 'p'; how far into their turn they
+		are, and the time it was last advanced */
+	bool				m_animating;
+	double				m_animationTime;
+	double				m_animationClock;
+	/** Bounds the instances moved from and to in the last step */
+	std::vector<G3D::AABox>	m_movedBoxes;
+
+	/** Turns the spinning instances to the current time and re-traces only the leaves that saw
+		them where they were or are now */
+	void stepAnimation();
+
+	/** Heap allocations seen by onGraphics, per frame and over the current pass; see AllocationCounter.h */
+	long long			m_lastAllocationCount;
+	long long			m_passAllocations;
+	long long			m_maxFrameAllocations;
+	int					m_passFrames;
+
+	/** The renderer's image on the GPU, updated with the leaves finished since the last frame */
+	StreamingTexture	m_framebuffer;
+	std::vector<G3D::Rect2D>	m_dirtyRects;
+	shared_ptr<G3D::Texture>	m_exposed;
+	/** Bytes uploaded to m_framebuffer over the current pass, and at most in one frame */
+	long long			m_passUploadBytes;
+	long long			m_maxFrameUploadBytes;
+
+	/** Uploads the parts of the renderer's image that changed since the last call */
+	void updateFramebuffer();
+
+	/** Exposes the renderer's image into m_result */
+	void postProcess();
+
+	/** Prints the pool's stats for the pass that just finished and the heap allocations per frame during it */
+	void printPassStats();
 
     /** Called from onInit() */
     void makeGUI();
 
-    /** Trace a whole image. */
-    void rayTraceImage(int numRays);
-	void fastColor();
-	void slowColor();
-	void renderFirstFrame();
-	void calculateNeighborDiff();
-
     /** Show a full-screen message */
     void message(const std::string& msg) const;
 
 	G3D::Radiance3 performDof(const G3D::Ray& ray, World* world);
 
-	void start_threads();
-	void check_threads();
+	/** Moves the camera on a fixed script and reports move-to-first-pixel latency; see latencyBenchmarkMoves */
+	void runLatencyBenchmark();
 
 public:
-	static enum render_mode { START, INITIAL, FAST_COLOR, SLOW_COLOR, FINISH, SORT, SORT_WAITING, NONE };
+	static enum render_mode { START, INITIAL, FAST_COLOR, SLOW_COLOR, FINISH, SORT, SORT_WAITING, REFINE, RETRACE, NONE };
 
 	render_mode current_mode;
 
-	/** Used to pass information from rayTraceImage() to trace() */
-    shared_ptr<G3D::Image3>		m_currentImage;
 	World*						m_world;
-	/** Used to pass information from rayTraceImage() to trace() */
-    int							m_currentRays;
 	shared_ptr<G3D::Texture>	m_result;
-	int							smallDiffStart;
-	G3D::ThreadSet				threads;
-	G3D::GMutex					order_lock;
-	G3D::GMutex					diff_lock;
-	float						threshold;
-
-	//std::priority_queue<QuadTree*, std::vector<QuadTree*>, QuadTreeComparator> *render_queue;
-	std::vector<QuadTree*> render_order;
-	std::vector<QuadTree*> *tmp_render_order;
+	/** The passes of each frame, run on its pool and started from onGraphics */
+	Renderer					*renderer;
+	/** Number of scripted camera moves still to make.  Zero disables the latency benchmark. */
+	int							latencyBenchmarkMoves;
+	/** Run the packet tracing benchmark once the world has loaded, then exit */
+	bool						packetBenchmark;
+	/** Compare the BVH against G3D::TriTree once the world has loaded, then exit */
+	bool						bvhBenchmark;
+	/** Compare inline and batched shadow rays once the world has loaded, then exit */
+	bool						shadowBenchmark;
+	/** Compare recursive and wavefront path tracing once the world has loaded, then exit */
+	bool						wavefrontBenchmark;
+	/** Compare full and compact triangle storage on the scene copied 16 times once the world has loaded, then exit */
+	bool						compactBenchmark;
+	/** Compare a flat BVH over every placed triangle against the world's mesh and instance BVHs once the world has loaded, then exit */
+	bool						instanceBenchmark;
+	/** Move instances frame by frame, refitting and re-tracing what saw them, once the world has loaded, then exit */
+	bool						refitBenchmark;
+	/** The scene file onInit() loads; see World */
+	std::string					sceneFile;
+	/** Map the scene's BVH from World::CACHE_DIRECTORY when an earlier run left it there */
+	bool						useCache;
+	/** Quantize the BVH's triangles to its leaves; see BVH::setCompact */
+	bool						compact;
+	/** Seconds after a camera move to stop refining even if the frame has not converged; zero means never */
+	double						refineBudget;
 
     App(const GApp::Settings& settings = GApp::Settings());
 
@@ -95,14 +140,10 @@ public:
 
     virtual void onGraphics(G3D::RenderDevice* rd, G3D::Array<shared_ptr<G3D::Surface> >& posed3D, G3D::Array<shared_ptr<G3D::Surface2D> >& posed2D);
     virtual void onCleanup();
-
-	/** Trace a single ray backwards. */
-    G3D::Radiance3 rayTrace(const G3D::Ray& ray, World* world, int bounces = 1);
+	virtual bool onEvent(const G3D::GEvent& event);
 
 	shared_ptr<G3D::Camera> getDebugCamera() { return m_debugCamera; }
 	shared_ptr<G3D::Film> getFilm() { return m_film; }
-
-	void sort_render_order();
 };
 
 #endif
@@ -0,0 +1,1052 @@
+#include "BVH.h"
+#include "ParallelFor.h"
+
+#include <G3D/debugPrintf.h>
+
+#include <algorithm>
+#include <atomic>
+#include <climits>
+#include <cstring>
+#include <cstdio>
+#include <xmmintrin.h>
+#include <emmintrin.h>
+
+#ifdef _WIN32
+#	include <process.h>
+#	define getpid _getpid
+#else
+#	include <unistd.h>
+#endif
+
+
+RayPacket::RayPacket() : count(0), nodesVisited(0)
+{
+}
+
+void RayPacket::set(int lane, const G3D::Ray& ray, float maxDistance) {
+	this->ox[lane] = ray.origin().x;
+	this->oy[lane] = ray.origin().y;
+	this->oz[lane] = ray.origin().z;
+	this->dx[lane] = ray.direction().x;
+	this->dy[lane] = ray.direction().y;
+	this->dz[lane] = ray.direction().z;
+	this->tMax[lane] = maxDistance;
+}
+
+namespace {
+
+const float TRI_EPSILON = 1e-7f;
+const float MIN_T		= 1e-5f;
+
+const int SAH_BINS		= 16;
+/** No more than this many threads bin a single node */
+const int MAX_BUILD_CHUNKS	= 64;
+
+/** Bumped whenever the layout of the tree or of its file changes, so older files are rebuilt */
+const unsigned int FILE_VERSION	= 3;
+const char FILE_MAGIC[8]		= { 'P', 'R', 'T', 'B', 'V', 'H', 0, 0 };
+/** Every array of the file starts on a cache line */
+const unsigned long long FILE_ALIGNMENT = 64;
+
+struct FileHeader {
+	char				magic[8];
+	unsigned int		version;
+	unsigned int		nodeSize;
+	/** Whether the triangles are quantized; see BVH::setCompact */
+	unsigned int		compact;
+	unsigned long long	key;
+	long long			nodeCount;
+	long long			triCount;
+	/** Offsets from the start of the file */
+	unsigned long long	nodeOffset;
+	unsigned long long	triOffset;
+	unsigned long long	indexOffset;
+	unsigned long long	fileSize;
+};
+
+/** Whether count elements of elementSize bytes starting at offset end at or before end, without overflowing */
+bool arrayFits(unsigned long long offset, long long count, unsigned long long elementSize, unsigned long long end) {
+	return count >= 0 && offset <= end && (unsigned long long)count <= (end - offset) / elementSize;
+}
+
+unsigned long long alignOffset(unsigned long long offset) {
+	return (offset + FILE_ALIGNMENT - 1) & ~(FILE_ALIGNMENT - 1);
+}
+
+/** Writes size bytes of data at offset, padding with zeros from position */
+bool writeAt(FILE *file, unsigned long long& position, unsigned long long offset, const void *data, size_t size) {
+	static const char zeros[FILE_ALIGNMENT] = { 0 };
+	if(offset > position && fwrite(zeros, 1, (size_t)(offset - position), file) != offset - position){
+		return false;
+	}
+	position = offset + size;
+	return size == 0 || fwrite(data, 1, size, file) == size;
+}
+
+struct CentroidLess {
+	const std::vector<G3D::Vector3> *centroids;
+	int axis;
+
+	bool operator()(int left, int right) const {
+		return (*centroids)[left][axis] < (*centroids)[right][axis];
+	}
+};
+
+struct Bin {
+	G3D::Vector3 lo, hi;
+	int count;
+
+	void clear() {
+		lo = G3D::Vector3(G3D::finf(), G3D::finf(), G3D::finf());
+		hi = -lo;
+		count = 0;
+	}
+
+	void merge(const Bin& other) {
+		lo = lo.min(other.lo);
+		hi = hi.max(other.hi);
+		count += other.count;
+	}
+};
+
+struct Bounds {
+	G3D::Vector3 lo, hi;
+	G3D::Vector3 centroidLo, centroidHi;
+
+	void merge(const Bounds& other) {
+		lo = lo.min(other.lo);
+		hi = hi.max(other.hi);
+		centroidLo = centroidLo.min(other.centroidLo);
+		centroidHi = centroidHi.max(other.centroidHi);
+	}
+};
+
+inline int chunkBegin(int begin, int end, int chunk, int chunks) {
+	return begin + (int)((long long)(end - begin) * chunk / chunks);
+}
+
+template<class BuildInput>
+Bounds rangeBounds(const std::vector<int>& order, const BuildInput& input, int begin, int end) {
+	Bounds bounds;
+	bounds.lo = bounds.centroidLo = G3D::Vector3(G3D::finf(), G3D::finf(), G3D::finf());
+	bounds.hi = bounds.centroidHi = -bounds.lo;
+	for(int i = begin; i < end; i++){
+		int t = order[i];
+		bounds.lo = bounds.lo.min(input.lo[t]);
+		bounds.hi = bounds.hi.max(input.hi[t]);
+		bounds.centroidLo = bounds.centroidLo.min(input.centroids[t]);
+		bounds.centroidHi = bounds.centroidHi.max(input.centroids[t]);
+	}
+	return bounds;
+}
+
+template<class Node>
+void appendSubtree(std::vector<Node>& nodes, const std::vector<Node>& subtree) {
+	int base = nodes.size();
+	for(int i = 0; i < subtree.size(); i++){
+		nodes.push_back(subtree[i]);
+		if(subtree[i].count == 0){
+			nodes.back().offset += base;
+		}
+	}
+}
+
+inline float halfArea(const G3D::Vector3& lo, const G3D::Vector3& hi) {
+	G3D::Vector3 d = hi - lo;
+	return d.x * d.y + d.y * d.z + d.z * d.x;
+}
+
+inline int binIndex(float centroid, float lo, float scale, int bins) {
+	int b = (int)((centroid - lo) * scale);
+	return b < 0 ? 0 : (b >= bins ? bins - 1 : b);
+}
+
+template<class BuildInput>
+void binRange(Bin *bins, const std::vector<int>& order, const BuildInput& input, int begin, int end, int axis, float lo, float scale) {
+	for(int b = 0; b < SAH_BINS; b++){
+		bins[b].clear();
+	}
+	for(int i = begin; i < end; i++){
+		int t = order[i];
+		Bin& bin = bins[binIndex(input.centroids[t][axis], lo, scale, SAH_BINS)];
+		bin.lo = bin.lo.min(input.lo[t]);
+		bin.hi = bin.hi.max(input.hi[t]);
+		bin.count++;
+	}
+}
+
+struct InLeftBins {
+	const std::vector<G3D::Vector3> *centroids;
+	int axis;
+	float lo, scale;
+	int lastBin;
+
+	bool operator()(int t) const {
+		return binIndex((*centroids)[t][axis], lo, scale, SAH_BINS) <= lastBin;
+	}
+};
+
+inline __m128 select(__m128 mask, __m128 a, __m128 b) {
+	return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b));
+}
+
+/** Four rays of a packet, in registers */
+struct Lanes {
+	__m128 ox, oy, oz;
+	__m128 dx, dy, dz;
+	__m128 idx, idy, idz;
+	__m128 tMax;
+};
+
+}
+
+BVH::BVH(void) :
+	m_nodes(NULL),
+	m_ownedNodes(NULL),
+	m_nodeCount(0),
+	m_triCount(0),
+	m_triIndex(NULL),
+	m_compact(false),
+	m_quantized(NULL)
+{
+	this->setTriangles(NULL, NULL);
+}
+
+BVH::~BVH(void)
+{
+	this->releaseStorage();
+}
+
+void BVH::releaseStorage() {
+	if(this->m_ownedNodes != NULL){
+		_mm_free(this->m_ownedNodes);
+		this->m_ownedNodes = NULL;
+	}
+	std::vector<float>().swap(this->m_triStorage);
+	std::vector<int>().swap(this->m_triIndexStorage);
+	std::vector<unsigned short>().swap(this->m_quantizedStorage);
+	this->m_quantized = NULL;
+	this->m_mapping.close();
+}
+
+void BVH::setTriangles(const float *data, const int *triIndex) {
+	const float **arrays[9] = { &this->m_v0x, &this->m_v0y, &this->m_v0z, &this->m_e1x, &this->m_e1y, &this->m_e1z,
+		&this->m_e2x, &this->m_e2y, &this->m_e2z };
+	for(int a = 0; a < 9; a++){
+		*arrays[a] = (data != NULL) ? data + a * this->m_triCount : NULL;
+	}
+	this->m_triIndex = triIndex;
+}
+
+bool BVH::isMapped() const {
+	return this->m_mapping.isOpen();
+}
+
+void BVH::setCompact(bool compact) {
+	this->m_compact = compact;
+}
+
+bool BVH::compact() const {
+	return this->m_compact;
+}
+
+inline void BVH::leafTriangles(const Node& node, Leaf& leaf) const {
+	leaf.triIndex = this->m_triIndex + node.offset;
+	if(this->m_quantized == NULL){
+		leaf.v0x = this->m_v0x + node.offset; leaf.v0y = this->m_v0y + node.offset; leaf.v0z = this->m_v0z + node.offset;
+		leaf.e1x = this->m_e1x + node.offset; leaf.e1y = this->m_e1y + node.offset; leaf.e1z = this->m_e1z + node.offset;
+		leaf.e2x = this->m_e2x + node.offset; leaf.e2y = this->m_e2y + node.offset; leaf.e2z = this->m_e2z + node.offset;
+		return;
+	}
+
+	float scale[3];
+	for(int a = 0; a < 3; a++){
+		scale[a] = (node.hi[a] - node.lo[a]) * (1.0f / 65535.0f);
+	}
+	const unsigned short *q = this->m_quantized + 9 * node.offset;
+	for(int i = 0; i < node.count; i++, q += 9){
+		for(int a = 0; a < 3; a++){
+			float p0 = node.lo[a] + q[a] * scale[a];
+			leaf.scratch[a][i] = p0;
+			leaf.scratch[3 + a][i] = node.lo[a] + q[3 + a] * scale[a] - p0;
+			leaf.scratch[6 + a][i] = node.lo[a] + q[6 + a] * scale[a] - p0;
+		}
+	}
+	leaf.v0x = leaf.scratch[0]; leaf.v0y = leaf.scratch[1]; leaf.v0z = leaf.scratch[2];
+	leaf.e1x = leaf.scratch[3]; leaf.e1y = leaf.scratch[4]; leaf.e1z = leaf.scratch[5];
+	leaf.e2x = leaf.scratch[6]; leaf.e2y = leaf.scratch[7]; leaf.e2z = leaf.scratch[8];
+}
+
+bool BVH::bounds(G3D::Vector3& lo, G3D::Vector3& hi) const {
+	if(this->m_nodeCount == 0){
+		return false;
+	}
+	lo = G3D::Vector3(this->m_nodes[0].lo[0], this->m_nodes[0].lo[1], this->m_nodes[0].lo[2]);
+	hi = G3D::Vector3(this->m_nodes[0].hi[0], this->m_nodes[0].hi[1], this->m_nodes[0].hi[2]);
+	return true;
+}
+
+int BVH::nodeCount() const {
+	return this->m_nodeCount;
+}
+
+int BVH::triangleCount() const {
+	return this->m_triCount;
+}
+
+size_t BVH::memoryFootprint() const {
+	size_t triangle = (this->m_quantized != NULL) ? 9 * sizeof(unsigned short) : 9 * sizeof(float);
+	return this->m_nodeCount * sizeof(Node) + this->m_triCount * (triangle + sizeof(int));
+}
+
+void BVH::build(const G3D::Array<G3D::Tri>& tris, const G3D::CPUVertexArray& vertexArray, int numThreads) {
+	std::vector<G3D::Vector3> positions(3 * tris.size());
+	parallelFor(0, tris.size(), [&](int begin, int end) {
+		for(int i = begin; i < end; i++){
+			for(int k = 0; k < 3; k++){
+				positions[3 * i + k] = tris[i].position(vertexArray, k);
+			}
+		}
+	}, 4096, numThreads);
+	this->build(positions, numThreads);
+}
+
+void BVH::build(const std::vector<G3D::Vector3>& positions, int numThreads) {
+	if(numThreads <= 0){
+		numThreads = (int)std::thread::hardware_concurrency();
+	}
+	if(numThreads <= 0){
+		numThreads = 4;
+	}
+
+	int count = positions.size() / 3;
+	BuildInput input;
+	input.lo.resize(count);
+	input.hi.resize(count);
+	input.centroids.resize(count);
+	std::vector<int> order(count);
+
+	parallelFor(0, count, [&](int begin, int end) {
+		for(int i = begin; i < end; i++){
+			const G3D::Vector3& v0 = positions[3 * i];
+			const G3D::Vector3& v1 = positions[3 * i + 1];
+			const G3D::Vector3& v2 = positions[3 * i + 2];
+			input.lo[i] = v0.min(v1).min(v2);
+			input.hi[i] = v0.max(v1).max(v2);
+			input.centroids[i] = (input.lo[i] + input.hi[i]) * 0.5f;
+			order[i] = i;
+		}
+	}, 4096, numThreads);
+
+	std::vector<Node> nodes;
+	nodes.reserve(2 * count);
+	if(count > 0){
+		buildRecursive(nodes, order, input, 0, count, 0, numThreads);
+	}
+
+	// Copy into 32-byte aligned storage so no node straddles a cache line
+	this->releaseStorage();
+	this->m_nodeCount = nodes.size();
+	this->m_nodes = NULL;
+	if(this->m_nodeCount > 0){
+		this->m_ownedNodes = (Node*)_mm_malloc(this->m_nodeCount * sizeof(Node), 32);
+		memcpy(this->m_ownedNodes, &nodes[0], this->m_nodeCount * sizeof(Node));
+		this->m_nodes = this->m_ownedNodes;
+	}
+
+	this->m_triCount = count;
+	this->m_triIndexStorage.resize(count);
+	if(this->m_compact){
+		this->buildQuantized(positions, order, numThreads);
+		return;
+	}
+	this->m_triStorage.resize(9 * count);
+	float *v0x = this->m_triStorage.data(), *v0y = v0x + count, *v0z = v0y + count;
+	float *e1x = v0z + count, *e1y = e1x + count, *e1z = e1y + count;
+	float *e2x = e1z + count, *e2y = e2x + count, *e2z = e2y + count;
+	int *triIndex = this->m_triIndexStorage.data();
+	parallelFor(0, count, [&](int begin, int end) {
+		for(int i = begin; i < end; i++){
+			int t = order[i];
+			const G3D::Vector3& v0 = positions[3 * t];
+			G3D::Vector3 e1 = positions[3 * t + 1] - v0;
+			G3D::Vector3 e2 = positions[3 * t + 2] - v0;
+			v0x[i] = v0.x; v0y[i] = v0.y; v0z[i] = v0.z;
+			e1x[i] = e1.x; e1y[i] = e1.y; e1z[i] = e1.z;
+			e2x[i] = e2.x; e2y[i] = e2.y; e2z[i] = e2.z;
+			triIndex[i] = t;
+		}
+	}, 4096, numThreads);
+	this->setTriangles(this->m_triStorage.data(), triIndex);
+}
+
+void BVH::buildQuantized(const std::vector<G3D::Vector3>& positions, const std::vector<int>& order, int numThreads) {
+	this->m_quantizedStorage.resize(9 * this->m_triCount);
+	unsigned short *quantized = this->m_quantizedStorage.data();
+	int *triIndex = this->m_triIndexStorage.data();
+	const Node *nodes = this->m_nodes;
+	parallelFor(0, this->m_nodeCount, [&](int begin, int end) {
+		for(int n = begin; n < end; n++){
+			const Node& node = nodes[n];
+			for(int i = node.offset; node.count > 0 && i < node.offset + node.count; i++){
+				int t = order[i];
+				for(int k = 0; k < 3; k++){
+					for(int a = 0; a < 3; a++){
+						float extent = node.hi[a] - node.lo[a];
+						float f = (extent > 0.0f) ? (positions[3 * t + k][a] - node.lo[a]) / extent : 0.0f;
+						quantized[9 * i + 3 * k + a] = (unsigned short)G3D::iClamp((int)(f * 65535.0f + 0.5f), 0, 65535);
+					}
+				}
+				triIndex[i] = t;
+			}
+		}
+	}, 4096, numThreads);
+	this->m_quantized = quantized;
+	this->setTriangles(NULL, triIndex);
+}
+
+bool BVH::save(const std::string& filename, unsigned long long key) const {
+	FileHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, FILE_MAGIC, sizeof(FILE_MAGIC));
+	header.version = FILE_VERSION;
+	header.nodeSize = sizeof(Node);
+	header.compact = (this->m_quantized != NULL) ? 1 : 0;
+	header.key = key;
+	header.nodeCount = this->m_nodeCount;
+	header.triCount = this->m_triCount;
+	header.nodeOffset = alignOffset(sizeof(FileHeader));
+	header.triOffset = alignOffset(header.nodeOffset + header.nodeCount * sizeof(Node));
+	header.indexOffset = alignOffset(header.triOffset + 9 * header.triCount * (header.compact ? sizeof(unsigned short) : sizeof(float)));
+	header.fileSize = header.indexOffset + header.triCount * sizeof(int);
+
+	// Unique to this process, so two processes building the same tree cannot interleave their writes
+	char suffix[32];
+	sprintf(suffix, ".%d.tmp", (int)getpid());
+	std::string temporary = filename + suffix;
+	FILE *file = fopen(temporary.c_str(), "wb");
+	if(file == NULL){
+		return false;
+	}
+	unsigned long long position = 0;
+	bool ok = writeAt(file, position, 0, &header, sizeof(header)) &&
+		writeAt(file, position, header.nodeOffset, this->m_nodes, this->m_nodeCount * sizeof(Node));
+	if(header.compact){
+		ok = ok && writeAt(file, position, header.triOffset, this->m_quantized, 9 * this->m_triCount * sizeof(unsigned short));
+	} else {
+		const float *arrays[9] = { this->m_v0x, this->m_v0y, this->m_v0z, this->m_e1x, this->m_e1y, this->m_e1z, this->m_e2x, this->m_e2y, this->m_e2z };
+		for(int a = 0; a < 9 && ok; a++){
+			ok = writeAt(file, position, header.triOffset + a * header.triCount * sizeof(float), arrays[a], this->m_triCount * sizeof(float));
+		}
+	}
+	ok = ok && writeAt(file, position, header.indexOffset, this->m_triIndex, this->m_triCount * sizeof(int));
+	ok = (fclose(file) == 0) && ok;
+
+	// rename() will not replace an existing file on Windows
+	if(ok){
+		remove(filename.c_str());
+		ok = (rename(temporary.c_str(), filename.c_str()) == 0);
+	}
+	if(!ok){
+		remove(temporary.c_str());
+	}
+	return ok;
+}
+
+bool BVH::load(const std::string& filename, unsigned long long key) {
+	MappedFile mapping;
+	if(!mapping.open(filename) || mapping.size() < sizeof(FileHeader)){
+		return false;
+	}
+	FileHeader header;
+	memcpy(&header, mapping.data(), sizeof(header));
+	if(memcmp(header.magic, FILE_MAGIC, sizeof(FILE_MAGIC)) != 0 || header.version != FILE_VERSION || header.nodeSize != sizeof(Node) ||
+		header.compact != (this->m_compact ? 1u : 0u) || header.key != key || header.fileSize != mapping.size() ||
+		header.nodeCount < 0 || header.nodeCount > INT_MAX || header.triCount < 0 || header.triCount > INT_MAX){
+		return false;
+	}
+	// Check every array fits and then every node and index, so a damaged file is rebuilt instead of traced out of bounds
+	if(!arrayFits(header.nodeOffset, header.nodeCount, sizeof(Node), header.triOffset) ||
+		!arrayFits(header.triOffset, 9 * header.triCount, header.compact ? sizeof(unsigned short) : sizeof(float), header.indexOffset) ||
+		!arrayFits(header.indexOffset, header.triCount, sizeof(int), header.fileSize) ||
+		(header.nodeOffset | header.triOffset | header.indexOffset) % FILE_ALIGNMENT != 0){
+		return false;
+	}
+	const unsigned char *contents = mapping.data();
+	if(!validTree((const Node*)(contents + header.nodeOffset), (int)header.nodeCount, (const int*)(contents + header.indexOffset), (int)header.triCount)){
+		return false;
+	}
+
+	this->releaseStorage();
+	this->m_mapping.swap(mapping);
+	const unsigned char *data = this->m_mapping.data();
+	this->m_nodeCount = (int)header.nodeCount;
+	this->m_triCount = (int)header.triCount;
+	this->m_nodes = (const Node*)(data + header.nodeOffset);
+	if(header.compact){
+		this->m_quantized = (const unsigned short*)(data + header.triOffset);
+		this->setTriangles(NULL, (const int*)(data + header.indexOffset));
+	} else {
+		this->setTriangles((const float*)(data + header.triOffset), (const int*)(data + header.indexOffset));
+	}
+	return true;
+}
+
+bool BVH::validTree(const Node *nodes, int nodeCount, const int *triIndex, int triCount) {
+	if((nodeCount == 0) != (triCount == 0)){
+		return false;
+	}
+
+	// Children always follow their parents, so one pass in order sees each node's depth before its children
+	std::vector<unsigned char> depths(nodeCount, 0);
+	for(int n = 0; n < nodeCount; n++){
+		const Node& node = nodes[n];
+		if(node.count > 0){
+			if(node.offset < 0 || node.offset > triCount - node.count){
+				return false;
+			}
+			continue;
+		}
+		// A trace holds at most the depth of an internal node plus its two children
+		if(node.offset <= n + 1 || node.offset >= nodeCount || node.axis > 2 || depths[n] + 2 > STACK_SIZE){
+			return false;
+		}
+		unsigned char depth = (unsigned char)(depths[n] + 1);
+		depths[n + 1] = G3D::max(depths[n + 1], depth);
+		depths[node.offset] = G3D::max(depths[node.offset], depth);
+	}
+
+	std::atomic<bool> valid(true);
+	parallelFor(0, triCount, [&](int begin, int end) {
+		for(int i = begin; i < end; i++){
+			if(triIndex[i] < 0 || triIndex[i] >= triCount){
+				valid = false;
+				return;
+			}
+		}
+	}, 1 << 16);
+	return valid;
+}
+
+int BVH::buildRecursive(std::vector<Node>& nodes, std::vector<int>& order, const BuildInput& input, int begin, int end, int depth, int numThreads) {
+	int chunks = (end - begin >= PARALLEL_BINNING_SIZE) ? (numThreads < MAX_BUILD_CHUNKS ? numThreads : MAX_BUILD_CHUNKS) : 1;
+	Bounds box;
+	if(chunks > 1){
+		std::vector<Bounds> bounds(chunks);
+		parallelFor(0, chunks, [&](int c0, int c1) {
+			for(int c = c0; c < c1; c++){
+				bounds[c] = rangeBounds(order, input, chunkBegin(begin, end, c, chunks), chunkBegin(begin, end, c + 1, chunks));
+			}
+		}, 1, chunks);
+		box = bounds[0];
+		for(int c = 1; c < chunks; c++){
+			box.merge(bounds[c]);
+		}
+	} else {
+		box = rangeBounds(order, input, begin, end);
+	}
+
+	int index = nodes.size();
+	Node node;
+	for(int a = 0; a < 3; a++){
+		node.lo[a] = box.lo[a];
+		node.hi[a] = box.hi[a];
+	}
+	node.offset = begin;
+	node.count = end - begin;
+	node.axis = 0;
+	nodes.push_back(node);
+
+	if(end - begin == 1){
+		return index;
+	}
+
+	int axis;
+	int mid;
+	if(depth < MAX_SAH_DEPTH){
+		mid = sahPartition(order, input, begin, end, box.lo, box.hi, box.centroidLo, box.centroidHi, axis, chunks);
+	} else {
+		// Halve everything this deep so degenerate SAH splits cannot outgrow the traversal stacks
+		G3D::Vector3 extent = box.centroidHi - box.centroidLo;
+		axis = (extent.x > extent.y && extent.x > extent.z) ? 0 : ((extent.y > extent.z) ? 1 : 2);
+		mid = -1;
+	}
+	if(mid < 0){
+		if(end - begin <= MAX_LEAF_SIZE){
+			return index;
+		}
+		// Too many triangles for one leaf even though splitting does not pay; fall back to a median split
+		CentroidLess less;
+		less.centroids = &input.centroids;
+		less.axis = axis;
+		mid = (begin + end) / 2;
+		std::nth_element(order.begin() + begin, order.begin() + mid, order.begin() + end, less);
+	}
+
+	nodes[index].count = 0;
+	nodes[index].axis = axis;
+
+	if(numThreads > 1 && end - begin >= PARALLEL_SUBTREE_SIZE){
+		// The two halves of order are disjoint, so the left subtree can be built on another
+		// thread into its own array and then spliced in directly after this node
+		std::vector<Node> left;
+		std::vector<Node> right;
+		int leftThreads = numThreads / 2;
+		std::thread worker([&]() { buildRecursive(left, order, input, begin, mid, depth + 1, leftThreads); });
+		buildRecursive(right, order, input, mid, end, depth + 1, numThreads - leftThreads);
+		worker.join();
+
+		appendSubtree(nodes, left);
+		nodes[index].offset = nodes.size();
+		appendSubtree(nodes, right);
+		return index;
+	}
+
+	buildRecursive(nodes, order, input, begin, mid, depth + 1, 1);
+	int right = buildRecursive(nodes, order, input, mid, end, depth + 1, 1);
+	nodes[index].offset = right;
+	return index;
+}
+
+int BVH::sahPartition(std::vector<int>& order, const BuildInput& input, int begin, int end,
+	const G3D::Vector3& boxLo, const G3D::Vector3& boxHi, const G3D::Vector3& centroidLo, const G3D::Vector3& centroidHi, int& axis, int numThreads) {
+
+	G3D::Vector3 extent = centroidHi - centroidLo;
+	axis = (extent.x > extent.y && extent.x > extent.z) ? 0 : ((extent.y > extent.z) ? 1 : 2);
+	if(extent[axis] <= 0.0f){
+		return -1;
+	}
+
+	// Bin the centroids along the widest axis, each thread of a large node into its own set of bins
+	float scale = SAH_BINS / extent[axis];
+	int chunks = numThreads < MAX_BUILD_CHUNKS ? numThreads : MAX_BUILD_CHUNKS;
+	Bin bins[SAH_BINS];
+	if(chunks > 1){
+		std::vector<Bin> chunkBins(chunks * SAH_BINS);
+		parallelFor(0, chunks, [&](int c0, int c1) {
+			for(int c = c0; c < c1; c++){
+				binRange(&chunkBins[c * SAH_BINS], order, input, chunkBegin(begin, end, c, chunks), chunkBegin(begin, end, c + 1, chunks), axis, centroidLo[axis], scale);
+			}
+		}, 1, chunks);
+		for(int b = 0; b < SAH_BINS; b++){
+			bins[b] = chunkBins[b];
+			for(int c = 1; c < chunks; c++){
+				bins[b].merge(chunkBins[c * SAH_BINS + b]);
+			}
+		}
+	} else {
+		binRange(bins, order, input, begin, end, axis, centroidLo[axis], scale);
+	}
+
+	// Sweep from the right to get the cost of everything right of each plane
+	float rightCost[SAH_BINS];
+	G3D::Vector3 accLo = bins[SAH_BINS - 1].lo, accHi = bins[SAH_BINS - 1].hi;
+	int accCount = bins[SAH_BINS - 1].count;
+	for(int b = SAH_BINS - 2; b >= 0; b--){
+		rightCost[b] = accCount > 0 ? halfArea(accLo, accHi) * accCount : 0.0f;
+		accLo = accLo.min(bins[b].lo);
+		accHi = accHi.max(bins[b].hi);
+		accCount += bins[b].count;
+	}
+
+	// Then from the left, splitting after bin b
+	int best = -1;
+	float bestCost = G3D::finf();
+	accLo = bins[0].lo; accHi = bins[0].hi;
+	accCount = bins[0].count;
+	for(int b = 0; b < SAH_BINS - 1; b++){
+		if(b > 0){
+			accLo = accLo.min(bins[b].lo);
+			accHi = accHi.max(bins[b].hi);
+			accCount += bins[b].count;
+		}
+		if(accCount == 0 || accCount == end - begin){
+			continue;
+		}
+		float cost = halfArea(accLo, accHi) * accCount + rightCost[b];
+		if(cost < bestCost){
+			bestCost = cost;
+			best = b;
+		}
+	}
+
+	// One traversal step costs about as much as one triangle test
+	float leafCost = (float)(end - begin);
+	float area = halfArea(boxLo, boxHi);
+	if(best < 0 || (area > 0.0f && 1.0f + bestCost / area >= leafCost && end - begin <= MAX_LEAF_SIZE)){
+		return -1;
+	}
+
+	InLeftBins left;
+	left.centroids = &input.centroids;
+	left.axis = axis;
+	left.lo = centroidLo[axis];
+	left.scale = scale;
+	left.lastBin = best;
+	return std::partition(order.begin() + begin, order.begin() + end, left) - order.begin();
+}
+
+bool BVH::intersect(const G3D::Ray& ray, float maxDistance, Hit& hit, bool anyHit) const {
+	hit.triIndex = -1;
+	if(this->m_nodeCount == 0){
+		return false;
+	}
+
+	const float ox = ray.origin().x, oy = ray.origin().y, oz = ray.origin().z;
+	const float dx = ray.direction().x, dy = ray.direction().y, dz = ray.direction().z;
+	const float inv[3] = { 1.0f / dx, 1.0f / dy, 1.0f / dz };
+	const float origin[3] = { ox, oy, oz };
+	const bool negative[3] = { dx < 0.0f, dy < 0.0f, dz < 0.0f };
+	float tMax = maxDistance;
+
+	Leaf leaf;
+	int stack[STACK_SIZE];
+	int stackSize = 0;
+	stack[stackSize++] = 0;
+
+	while(stackSize > 0) {
+		int index = stack[--stackSize];
+		const Node& node = this->m_nodes[index];
+
+		float tNear = 0.0f;
+		float tFar = tMax;
+		for(int a = 0; a < 3; a++){
+			float t0 = (node.lo[a] - origin[a]) * inv[a];
+			float t1 = (node.hi[a] - origin[a]) * inv[a];
+			if(t0 > t1){
+				std::swap(t0, t1);
+			}
+			tNear = t0 > tNear ? t0 : tNear;
+			tFar = t1 < tFar ? t1 : tFar;
+		}
+		if(tNear > tFar){
+			continue;
+		}
+
+		if(node.count == 0){
+			debugAssertM(stackSize + 2 <= STACK_SIZE, "BVH deeper than its traversal stack");
+			if(negative[node.axis]){
+				stack[stackSize++] = index + 1;
+				stack[stackSize++] = node.offset;
+			} else {
+				stack[stackSize++] = node.offset;
+				stack[stackSize++] = index + 1;
+			}
+			continue;
+		}
+
+		this->leafTriangles(node, leaf);
+		for(int i = 0; i < node.count; i++){
+			const float e1x = leaf.e1x[i], e1y = leaf.e1y[i], e1z = leaf.e1z[i];
+			const float e2x = leaf.e2x[i], e2y = leaf.e2y[i], e2z = leaf.e2z[i];
+
+			float px = dy * e2z - dz * e2y;
+			float py = dz * e2x - dx * e2z;
+			float pz = dx * e2y - dy * e2x;
+			float det = e1x * px + e1y * py + e1z * pz;
+			if(det > -TRI_EPSILON && det < TRI_EPSILON){
+				continue;
+			}
+			float invDet = 1.0f / det;
+
+			float sx = ox - leaf.v0x[i];
+			float sy = oy - leaf.v0y[i];
+			float sz = oz - leaf.v0z[i];
+			float u = (sx * px + sy * py + sz * pz) * invDet;
+			if(u < 0.0f || u > 1.0f){
+				continue;
+			}
+
+			float qx = sy * e1z - sz * e1y;
+			float qy = sz * e1x - sx * e1z;
+			float qz = sx * e1y - sy * e1x;
+			float v = (dx * qx + dy * qy + dz * qz) * invDet;
+			if(v < 0.0f || u + v > 1.0f){
+				continue;
+			}
+
+			float t = (e2x * qx + e2y * qy + e2z * qz) * invDet;
+			if(t <= MIN_T || t >= tMax){
+				continue;
+			}
+
+			tMax = t;
+			hit.triIndex = leaf.triIndex[i];
+			hit.t = t;
+			hit.u = u;
+			hit.v = v;
+			if(anyHit){
+				return true;
+			}
+		}
+	}
+
+	return hit.triIndex >= 0;
+}
+
+void BVH::intersect8(RayPacket& packet, Hit hits[RayPacket::SIZE]) const {
+	for(int i = 0; i < RayPacket::SIZE; i++){
+		hits[i].triIndex = -1;
+	}
+	packet.nodesVisited = 0;
+	if(this->m_nodeCount == 0 || packet.count <= 0){
+		return;
+	}
+
+	// Unused lanes get a negative tMax so they never hit anything
+	for(int i = packet.count; i < RayPacket::SIZE; i++){
+		packet.set(i, G3D::Ray::fromOriginAndDirection(G3D::Point3(0, 0, 0), G3D::Vector3(1, 0, 0)), -1.0f);
+	}
+
+	Lanes lanes[2];
+	for(int h = 0; h < 2; h++){
+		Lanes& l = lanes[h];
+		l.ox = _mm_loadu_ps(packet.ox + 4 * h);
+		l.oy = _mm_loadu_ps(packet.oy + 4 * h);
+		l.oz = _mm_loadu_ps(packet.oz + 4 * h);
+		l.dx = _mm_loadu_ps(packet.dx + 4 * h);
+		l.dy = _mm_loadu_ps(packet.dy + 4 * h);
+		l.dz = _mm_loadu_ps(packet.dz + 4 * h);
+		l.idx = _mm_div_ps(_mm_set1_ps(1.0f), l.dx);
+		l.idy = _mm_div_ps(_mm_set1_ps(1.0f), l.dy);
+		l.idz = _mm_div_ps(_mm_set1_ps(1.0f), l.dz);
+		l.tMax = _mm_loadu_ps(packet.tMax + 4 * h);
+	}
+
+	const __m128 zero = _mm_setzero_ps();
+	const __m128 one = _mm_set1_ps(1.0f);
+	const __m128 epsilon = _mm_set1_ps(TRI_EPSILON);
+	const __m128 minT = _mm_set1_ps(MIN_T);
+	const __m128 absMask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+
+	// Visit the near child first, judged by the first ray of the packet
+	const bool negative[3] = { packet.dx[0] < 0.0f, packet.dy[0] < 0.0f, packet.dz[0] < 0.0f };
+
+	Leaf leaf;
+	int stack[STACK_SIZE];
+	int stackSize = 0;
+	stack[stackSize++] = 0;
+
+	while(stackSize > 0) {
+		int index = stack[--stackSize];
+		const Node& node = this->m_nodes[index];
+		packet.nodesVisited++;
+
+		// Slab test of the box against all eight rays; the node is visited if any of them hits it
+		int anyHit = 0;
+		for(int h = 0; h < 2; h++){
+			const Lanes& l = lanes[h];
+			__m128 tx0 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node.lo[0]), l.ox), l.idx);
+			__m128 tx1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node.hi[0]), l.ox), l.idx);
+			__m128 ty0 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node.lo[1]), l.oy), l.idy);
+			__m128 ty1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node.hi[1]), l.oy), l.idy);
+			__m128 tz0 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node.lo[2]), l.oz), l.idz);
+			__m128 tz1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node.hi[2]), l.oz), l.idz);
+
+			__m128 tNear = _mm_max_ps(_mm_max_ps(_mm_min_ps(tx0, tx1), _mm_min_ps(ty0, ty1)), _mm_max_ps(_mm_min_ps(tz0, tz1), zero));
+			__m128 tFar = _mm_min_ps(_mm_min_ps(_mm_max_ps(tx0, tx1), _mm_max_ps(ty0, ty1)), _mm_min_ps(_mm_max_ps(tz0, tz1), l.tMax));
+			anyHit |= _mm_movemask_ps(_mm_cmple_ps(tNear, tFar));
+		}
+		if(anyHit == 0){
+			continue;
+		}
+
+		if(node.count == 0){
+			debugAssertM(stackSize + 2 <= STACK_SIZE, "BVH deeper than its traversal stack");
+			if(negative[node.axis]){
+				stack[stackSize++] = index + 1;
+				stack[stackSize++] = node.offset;
+			} else {
+				stack[stackSize++] = node.offset;
+				stack[stackSize++] = index + 1;
+			}
+			continue;
+		}
+
+		this->leafTriangles(node, leaf);
+
+		// Moller-Trumbore against four rays at a time
+		for(int i = 0; i < node.count; i++){
+			const __m128 e1x = _mm_set1_ps(leaf.e1x[i]), e1y = _mm_set1_ps(leaf.e1y[i]), e1z = _mm_set1_ps(leaf.e1z[i]);
+			const __m128 e2x = _mm_set1_ps(leaf.e2x[i]), e2y = _mm_set1_ps(leaf.e2y[i]), e2z = _mm_set1_ps(leaf.e2z[i]);
+			const __m128 v0x = _mm_set1_ps(leaf.v0x[i]), v0y = _mm_set1_ps(leaf.v0y[i]), v0z = _mm_set1_ps(leaf.v0z[i]);
+
+			for(int h = 0; h < 2; h++){
+				Lanes& l = lanes[h];
+				__m128 px = _mm_sub_ps(_mm_mul_ps(l.dy, e2z), _mm_mul_ps(l.dz, e2y));
+				__m128 py = _mm_sub_ps(_mm_mul_ps(l.dz, e2x), _mm_mul_ps(l.dx, e2z));
+				__m128 pz = _mm_sub_ps(_mm_mul_ps(l.dx, e2y), _mm_mul_ps(l.dy, e2x));
+				__m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, px), _mm_mul_ps(e1y, py)), _mm_mul_ps(e1z, pz));
+				__m128 invDet = _mm_div_ps(one, det);
+
+				__m128 sx = _mm_sub_ps(l.ox, v0x);
+				__m128 sy = _mm_sub_ps(l.oy, v0y);
+				__m128 sz = _mm_sub_ps(l.oz, v0z);
+				__m128 u = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(sx, px), _mm_mul_ps(sy, py)), _mm_mul_ps(sz, pz)), invDet);
+
+				__m128 qx = _mm_sub_ps(_mm_mul_ps(sy, e1z), _mm_mul_ps(sz, e1y));
+				__m128 qy = _mm_sub_ps(_mm_mul_ps(sz, e1x), _mm_mul_ps(sx, e1z));
+				__m128 qz = _mm_sub_ps(_mm_mul_ps(sx, e1y), _mm_mul_ps(sy, e1x));
+				__m128 v = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(l.dx, qx), _mm_mul_ps(l.dy, qy)), _mm_mul_ps(l.dz, qz)), invDet);
+				__m128 t = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, qx), _mm_mul_ps(e2y, qy)), _mm_mul_ps(e2z, qz)), invDet);
+
+				__m128 mask = _mm_cmpgt_ps(_mm_and_ps(det, absMask), epsilon);
+				mask = _mm_and_ps(mask, _mm_cmpge_ps(u, zero));
+				mask = _mm_and_ps(mask, _mm_cmpge_ps(v, zero));
+				mask = _mm_and_ps(mask, _mm_cmple_ps(_mm_add_ps(u, v), one));
+				mask = _mm_and_ps(mask, _mm_cmpgt_ps(t, minT));
+				mask = _mm_and_ps(mask, _mm_cmplt_ps(t, l.tMax));
+
+				int bits = _mm_movemask_ps(mask);
+				if(bits == 0){
+					continue;
+				}
+				l.tMax = select(mask, t, l.tMax);
+
+				float tLanes[4], uLanes[4], vLanes[4];
+				_mm_storeu_ps(tLanes, t);
+				_mm_storeu_ps(uLanes, u);
+				_mm_storeu_ps(vLanes, v);
+				for(int k = 0; k < 4; k++){
+					if(bits & (1 << k)){
+						Hit& hit = hits[4 * h + k];
+						hit.triIndex = leaf.triIndex[i];
+						hit.t = tLanes[k];
+						hit.u = uLanes[k];
+						hit.v = vLanes[k];
+					}
+				}
+			}
+		}
+	}
+
+	for(int h = 0; h < 2; h++){
+		_mm_storeu_ps(packet.tMax + 4 * h, lanes[h].tMax);
+	}
+}
+
+void BVH::occluded8(const RayPacket& packet, bool occluded[RayPacket::SIZE]) const {
+	for(int i = 0; i < RayPacket::SIZE; i++){
+		occluded[i] = false;
+	}
+	if(this->m_nodeCount == 0 || packet.count <= 0){
+		return;
+	}
+
+	// Unused lanes start out done, with a negative tMax so they never hit anything
+	Lanes lanes[2];
+	for(int h = 0; h < 2; h++){
+		float tMax[4];
+		for(int k = 0; k < 4; k++){
+			tMax[k] = (4 * h + k < packet.count) ? packet.tMax[4 * h + k] : -1.0f;
+		}
+		Lanes& l = lanes[h];
+		l.ox = _mm_loadu_ps(packet.ox + 4 * h);
+		l.oy = _mm_loadu_ps(packet.oy + 4 * h);
+		l.oz = _mm_loadu_ps(packet.oz + 4 * h);
+		l.dx = _mm_loadu_ps(packet.dx + 4 * h);
+		l.dy = _mm_loadu_ps(packet.dy + 4 * h);
+		l.dz = _mm_loadu_ps(packet.dz + 4 * h);
+		l.idx = _mm_div_ps(_mm_set1_ps(1.0f), l.dx);
+		l.idy = _mm_div_ps(_mm_set1_ps(1.0f), l.dy);
+		l.idz = _mm_div_ps(_mm_set1_ps(1.0f), l.dz);
+		l.tMax = _mm_loadu_ps(tMax);
+	}
+	const int allLanes = (1 << packet.count) - 1;
+	int done = 0;
+
+	const __m128 zero = _mm_setzero_ps();
+	const __m128 one = _mm_set1_ps(1.0f);
+	const __m128 epsilon = _mm_set1_ps(TRI_EPSILON);
+	const __m128 minT = _mm_set1_ps(MIN_T);
+	const __m128 absMask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+	const __m128 finished = _mm_set1_ps(-1.0f);
+
+	const bool negative[3] = { packet.dx[0] < 0.0f, packet.dy[0] < 0.0f, packet.dz[0] < 0.0f };
+
+	Leaf leaf;
+	int stack[STACK_SIZE];
+	int stackSize = 0;
+	stack[stackSize++] = 0;
+
+	while(stackSize > 0 && done != allLanes) {
+		int index = stack[--stackSize];
+		const Node& node = this->m_nodes[index];
+
+		int anyHit = 0;
+		for(int h = 0; h < 2; h++){
+			const Lanes& l = lanes[h];
+			__m128 tx0 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node.lo[0]), l.ox), l.idx);
+			__m128 tx1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node.hi[0]), l.ox), l.idx);
+			__m128 ty0 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node.lo[1]), l.oy), l.idy);
+			__m128 ty1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node.hi[1]), l.oy), l.idy);
+			__m128 tz0 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node.lo[2]), l.oz), l.idz);
+			__m128 tz1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node.hi[2]), l.oz), l.idz);
+
+			__m128 tNear = _mm_max_ps(_mm_max_ps(_mm_min_ps(tx0, tx1), _mm_min_ps(ty0, ty1)), _mm_max_ps(_mm_min_ps(tz0, tz1), zero));
+			__m128 tFar = _mm_min_ps(_mm_min_ps(_mm_max_ps(tx0, tx1), _mm_max_ps(ty0, ty1)), _mm_min_ps(_mm_max_ps(tz0, tz1), l.tMax));
+			anyHit |= _mm_movemask_ps(_mm_cmple_ps(tNear, tFar));
+		}
+		if(anyHit == 0){
+			continue;
+		}
+
+		if(node.count == 0){
+			debugAssertM(stackSize + 2 <= STACK_SIZE, "BVH deeper than its traversal stack");
+			if(negative[node.axis]){
+				stack[stackSize++] = index + 1;
+				stack[stackSize++] = node.offset;
+			} else {
+				stack[stackSize++] = node.offset;
+				stack[stackSize++] = index + 1;
+			}
+			continue;
+		}
+
+		this->leafTriangles(node, leaf);
+		for(int i = 0; i < node.count && done != allLanes; i++){
+			const __m128 e1x = _mm_set1_ps(leaf.e1x[i]), e1y = _mm_set1_ps(leaf.e1y[i]), e1z = _mm_set1_ps(leaf.e1z[i]);
+			const __m128 e2x = _mm_set1_ps(leaf.e2x[i]), e2y = _mm_set1_ps(leaf.e2y[i]), e2z = _mm_set1_ps(leaf.e2z[i]);
+			const __m128 v0x = _mm_set1_ps(leaf.v0x[i]), v0y = _mm_set1_ps(leaf.v0y[i]), v0z = _mm_set1_ps(leaf.v0z[i]);
+
+			for(int h = 0; h < 2; h++){
+				Lanes& l = lanes[h];
+				__m128 px = _mm_sub_ps(_mm_mul_ps(l.dy, e2z), _mm_mul_ps(l.dz, e2y));
+				__m128 py = _mm_sub_ps(_mm_mul_ps(l.dz, e2x), _mm_mul_ps(l.dx, e2z));
+				__m128 pz = _mm_sub_ps(_mm_mul_ps(l.dx, e2y), _mm_mul_ps(l.dy, e2x));
+				__m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, px), _mm_mul_ps(e1y, py)), _mm_mul_ps(e1z, pz));
+				__m128 invDet = _mm_div_ps(one, det);
+
+				__m128 sx = _mm_sub_ps(l.ox, v0x);
+				__m128 sy = _mm_sub_ps(l.oy, v0y);
+				__m128 sz = _mm_sub_ps(l.oz, v0z);
+				__m128 u = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(sx, px), _mm_mul_ps(sy, py)), _mm_mul_ps(sz, pz)), invDet);
+
+				__m128 qx = _mm_sub_ps(_mm_mul_ps(sy, e1z), _mm_mul_ps(sz, e1y));
+				__m128 qy = _mm_sub_ps(_mm_mul_ps(sz, e1x), _mm_mul_ps(sx, e1z));
+				__m128 qz = _mm_sub_ps(_mm_mul_ps(sx, e1y), _mm_mul_ps(sy, e1x));
+				__m128 v = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(l.dx, qx), _mm_mul_ps(l.dy, qy)), _mm_mul_ps(l.dz, qz)), invDet);
+				__m128 t = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, qx), _mm_mul_ps(e2y, qy)), _mm_mul_ps(e2z, qz)), invDet);
+
+				__m128 mask = _mm_cmpgt_ps(_mm_and_ps(det, absMask), epsilon);
+				mask = _mm_and_ps(mask, _mm_cmpge_ps(u, zero));
+				mask = _mm_and_ps(mask, _mm_cmpge_ps(v, zero));
+				mask = _mm_and_ps(mask, _mm_cmple_ps(_mm_add_ps(u, v), one));
+				mask = _mm_and_ps(mask, _mm_cmpgt_ps(t, minT));
+				mask = _mm_and_ps(mask, _mm_cmplt_ps(t, l.tMax));
+
+				int bits = _mm_movemask_ps(mask);
+				if(bits == 0){
+					continue;
+				}
+				// An occluded ray is finished: a negative tMax keeps it out of every box and triangle
+				l.tMax = select(mask, finished, l.tMax);
+				done |= bits << (4 * h);
+			}
+		}
+	}
+
+	for(int i = 0; i < packet.count; i++){
+		occluded[i] = (done & (1 << i)) != 0;
+	}
+}
@@ -0,0 +1,186 @@
+#pragma once
+#include <G3D/Array.h>
+#include <G3D/Vector3.h>
+#include <G3D/Ray.h>
+
+#include <GLG3D/Tri.h>
+#include <GLG3D/CPUVertexArray.h>
+
+#include <vector>
+#include <string>
+
+#include "MappedFile.h"
+
+/**
+  A bundle of RayPacket::SIZE rays stored structure-of-arrays, so each
+  coordinate of four rays fits one SSE register.  Lanes past count are
+  ignored.
+ */
+struct RayPacket {
+	static const int SIZE = 8;
+
+	float ox[SIZE], oy[SIZE], oz[SIZE];
+	float dx[SIZE], dy[SIZE], dz[SIZE];
+	/** On input the maximum distance of each ray; on output the distance to its hit */
+	float tMax[SIZE];
+	int count;
+	/** Set by BVH::intersect8 to the number of nodes the packet was tested against */
+	int nodesVisited;
+
+	RayPacket();
+	void set(int lane, const G3D::Ray& ray, float maxDistance);
+};
+
+/**
+  Bounding volume hierarchy over the triangles of a World, used for all CPU
+  tracing.
+
+  Built top-down with a binned surface area heuristic.  Nodes are 32 bytes,
+  32-byte aligned and stored depth first, so the left child of a node is the
+  next node in memory.  Triangles are stored structure-of-arrays as a vertex
+  and two precomputed edges, in leaf order.
+
+  With setCompact(), each triangle is instead stored as its three vertices
+  quantized to 16 bits per coordinate within the bounds of its leaf, 22 bytes
+  with its index instead of 40, and decoded when the leaf is visited.  The
+  decoded vertices are within 1/65535 of the leaf's extent of the originals,
+  so a hit may move by that much and triangles that share an edge across two
+  leaves may leave a crack that narrow between them.
+
+  A built tree can be saved to a file and mapped back by load() instead of
+  being built again.  Everything in the file is found by offsets from its
+  start, so the mapping is traced in place, wherever it lands.
+ */
+class BVH
+{
+public:
+	/** Triangle index into the array given to build(); -1 when nothing was hit */
+	struct Hit {
+		int triIndex;
+		float t, u, v;
+	};
+
+	BVH(void);
+	~BVH(void);
+
+	void build(const G3D::Array<G3D::Tri>& tris, const G3D::CPUVertexArray& vertexArray, int numThreads = 0);
+
+	/** Builds over the triangles (positions[3i], positions[3i + 1], positions[3i + 2]).  Subtrees
+		and the binning of large nodes are spread over numThreads threads, zero meaning one per
+		hardware thread; the tree is the same for any thread count. */
+	void build(const std::vector<G3D::Vector3>& positions, int numThreads = 0);
+
+	/** Closest hit closer than maxDistance, or with anyHit the first one found.  Returns false on a miss. */
+	bool intersect(const G3D::Ray& ray, float maxDistance, Hit& hit, bool anyHit = false) const;
+
+	/** Closest hit for every ray of the packet, traversing the tree once for the whole packet */
+	void intersect8(RayPacket& packet, Hit hits[RayPacket::SIZE]) const;
+
+	/** Whether anything is closer than tMax along each ray of the packet.  Only looks for any
+		hit: a ray drops out of the traversal at its first one, and the packet at the last. */
+	void occluded8(const RayPacket& packet, bool occluded[RayPacket::SIZE]) const;
+
+	/** Writes the tree to filename, tagged with key, through a temporary file so a process
+		loading it never sees half of it.  Returns false if it cannot be written. */
+	bool save(const std::string& filename, unsigned long long key) const;
+
+	/** Replaces the tree with a view of a file written by save() with the same key and this
+		build's file format.  Returns false, leaving the tree alone, otherwise. */
+	bool load(const std::string& filename, unsigned long long key);
+
+	/** Whether the tree is a file mapped by load() */
+	bool isMapped() const;
+
+	/** Store triangles quantized to their leaves from the next build() on.  load() only accepts
+		files saved with the same setting. */
+	void setCompact(bool compact);
+	bool compact() const;
+
+	/** The box around every triangle.  Returns false for an empty tree. */
+	bool bounds(G3D::Vector3& lo, G3D::Vector3& hi) const;
+
+	int nodeCount() const;
+	int triangleCount() const;
+	size_t memoryFootprint() const;
+
+private:
+	const static int MAX_LEAF_SIZE	= 8;
+	/** Entries in the traversal stacks; a trace never holds more than the tree depth plus one */
+	const static int STACK_SIZE		= 64;
+	/** Nodes deeper than this split at the median, so no tree is deeper than
+		MAX_SAH_DEPTH + log2(2^31 / MAX_LEAF_SIZE) < STACK_SIZE */
+	const static int MAX_SAH_DEPTH	= 32;
+	/** Smallest node whose two subtrees are built on separate threads */
+	const static int PARALLEL_SUBTREE_SIZE	= 4096;
+	/** Smallest node whose bounds and bins are computed on several threads */
+	const static int PARALLEL_BINNING_SIZE	= 1 << 16;
+
+	/** Leaves have count > 0 and hold triangles [offset, offset + count).  An internal
+		node's left child directly follows it and offset is its right child; axis is the
+		split axis, used to visit the near child first. */
+	struct Node {
+		float lo[3];
+		float hi[3];
+		int offset;
+		unsigned short count;
+		unsigned short axis;
+	};
+
+	/** A leaf's triangles: views of the arrays, or for compact storage decoded into scratch */
+	struct Leaf {
+		const float				*v0x, *v0y, *v0z;
+		const float				*e1x, *e1y, *e1z;
+		const float				*e2x, *e2y, *e2z;
+		const int				*triIndex;
+		float					scratch[9][MAX_LEAF_SIZE];
+	};
+
+	/** m_ownedNodes after build(), the mapping after load() */
+	const Node					*m_nodes;
+	Node						*m_ownedNodes;
+	int							m_nodeCount;
+	int							m_triCount;
+
+	/** The triangles, in m_triStorage and m_triIndexStorage after build() and in the
+		mapping after load().  m_triIndex is the index into the array given to build(). */
+	const float					*m_v0x, *m_v0y, *m_v0z;
+	const float					*m_e1x, *m_e1y, *m_e1z;
+	const float					*m_e2x, *m_e2y, *m_e2z;
+	const int					*m_triIndex;
+	std::vector<float>			m_triStorage;
+	std::vector<int>			m_triIndexStorage;
+
+	/** With compact storage, the nine coordinates of each triangle's vertices, 0 to 65535
+		across its leaf's box, instead of the float arrays */
+	bool						m_compact;
+	const unsigned short		*m_quantized;
+	std::vector<unsigned short>	m_quantizedStorage;
+	MappedFile					m_mapping;
+
+	/** Points the triangle arrays at 9 * m_triCount floats and m_triCount ints */
+	void setTriangles(const float *data, const int *triIndex);
+	void releaseStorage();
+
+	void leafTriangles(const Node& node, Leaf& leaf) const;
+
+	/** The compact half of build(): quantizes each triangle to its leaf */
+	void buildQuantized(const std::vector<G3D::Vector3>& positions, const std::vector<int>& order, int numThreads);
+
+	/** Per-triangle inputs to the build, indexed by original triangle */
+	struct BuildInput {
+		std::vector<G3D::Vector3> lo, hi, centroids;
+	};
+
+	/** Appends the subtree over order[begin, end) to nodes and returns its root.  Offsets of
+		internal nodes are relative to the start of nodes; depth is that of the subtree's root. */
+	static int buildRecursive(std::vector<Node>& nodes, std::vector<int>& order, const BuildInput& input, int begin, int end, int depth, int numThreads);
+
+	/** Whether every child and leaf range of nodes and every triangle index stays within the
+		arrays, with children stored after their parents and no deeper than the traversal stacks
+		allow.  Checked for every loaded file, whose contents may be damaged. */
+	static bool validTree(const Node *nodes, int nodeCount, const int *triIndex, int triCount);
+
+	/** Returns the split position in order, or -1 if a leaf is cheaper */
+	static int sahPartition(std::vector<int>& order, const BuildInput& input, int begin, int end,
+		const G3D::Vector3& boxLo, const G3D::Vector3& boxHi, const G3D::Vector3& centroidLo, const G3D::Vector3& centroidHi, int& axis, int numThreads);
+};
@@ -0,0 +1,273 @@
+#include "BatchRender.h"
+#include "Renderer.h"
+#include "World.h"
+#include "QuadTreeNode.h"
+
+#include <G3D/System.h>
+#include <G3D/debugPrintf.h>
+
+#include <GLG3D/OSWindow.h>
+#include <GLG3D/RenderDevice.h>
+#include <GLG3D/Camera.h>
+
+#ifdef _WIN32
+#	include <windows.h>
+#else
+#	include <cstdlib>
+#endif
+
+#include <cstdio>
+#include <cstring>
+#include <cctype>
+#include <cmath>
+#include <vector>
+#include <thread>
+#include <chrono>
+
+namespace {
+
+/** Waits for the pass the renderer is running, cancelling it once deadline has passed (zero
+	means never).  Returns false if the pass was cut short. */
+bool finishPass(Renderer& renderer, double deadline) {
+	while(renderer.pool->busy()){
+		if(deadline > 0.0 && G3D::System::time() > deadline){
+			renderer.pool->cancel();
+			renderer.pool->waitForCompletion();
+			return false;
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds(5));
+	}
+	renderer.pool->waitForCompletion();
+	renderer.pool->printStats();
+	return true;
+}
+
+bool hasExtension(const std::string& filename, const char *extension) {
+	size_t length = strlen(extension);
+	if(filename.size() < length){
+		return false;
+	}
+	for(size_t i = 0; i < length; i++){
+		if(tolower(filename[filename.size() - length + i]) != extension[i]){
+			return false;
+		}
+	}
+	return true;
+}
+
+void writePFM(const shared_ptr<G3D::Image3>& image, const std::string& filename) {
+	FILE *file = fopen(filename.c_str(), "wb");
+	if(file == NULL){
+		G3D::consolePrintf("Could not open %s for writing\n", filename.c_str());
+		return;
+	}
+
+	// A negative scale marks little-endian floats; rows are stored bottom to top
+	fprintf(file, "PF\n%d %d\n-1.0\n", image->width(), image->height());
+	std::vector<float> row(3 * image->width());
+	for(int y = image->height() - 1; y >= 0; y--){
+		for(int x = 0; x < image->width(); x++){
+			const G3D::Color3& color = image->fastGet(x, y);
+			row[3 * x] = color.r;
+			row[3 * x + 1] = color.g;
+			row[3 * x + 2] = color.b;
+		}
+		fwrite(&row[0], sizeof(float), row.size(), file);
+	}
+	fclose(file);
+}
+
+/** Whether this process can get an OpenGL context, and if not why.  G3D stops the process
+	when it cannot create its window, so this is asked before it tries. */
+bool canCreateContext(std::string& reason) {
+#ifdef _WIN32
+	// The same steps G3D takes: a window, a pixel format with OpenGL and a context on it
+	const char *className = "ProgressiveRayTracerProbe";
+	WNDCLASSA windowClass;
+	memset(&windowClass, 0, sizeof(windowClass));
+	windowClass.style = CS_OWNDC;
+	windowClass.lpfnWndProc = DefWindowProcA;
+	windowClass.hInstance = GetModuleHandleA(NULL);
+	windowClass.lpszClassName = className;
+	RegisterClassA(&windowClass);
+	HWND window = CreateWindowA(className, "", WS_OVERLAPPEDWINDOW, 0, 0, 64, 64, NULL, NULL, windowClass.hInstance, NULL);
+	if(window == NULL){
+		reason = "no window can be created in this session";
+		return false;
+	}
+
+	PIXELFORMATDESCRIPTOR format;
+	memset(&format, 0, sizeof(format));
+	format.nSize = sizeof(format);
+	format.nVersion = 1;
+	format.dwFlags = PFD_DRAW_TO_WINDOW | PFD_SUPPORT_OPENGL | PFD_DOUBLEBUFFER;
+	format.iPixelType = PFD_TYPE_RGBA;
+	format.cColorBits = 24;
+	format.cDepthBits = 24;
+	HDC dc = GetDC(window);
+	int index = ChoosePixelFormat(dc, &format);
+	HGLRC context = (index != 0 && SetPixelFormat(dc, index, &format)) ? wglCreateContext(dc) : NULL;
+	if(context != NULL){
+		wglDeleteContext(context);
+	} else {
+		reason = "no OpenGL pixel format or context is available";
+	}
+	ReleaseDC(window, dc);
+	DestroyWindow(window);
+	UnregisterClassA(className, windowClass.hInstance);
+	return context != NULL;
+#else
+	// G3D opens its window on the X server
+	const char *display = getenv("DISPLAY");
+	if(display == NULL || display[0] == 0){
+		reason = "DISPLAY is not set";
+		return false;
+	}
+	return true;
+#endif
+}
+
+}
+
+BatchSettings::BatchSettings() :
+	output("render.pfm"),
+	scene(World::DEFAULT_SCENE),
+	sceneCamera(true),
+	width(960),
+	height(640),
+	raysPerPixel(1),
+	maxBounces(3),
+	errorTarget(0.02f),
+	maxSamplesPerPixel(256),
+	alignTiles(false),
+	lightSamples(2),
+	batchShadowRays(true),
+	wavefront(false),
+	reorderRays(true),
+	useCache(true),
+	compact(false),
+	timeBudget(0.0),
+	numThreads(0)
+{
+}
+
+void writeImage(const shared_ptr<G3D::Image3>& image, const std::string& filename) {
+	if(hasExtension(filename, ".pfm")){
+		writePFM(image, filename);
+	} else if(hasExtension(filename, ".exr")){
+		image->save(filename);
+	} else {
+		// 8-bit formats get the clamped, gamma encoded image instead of linear radiance
+		shared_ptr<G3D::Image3> encoded = G3D::Image3::createEmpty(image->width(), image->height());
+		for(int y = 0; y < image->height(); y++){
+			for(int x = 0; x < image->width(); x++){
+				const G3D::Color3& color = image->fastGet(x, y);
+				encoded->fastSet(x, y, G3D::Color3(powf(G3D::clamp(color.r, 0.0f, 1.0f), 1.0f / 2.2f),
+					powf(G3D::clamp(color.g, 0.0f, 1.0f), 1.0f / 2.2f), powf(G3D::clamp(color.b, 0.0f, 1.0f), 1.0f / 2.2f)));
+			}
+		}
+		encoded->save(filename);
+	}
+}
+
+G3D::RenderDevice* createHiddenRenderDevice(const std::string& caption) {
+	std::string reason;
+	if(!canCreateContext(reason)){
+		G3D::consolePrintf("Cannot create an OpenGL context: %s.\n", reason.c_str());
+		G3D::consolePrintf("G3D needs one to load the models' textures, even though rendering runs on the CPU only.  On a machine\n"
+			"without a display, run under a virtual X server such as Xvfb with Mesa's software OpenGL on Linux, or\n"
+			"in a session with a desktop and Mesa's software opengl32.dll next to the executable on Windows.\n");
+		return NULL;
+	}
+
+	G3D::OSWindow::Settings windowSettings;
+	windowSettings.caption = caption;
+	windowSettings.width = 64;
+	windowSettings.height = 64;
+	windowSettings.visible = false;
+	G3D::RenderDevice *renderDevice = new G3D::RenderDevice();
+	renderDevice->init(windowSettings);
+	return renderDevice;
+}
+
+int runBatchRender(const BatchSettings& settings) {
+	G3D::RenderDevice *renderDevice = createHiddenRenderDevice("Progressive Ray Tracer (batch)");
+	if(renderDevice == NULL){
+		return 1;
+	}
+
+	double loadStart = G3D::System::time();
+	World *world = new World(settings.scene, settings.useCache, settings.compact);
+	double loadTime = G3D::System::time() - loadStart;
+
+	Renderer renderer(settings.width, settings.height, settings.numThreads);
+	renderer.world = world;
+	renderer.camera = G3D::Camera::create("Batch");
+	renderer.camera->setFrame(settings.sceneCamera ? world->cameraFrame : settings.cameraFrame);
+	renderer.raysPerPixel = settings.raysPerPixel;
+	renderer.maxBounces = settings.maxBounces;
+	renderer.errorTarget = settings.errorTarget;
+	renderer.maxSamplesPerPixel = G3D::min(settings.maxSamplesPerPixel, (int)QuadTreeNode::MAX_SAMPLES);
+	renderer.setAlignTiles(settings.alignTiles);
+	renderer.lightSamples = settings.lightSamples;
+	renderer.batchShadowRays = settings.batchShadowRays;
+	renderer.wavefront = settings.wavefront;
+	renderer.reorderRays = settings.reorderRays;
+	renderer.resetRayCounts();
+
+	double start = G3D::System::time();
+	double deadline = (settings.timeBudget > 0.0) ? start + settings.timeBudget : 0.0;
+
+	// The same passes App runs for its first frame and every frame after it
+	renderer.renderFirstFrame();
+	bool complete = finishPass(renderer, deadline);
+	if(complete){
+		renderer.calculateNeighborDiff();
+		complete = finishPass(renderer, deadline);
+	}
+	if(complete){
+		renderer.sortRenderOrder();
+		renderer.tmp_render_order.clear();
+		renderer.fastColor();
+		complete = finishPass(renderer, deadline);
+	}
+	if(complete){
+		renderer.slowColor();
+		complete = finishPass(renderer, deadline);
+	}
+	int refinePasses = 0;
+	while(complete && renderer.refine() > 0){
+		complete = finishPass(renderer, deadline);
+		refinePasses++;
+	}
+	double wall = G3D::System::time() - start;
+
+	std::vector<G3D::Rect2D> rects;
+	renderer.markAllDirty();
+	renderer.updateImage(rects);
+	writeImage(renderer.image, settings.output);
+
+	long long primary, shadow, secondary;
+	renderer.rayCounts(primary, shadow, secondary);
+	long long total = primary + shadow + secondary;
+	G3D::consolePrintf("%s: %dx%d, %d rays per pixel, %d bounces, %d threads\n", settings.output.c_str(), settings.width, settings.height,
+		settings.raysPerPixel, settings.maxBounces, renderer.pool->size());
+	G3D::consolePrintf("  scene load %f s, render %f s wall%s\n", loadTime, wall, complete ? "" : " (stopped at the time budget)");
+	G3D::consolePrintf("  %d refinement passes, %.2f primary rays per pixel, largest leaf error %f\n", refinePasses,
+		primary / (double)(settings.width * settings.height), renderer.maxError());
+	G3D::consolePrintf("  %lld primary, %lld shadow, %lld secondary rays: %.0f rays/s\n", primary, shadow, secondary, wall > 0.0 ? total / wall : 0.0);
+
+	long long primaryNodes, secondaryNodes;
+	renderer.nodeVisits(primaryNodes, secondaryNodes);
+	if(settings.wavefront){
+		G3D::consolePrintf("  %.1f BVH nodes per primary ray, %.1f per secondary ray\n", primaryNodes / (double)G3D::max(primary, 1LL),
+			secondaryNodes / (double)G3D::max(secondary, 1LL));
+	} else {
+		G3D::consolePrintf("  %.1f BVH nodes per primary ray\n", primaryNodes / (double)G3D::max(primary, 1LL));
+	}
+
+	delete world;
+	renderDevice->cleanup();
+	delete renderDevice;
+	return 0;
+}
@@ -0,0 +1,59 @@
+#pragma once
+#include <G3D/CoordinateFrame.h>
+#include <G3D/Image3.h>
+
+#include <GLG3D/RenderDevice.h>
+
+#include <string>
+
+/** What -batch renders; see README.md for the matching command line options */
+struct BatchSettings {
+	std::string		output;
+	/** The scene file; see World */
+	std::string		scene;
+	/** Start from the scene file's camera instead of cameraFrame */
+	bool			sceneCamera;
+	G3D::CFrame		cameraFrame;
+	int				width;
+	int				height;
+	int				raysPerPixel;
+	int				maxBounces;
+	/** See Renderer::errorTarget and Renderer::maxSamplesPerPixel */
+	float			errorTarget;
+	int				maxSamplesPerPixel;
+	/** See Renderer::setAlignTiles */
+	bool			alignTiles;
+	/** See Renderer::lightSamples, Renderer::batchShadowRays, Renderer::wavefront and Renderer::reorderRays */
+	int				lightSamples;
+	bool			batchShadowRays;
+	bool			wavefront;
+	bool			reorderRays;
+	/** See World::World */
+	bool			useCache;
+	bool			compact;
+	/** Seconds of rendering after the scene has loaded; zero runs every pass to completion */
+	double			timeBudget;
+	/** Zero means one per hardware thread */
+	int				numThreads;
+
+	BatchSettings();
+};
+
+/**
+  Renders one image without an interactive window: loads the World, runs
+  renderFirstFrame, calculateNeighborDiff, fastColor and slowColor on a
+  Renderer, writes the image and prints the wall time and rays/sec.
+
+  G3D's model loader still needs an OpenGL context for textures, so one is
+  created for an invisible window; nothing after loading touches it.  Without
+  one it exits with an error.  Returns the process exit code.
+ */
+int runBatchRender(const BatchSettings& settings);
+
+/** Writes linear radiance to .pfm or .exr, or clamped and gamma encoded to any other format G3D can save */
+void writeImage(const shared_ptr<G3D::Image3>& image, const std::string& filename);
+
+/** An OpenGL context on an invisible window, enough for World to load its models.  Call
+	cleanup() and delete it when done.  Prints why and returns NULL if this machine cannot
+	create one, for example when there is no display, instead of letting G3D stop the process. */
+G3D::RenderDevice* createHiddenRenderDevice(const std::string& caption);
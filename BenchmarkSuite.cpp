@@ -0,0 +1,226 @@
+#include "BenchmarkSuite.h"
+#include "BatchRender.h"
+#include "Renderer.h"
+#include "World.h"
+
+#include <G3D/System.h>
+#include <G3D/CoordinateFrame.h>
+#include <G3D/debugPrintf.h>
+#include <G3D/format.h>
+
+#include <GLG3D/Camera.h>
+
+#ifdef _WIN32
+#	include <windows.h>
+#	include <psapi.h>
+#else
+#	include <unistd.h>
+#endif
+
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <thread>
+
+namespace {
+
+const int SUITE_WIDTH = 960;
+const int SUITE_HEIGHT = 640;
+
+struct SuiteCamera {
+	const char		*scene;
+	const char		*name;
+	float			xyzypr[6];
+};
+
+/** Never change these in place: add new frames under new names, so results stay comparable */
+const SuiteCamera SUITE_CAMERAS[] = {
+	{ "demo",		"start",	{ 24.3f,  0.4f,  2.5f,   68.7f,   1.2f, 0.0f } },
+	{ "demo",		"nave",		{ 22.0f, -3.5f,  0.0f,   90.0f,   5.0f, 0.0f } },
+	{ "demo",		"gallery",	{  0.0f,  1.5f,  3.5f, -120.0f, -15.0f, 0.0f } },
+	{ "teapots",	"front",	{  0.0f,  1.5f,  8.0f,    0.0f, -10.0f, 0.0f } },
+	{ "teapots",	"above",	{  0.0f,  6.0f,  6.0f,    0.0f, -40.0f, 0.0f } },
+	{ "spheres",	"front",	{  0.0f,  1.5f,  8.0f,    0.0f, -10.0f, 0.0f } },
+	{ "spheres",	"above",	{  0.0f,  6.0f,  6.0f,    0.0f, -40.0f, 0.0f } },
+	{ "lights",	"front",	{  0.0f,  1.5f,  8.0f,    0.0f, -10.0f, 0.0f } },
+	{ "lights",	"above",	{  0.0f,  6.0f,  6.0f,    0.0f, -40.0f, 0.0f } },
+};
+const int NUM_SUITE_CAMERAS = sizeof(SUITE_CAMERAS) / sizeof(SUITE_CAMERAS[0]);
+
+/** Scene files in World::DEFAULT_SCENE's directory */
+const char *SUITE_SCENES[] = { "demo", "teapots", "spheres", "lights" };
+const int NUM_SUITE_SCENES = sizeof(SUITE_SCENES) / sizeof(SUITE_SCENES[0]);
+
+struct SuiteResult {
+	const char		*scene;
+	const char		*camera;
+	int				threads;
+	double			firstImageTime;
+	double			finishTime;
+	long long		primaryRays;
+	long long		shadowRays;
+	long long		secondaryRays;
+	/** The largest resident set size seen between the run's passes, less the size just before it */
+	long long		residentGrowth;
+};
+
+/** Renders one frame from a fresh renderer the way App does from onInit until it reaches FINISH */
+SuiteResult renderToFinish(World *world, const G3D::CFrame& frame, int numThreads) {
+	// The process's peak resident size covers every earlier run and scene, so each run
+	// samples the current size after every pass instead; the arenas never shrink within a run
+	const long long residentBefore = residentBytes();
+	long long residentMax = residentBefore;
+
+	Renderer renderer(SUITE_WIDTH, SUITE_HEIGHT, numThreads);
+	renderer.world = world;
+	renderer.camera = G3D::Camera::create("Benchmark");
+	renderer.camera->setFrame(frame);
+	auto waitAndSample = [&]() {
+		renderer.pool->waitForCompletion();
+		residentMax = G3D::max(residentMax, residentBytes());
+	};
+
+	SuiteResult result;
+	double start = G3D::System::time();
+
+	// App::onInit
+	renderer.renderFirstFrame();
+	waitAndSample();
+	result.firstImageTime = G3D::System::time() - start;
+
+	renderer.calculateNeighborDiff();
+	waitAndSample();
+	renderer.sortRenderOrder();
+	renderer.smallDiffStart = renderer.render_order.size();
+
+	// App::onGraphics from INITIAL through SORT_WAITING
+	renderer.tmp_render_order.clear();
+	renderer.rayTraceImage();
+	waitAndSample();
+	renderer.fastColor();
+	waitAndSample();
+	renderer.slowColor();
+	waitAndSample();
+	renderer.calculateNeighborDiff();
+	waitAndSample();
+	renderer.sortRenderOrder();
+	result.finishTime = G3D::System::time() - start;
+
+	renderer.rayCounts(result.primaryRays, result.shadowRays, result.secondaryRays);
+	result.residentGrowth = residentMax - residentBefore;
+	return result;
+}
+
+}
+
+long long residentBytes() {
+#ifdef _WIN32
+	PROCESS_MEMORY_COUNTERS counters;
+	if(GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))){
+		return (long long)counters.WorkingSetSize;
+	}
+	return 0;
+#else
+	// The second field of statm is the resident size in pages
+	FILE *file = fopen("/proc/self/statm", "r");
+	if(file == NULL){
+		return 0;
+	}
+	long long pages = 0;
+	long long resident = 0;
+	bool ok = (fscanf(file, "%lld %lld", &pages, &resident) == 2);
+	fclose(file);
+	return ok ? resident * sysconf(_SC_PAGESIZE) : 0;
+#endif
+}
+
+int runBenchmarkSuite(const std::string& jsonFile) {
+	G3D::RenderDevice *renderDevice = createHiddenRenderDevice("Progressive Ray Tracer (benchmark)");
+	if(renderDevice == NULL){
+		return 1;
+	}
+
+	int hardwareThreads = G3D::max(1, (int)std::thread::hardware_concurrency());
+	std::vector<int> threadCounts;
+	const int fixedCounts[] = { 1, 4, 16 };
+	for(int i = 0; i < 3; i++){
+		if(fixedCounts[i] < hardwareThreads){
+			threadCounts.push_back(fixedCounts[i]);
+		}
+	}
+	threadCounts.push_back(hardwareThreads);
+
+	std::vector<SuiteResult> results;
+	std::vector<std::string> sceneEntries;
+	for(int s = 0; s < NUM_SUITE_SCENES; s++){
+		double loadStart = G3D::System::time();
+		World *world = new World(G3D::format("scene/%s.Any", SUITE_SCENES[s]));
+		double loadTime = G3D::System::time() - loadStart;
+		const char *sceneName = SUITE_SCENES[s];
+
+		char entry[256];
+		sprintf(entry, "{ \"name\": \"%s\", \"triangles\": %d, \"uniqueTriangles\": %d, \"lights\": %d, \"loadSeconds\": %f }", sceneName,
+			world->triangleCount(), world->uniqueTriangleCount(), world->lightArray.size(), loadTime);
+		sceneEntries.push_back(entry);
+
+		for(int c = 0; c < NUM_SUITE_CAMERAS; c++){
+			const SuiteCamera& camera = SUITE_CAMERAS[c];
+			if(strcmp(camera.scene, SUITE_SCENES[s]) != 0){
+				continue;
+			}
+			const float *f = camera.xyzypr;
+			G3D::CFrame frame = G3D::CFrame::fromXYZYPRDegrees(f[0], f[1], f[2], f[3], f[4], f[5]);
+
+			// Untimed, so the first measured run does not pay for cold caches and page faults
+			renderToFinish(world, frame, hardwareThreads);
+
+			for(int t = 0; t < threadCounts.size(); t++){
+				SuiteResult result = renderToFinish(world, frame, threadCounts[t]);
+				result.scene = sceneName;
+				result.camera = camera.name;
+				result.threads = threadCounts[t];
+				double seconds = G3D::max(result.finishTime, 1e-9);
+				G3D::consolePrintf("%s/%s, %d threads: first image %f s, finish %f s, %.0f primary, %.0f shadow, %.0f secondary rays/s\n",
+					sceneName, camera.name, result.threads, result.firstImageTime, result.finishTime,
+					result.primaryRays / seconds, result.shadowRays / seconds, result.secondaryRays / seconds);
+				results.push_back(result);
+			}
+		}
+		delete world;
+	}
+
+	FILE *file = fopen(jsonFile.c_str(), "w");
+	if(file == NULL){
+		G3D::consolePrintf("Could not open %s for writing\n", jsonFile.c_str());
+		renderDevice->cleanup();
+		delete renderDevice;
+		return 1;
+	}
+
+	fprintf(file, "{\n");
+	fprintf(file, "  \"width\": %d,\n  \"height\": %d,\n  \"raysPerPixel\": 1,\n  \"maxBounces\": 3,\n  \"lightSamples\": 2,\n", SUITE_WIDTH, SUITE_HEIGHT);
+	fprintf(file, "  \"hardwareThreads\": %d,\n", hardwareThreads);
+	fprintf(file, "  \"scenes\": [\n");
+	for(int i = 0; i < sceneEntries.size(); i++){
+		fprintf(file, "    %s%s\n", sceneEntries[i].c_str(), (i + 1 < sceneEntries.size()) ? "," : "");
+	}
+	fprintf(file, "  ],\n  \"runs\": [\n");
+	for(int i = 0; i < results.size(); i++){
+		const SuiteResult& result = results[i];
+		double seconds = G3D::max(result.finishTime, 1e-9);
+		fprintf(file, "    { \"scene\": \"%s\", \"camera\": \"%s\", \"threads\": %d,\n", result.scene, result.camera, result.threads);
+		fprintf(file, "      \"firstImageSeconds\": %f, \"finishSeconds\": %f,\n", result.firstImageTime, result.finishTime);
+		fprintf(file, "      \"primaryRays\": %lld, \"shadowRays\": %lld, \"secondaryRays\": %lld,\n", result.primaryRays, result.shadowRays, result.secondaryRays);
+		fprintf(file, "      \"primaryRaysPerSecond\": %.0f, \"shadowRaysPerSecond\": %.0f, \"secondaryRaysPerSecond\": %.0f,\n",
+			result.primaryRays / seconds, result.shadowRays / seconds, result.secondaryRays / seconds);
+		fprintf(file, "      \"residentGrowthBytes\": %lld }%s\n", result.residentGrowth, (i + 1 < results.size()) ? "," : "");
+	}
+	fprintf(file, "  ]\n}\n");
+	fclose(file);
+
+	G3D::consolePrintf("Wrote %s\n", jsonFile.c_str());
+	renderDevice->cleanup();
+	delete renderDevice;
+	return 0;
+}
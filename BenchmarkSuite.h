@@ -0,0 +1,15 @@
+#pragma once
+#include <string>
+
+/**
+  The regression benchmark: renders the demo scene and the synthetic scenes in scene/
+  from a fixed set of camera frames, each at 1, 4, 16 and all hardware threads, running
+  the same passes App runs until it reaches FINISH.  For every run it records primary,
+  shadow and secondary rays/sec, the time to the first full image (renderFirstFrame), the
+  time until FINISH and how far the run grew the process's resident set, and writes them
+  all to jsonFile.  Returns the process exit code.
+ */
+int runBenchmarkSuite(const std::string& jsonFile);
+
+/** Resident set size of this process now, in bytes; zero where unknown */
+long long residentBytes();
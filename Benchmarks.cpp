@@ -0,0 +1,728 @@
+#include "Benchmarks.h"
+#include "RenderOrderBuffer.h"
+#include "RenderQueue.h"
+#include "QuadTree.h"
+#include "World.h"
+#include "BVH.h"
+#include "ShadowQueue.h"
+#include "WorkerPool.h"
+#include "Renderer.h"
+
+#include <G3D/System.h>
+#include <G3D/Random.h>
+#include <G3D/GMutex.h>
+#include <G3D/debugPrintf.h>
+
+#include <GLG3D/TriTree.h>
+#include <GLG3D/Surface.h>
+
+#include <math.h>
+#include <vector>
+#include <queue>
+#include <algorithm>
+#include <thread>
+
+namespace {
+
+const int CONTENTION_APPENDS = 1 << 20;
+/** Side of the tiles benchmarkShadowRays batches by, about the size of a QuadTree leaf */
+const int SHADOW_TILE_SIZE = 8;
+/** Shadow rays per hit in benchmarkShadowRays, the renderer's default */
+const int SHADOW_LIGHT_SAMPLES = 2;
+/** Primary rays per pixel in benchmarkWavefront, so bounces and shading dominate */
+const int WAVEFRONT_SPP = 4;
+/** benchmarkCompactGeometry traces COMPACT_GRID_SIZE^2 copies of the scene */
+const int COMPACT_GRID_SIZE = 4;
+/** benchmarkDynamicInstances spins every DYNAMIC_STRIDE-th instance of a scene that spins none,
+	for DYNAMIC_FRAMES frames of 1/30 s */
+const int DYNAMIC_STRIDE = 8;
+const int DYNAMIC_FRAMES = 30;
+const float DYNAMIC_DEGREES_PER_SECOND = 90.0f;
+
+struct MutexOrder {
+	G3D::GMutex				lock;
+	std::vector<int>		order;
+};
+
+void appendWithMutex(MutexOrder *order, int count) {
+	for(int i = 0; i < count; i++){
+		order->lock.lock();
+		order->order.push_back(i);
+		order->lock.unlock();
+	}
+}
+
+void appendLockFree(RenderOrderBuffer *order, int count) {
+	for(int i = 0; i < count; i++){
+		order->append(i);
+	}
+}
+
+}
+
+void benchmarkRenderOrderContention() {
+	const int threadCounts[] = { 4, 16, 64 };
+
+	for(int t = 0; t < 3; t++){
+		int numThreads = threadCounts[t];
+		int perThread = CONTENTION_APPENDS / numThreads;
+		std::vector<std::thread> threads;
+
+		MutexOrder mutexOrder;
+		double start = G3D::System::time();
+		for(int i = 0; i < numThreads; i++){
+			threads.push_back(std::thread(&appendWithMutex, &mutexOrder, perThread));
+		}
+		for(int i = 0; i < numThreads; i++){
+			threads[i].join();
+		}
+		double mutexTime = G3D::System::time() - start;
+		threads.clear();
+
+		RenderOrderBuffer buffer(perThread * numThreads);
+		start = G3D::System::time();
+		for(int i = 0; i < numThreads; i++){
+			threads.push_back(std::thread(&appendLockFree, &buffer, perThread));
+		}
+		for(int i = 0; i < numThreads; i++){
+			threads[i].join();
+		}
+		double lockFreeTime = G3D::System::time() - start;
+
+		G3D::debugPrintf("%2d threads, %d appends: mutex %f s, atomic slot %f s (%.1fx)\n", numThreads, perThread * numThreads,
+			mutexTime, lockFreeTime, lockFreeTime > 0.0 ? mutexTime / lockFreeTime : 0.0);
+	}
+}
+
+void benchmarkQuadTreeBuild() {
+	const int resolutions[][2] = { { 1280, 720 }, { 1920, 1080 }, { 3840, 2160 }, { 7680, 4320 } };
+
+	for(int r = 0; r < 4; r++){
+		int width = resolutions[r][0];
+		int height = resolutions[r][1];
+
+		double start = G3D::System::time();
+		QuadTree tree(width, height);
+		double buildTime = G3D::System::time() - start;
+
+		// A resize back to the same size measures a rebuild into the existing allocations
+		start = G3D::System::time();
+		tree.resize(width, height);
+		double rebuildTime = G3D::System::time() - start;
+
+		G3D::debugPrintf("%dx%d: built in %f s, rebuilt in %f s, depth %d, %d nodes, %d leaves, %.1f MB\n", width, height, buildTime,
+			rebuildTime, tree.depth(), tree.size(), tree.leafCount(), tree.memoryFootprint() / (1024.0 * 1024.0));
+	}
+}
+
+void benchmarkRenderOrderSort() {
+	const int passes = 10;
+	const float threshold = 0.05f;
+
+	QuadTree tree(3840, 2160);
+	G3D::Random rng(0x5EED, false);
+
+	// Leaves arrive in the order the workers happened to finish them
+	std::vector<int> visited(tree.leafCount());
+	for(int i = 0; i < visited.size(); i++){
+		visited[i] = tree.firstLeaf() + i;
+	}
+	std::random_shuffle(visited.begin(), visited.end());
+	RenderOrderBuffer buffer(tree.leafCount());
+	for(int i = 0; i < visited.size(); i++){
+		buffer.append(visited[i]);
+	}
+
+	std::vector<int> heapOrder(tree.leafCount());
+	std::vector<int> queueOrder(tree.leafCount());
+	RenderQueue queue;
+	WorkerPool pool;
+	std::vector<int> pooledOrder(tree.leafCount());
+	double heapTime = 0.0;
+	double queueTime = 0.0;
+	double pooledTime = 0.0;
+	int mismatches = 0;
+	for(int pass = 0; pass < passes; pass++){
+		// Contrast spans several orders of magnitude, mostly low
+		for(int i = 0; i < tree.leafCount(); i++){
+			tree.nodes[tree.firstLeaf() + i].neighborColorDiff = pow(10.0f, rng.uniform(-4.0f, 1.0f));
+		}
+
+		double start = G3D::System::time();
+		std::priority_queue<int, std::vector<int>, QuadTreeDiffComparator> heap(buffer.begin(), buffer.end(), QuadTreeDiffComparator(&tree));
+		int counter = 0;
+		while(!heap.empty()){
+			heapOrder[counter++] = heap.top();
+			heap.pop();
+		}
+		heapTime += G3D::System::time() - start;
+
+		start = G3D::System::time();
+		queue.sort(tree, buffer.begin(), buffer.end(), threshold, queueOrder);
+		queueTime += G3D::System::time() - start;
+
+		start = G3D::System::time();
+		queue.sort(tree, buffer.begin(), buffer.end(), threshold, pooledOrder, &pool);
+		pooledTime += G3D::System::time() - start;
+
+		for(int i = 0; i < tree.leafCount(); i++){
+			if(RenderQueue::bucket(tree.nodes[heapOrder[i]].neighborColorDiff) != RenderQueue::bucket(tree.nodes[queueOrder[i]].neighborColorDiff) ||
+				pooledOrder[i] != queueOrder[i]){
+				mismatches++;
+			}
+		}
+	}
+
+	G3D::debugPrintf("3840x2160, %d leaves, per pass: priority_queue %f ms, RenderQueue %f ms (%.1fx), on %d workers %f ms, %d mismatches\n", tree.leafCount(),
+		1000.0 * heapTime / passes, 1000.0 * queueTime / passes, queueTime > 0.0 ? heapTime / queueTime : 0.0, pool.size(), 1000.0 * pooledTime / passes, mismatches);
+}
+
+void benchmarkPacketTracing(World *world, const shared_ptr<G3D::Camera>& camera, const G3D::Rect2D& viewport) {
+	int width = (int)viewport.width();
+	int height = (int)viewport.height();
+
+	// Group the rays into 4x2 pixel tiles so that each packet is coherent
+	std::vector<G3D::Ray> rays;
+	rays.reserve(width * height);
+	for(int ty = 0; ty < height; ty += 2){
+		for(int tx = 0; tx < width; tx += 4){
+			for(int y = ty; y < ty + 2 && y < height; y++){
+				for(int x = tx; x < tx + 4 && x < width; x++){
+					rays.push_back(camera->worldRay(x + 0.5f, y + 0.5f, viewport));
+				}
+			}
+		}
+	}
+
+	int scalarHits = 0;
+	double start = G3D::System::time();
+	for(int i = 0; i < rays.size(); i++){
+		float distance = (float)G3D::inf();
+		BVH::Hit hit;
+		if(world->intersect(rays[i], distance, hit)){
+			scalarHits++;
+		}
+	}
+	double scalarTime = G3D::System::time() - start;
+
+	int packetHits = 0;
+	int surfelHits = 0;
+	double surfelTime = 0.0;
+	start = G3D::System::time();
+	for(int i = 0; i < rays.size(); i += RayPacket::SIZE){
+		RayPacket packet;
+		BVH::Hit hits[RayPacket::SIZE];
+		for(int lane = 0; lane < RayPacket::SIZE && i + lane < rays.size(); lane++){
+			packet.set(lane, rays[i + lane], (float)G3D::inf());
+			packet.count++;
+		}
+		world->intersect8(packet, hits);
+		for(int lane = 0; lane < packet.count; lane++){
+			if(hits[lane].triIndex >= 0){
+				packetHits++;
+			}
+		}
+	}
+	double packetTime = G3D::System::time() - start;
+
+	// The same again including surfel construction, which is what shading pays for
+	G3D::UniversalSurfel surfel;
+	start = G3D::System::time();
+	for(int i = 0; i < rays.size(); i += RayPacket::SIZE){
+		RayPacket packet;
+		BVH::Hit hits[RayPacket::SIZE];
+		for(int lane = 0; lane < RayPacket::SIZE && i + lane < rays.size(); lane++){
+			packet.set(lane, rays[i + lane], (float)G3D::inf());
+			packet.count++;
+		}
+		world->intersect8(packet, hits);
+		for(int lane = 0; lane < packet.count; lane++){
+			if(world->surfel(hits[lane], rays[i + lane], surfel)){
+				surfelHits++;
+			}
+		}
+	}
+	surfelTime = G3D::System::time() - start;
+
+	G3D::debugPrintf("%d primary rays (%dx%d)\n", (int)rays.size(), width, height);
+	G3D::debugPrintf("  scalar BVH:      %f s, %.0f rays/s, %d hits\n", scalarTime, rays.size() / scalarTime, scalarHits);
+	G3D::debugPrintf("  %d-wide packets:  %f s, %.0f rays/s, %d hits\n", RayPacket::SIZE, packetTime, rays.size() / packetTime, packetHits);
+	G3D::debugPrintf("  packets + surfel: %f s, %.0f rays/s, %d hits\n", surfelTime, rays.size() / surfelTime, surfelHits);
+}
+
+void benchmarkAccelerationStructures(World *world, const shared_ptr<G3D::Camera>& camera, const G3D::Rect2D& viewport) {
+	// Extract every instance's triangles serially into one vertex array, the way World did before
+	// loading in parallel and instancing
+	G3D::Array<shared_ptr<G3D::Surface> > surfaces;
+	world->surfaces(surfaces);
+	G3D::Array<G3D::Tri> tris;
+	G3D::CPUVertexArray vertexArray;
+	double start = G3D::System::time();
+	G3D::Surface::getTris(surfaces, vertexArray, tris);
+	double serialExtraction = G3D::System::time() - start;
+
+	// The settings World used before it had its own BVH
+	G3D::TriTree::Settings settings;
+	settings.algorithm = G3D::TriTree::MEAN_EXTENT;
+	G3D::TriTree triTree;
+	start = G3D::System::time();
+	triTree.setContents(tris, vertexArray, settings);
+	double triTreeBuild = G3D::System::time() - start;
+
+	BVH bvh;
+	start = G3D::System::time();
+	bvh.build(tris, vertexArray, 1);
+	double serialBuild = G3D::System::time() - start;
+
+	start = G3D::System::time();
+	bvh.build(tris, vertexArray);
+	double bvhBuild = G3D::System::time() - start;
+
+	int width = (int)viewport.width();
+	int height = (int)viewport.height();
+	std::vector<G3D::Ray> rays;
+	rays.reserve(width * height);
+	for(int y = 0; y < height; y++){
+		for(int x = 0; x < width; x++){
+			rays.push_back(camera->worldRay(x + 0.5f, y + 0.5f, viewport));
+		}
+	}
+
+	// Shadow rays from the BVH's primary hits toward the first light, so both structures trace the same set
+	const G3D::Vector3 lightPosition = world->lightArray.size() > 0 ? world->lightArray[0]->position().xyz() : G3D::Vector3(0, 10, 0);
+	std::vector<G3D::Ray> shadowRays;
+	std::vector<float> shadowLengths;
+	for(int i = 0; i < rays.size(); i++){
+		BVH::Hit hit;
+		if(bvh.intersect(rays[i], (float)G3D::inf(), hit)){
+			G3D::Vector3 origin = rays[i].origin() + rays[i].direction() * hit.t * 0.999f;
+			G3D::Vector3 toLight = lightPosition - origin;
+			shadowLengths.push_back(toLight.length());
+			shadowRays.push_back(G3D::Ray::fromOriginAndDirection(origin, toLight / shadowLengths.back()));
+		}
+	}
+
+	int triTreeHits = 0;
+	start = G3D::System::time();
+	for(int i = 0; i < rays.size(); i++){
+		float distance = (float)G3D::inf();
+		G3D::Tri::Intersector intersector;
+		if(triTree.intersectRay(rays[i], intersector, distance, false, true)){
+			triTreeHits++;
+		}
+	}
+	double triTreePrimary = G3D::System::time() - start;
+
+	int bvhHits = 0;
+	start = G3D::System::time();
+	for(int i = 0; i < rays.size(); i++){
+		BVH::Hit hit;
+		if(bvh.intersect(rays[i], (float)G3D::inf(), hit)){
+			bvhHits++;
+		}
+	}
+	double bvhPrimary = G3D::System::time() - start;
+
+	int triTreeOccluded = 0;
+	start = G3D::System::time();
+	for(int i = 0; i < shadowRays.size(); i++){
+		float distance = shadowLengths[i];
+		G3D::Tri::Intersector intersector;
+		if(triTree.intersectRay(shadowRays[i], intersector, distance, true, true)){
+			triTreeOccluded++;
+		}
+	}
+	double triTreeShadow = G3D::System::time() - start;
+
+	int bvhOccluded = 0;
+	start = G3D::System::time();
+	for(int i = 0; i < shadowRays.size(); i++){
+		BVH::Hit hit;
+		if(bvh.intersect(shadowRays[i], shadowLengths[i], hit, true)){
+			bvhOccluded++;
+		}
+	}
+	double bvhShadow = G3D::System::time() - start;
+
+	G3D::debugPrintf("%d triangles, %d primary rays (%dx%d), %d shadow rays\n", tris.size(), (int)rays.size(), width, height, (int)shadowRays.size());
+	G3D::debugPrintf("  serial Surface::getTris: %f s\n", serialExtraction);
+	G3D::debugPrintf("  BVH build on 1 thread: %f s, on %d threads: %f s (%.1fx)\n", serialBuild, (int)std::thread::hardware_concurrency(),
+		bvhBuild, bvhBuild > 0.0 ? serialBuild / bvhBuild : 0.0);
+	G3D::debugPrintf("  TriTree: built in %f s, primary %.0f rays/s (%d hits), shadow %.0f rays/s (%d occluded)\n", triTreeBuild,
+		rays.size() / triTreePrimary, triTreeHits, shadowRays.size() / triTreeShadow, triTreeOccluded);
+	G3D::debugPrintf("  BVH:     built in %f s, %d nodes, %.1f MB, primary %.0f rays/s (%d hits), shadow %.0f rays/s (%d occluded)\n", bvhBuild,
+		bvh.nodeCount(), bvh.memoryFootprint() / (1024.0 * 1024.0), rays.size() / bvhPrimary, bvhHits, shadowRays.size() / bvhShadow, bvhOccluded);
+}
+
+void benchmarkShadowRays(World *world, const shared_ptr<G3D::Camera>& camera, const G3D::Rect2D& viewport) {
+	const float BUMP_DISTANCE = 0.0001f;
+	int width = (int)viewport.width();
+	int height = (int)viewport.height();
+
+	// Shadow rays in the order shading makes them: tile by tile, pixel by pixel, light by light.
+	// With more lights than the renderer tests, they are picked from the light BVH as it does.
+	struct ShadowRay {
+		G3D::Vector3 origin, direction;
+		float distance;
+	};
+	std::vector<ShadowRay> shadowRays;
+	std::vector<int> tileStart;
+	G3D::Random rng(0x5EED, false);
+	const G3D::Array<shared_ptr<G3D::Light> >& lights = world->lightArray;
+	for(int ty = 0; ty < height; ty += SHADOW_TILE_SIZE){
+		for(int tx = 0; tx < width; tx += SHADOW_TILE_SIZE){
+			tileStart.push_back(shadowRays.size());
+			for(int y = ty; y < ty + SHADOW_TILE_SIZE && y < height; y++){
+				for(int x = tx; x < tx + SHADOW_TILE_SIZE && x < width; x++){
+					G3D::Ray ray = camera->worldRay(x + 0.5f, y + 0.5f, viewport);
+					float distance = (float)G3D::inf();
+					BVH::Hit hit;
+					G3D::UniversalSurfel surfel;
+					if(!world->intersect(ray, distance, hit) || !world->surfel(hit, ray, surfel)){
+						continue;
+					}
+					G3D::Vector3 origin = surfel.location + surfel.geometricNormal * BUMP_DISTANCE;
+					int samples = (lights.size() <= SHADOW_LIGHT_SAMPLES) ? lights.size() : SHADOW_LIGHT_SAMPLES;
+					for(int s = 0; s < samples; s++){
+						float pdf;
+						int L = (lights.size() <= SHADOW_LIGHT_SAMPLES) ? s : world->lightBVH().sample(surfel.location, surfel.shadingNormal, rng.uniform(), pdf);
+						if(L < 0){
+							continue;
+						}
+						ShadowRay shadowRay;
+						G3D::Vector3 toLight = lights[L]->position().xyz() - origin;
+						shadowRay.distance = toLight.length();
+						shadowRay.origin = origin;
+						shadowRay.direction = toLight / shadowRay.distance;
+						shadowRays.push_back(shadowRay);
+					}
+				}
+			}
+		}
+	}
+	tileStart.push_back(shadowRays.size());
+
+	int inlineVisible = 0;
+	double start = G3D::System::time();
+	for(int i = 0; i < shadowRays.size(); i++){
+		const ShadowRay& r = shadowRays[i];
+		if(world->lineOfSight(r.origin, r.origin + r.direction * r.distance)){
+			inlineVisible++;
+		}
+	}
+	double inlineTime = G3D::System::time() - start;
+
+	// Every ray carries one unit to the same sample, so the sum counts the visible ones
+	ShadowQueue queue;
+	queue.setSample(0);
+	G3D::Radiance3 visible = G3D::Radiance3::zero();
+	start = G3D::System::time();
+	for(int t = 0; t + 1 < tileStart.size(); t++){
+		for(int i = tileStart[t]; i < tileStart[t + 1]; i++){
+			const ShadowRay& r = shadowRays[i];
+			queue.push(r.origin, r.direction, r.distance, G3D::Radiance3(1.0f));
+		}
+		queue.trace(*world, &visible);
+	}
+	double batchedTime = G3D::System::time() - start;
+	int batchedVisible = (int)visible.r;
+
+	G3D::debugPrintf("%d shadow rays from %dx%d primary hits, %d lights, batched per %dx%d tile\n", (int)shadowRays.size(), width, height,
+		lights.size(), SHADOW_TILE_SIZE, SHADOW_TILE_SIZE);
+	G3D::debugPrintf("  inline:  %f s, %.0f rays/s, %d visible\n", inlineTime, shadowRays.size() / inlineTime, inlineVisible);
+	G3D::debugPrintf("  batched: %f s, %.0f rays/s, %d visible (%.2fx)\n", batchedTime, shadowRays.size() / batchedTime, batchedVisible,
+		batchedTime > 0.0 ? inlineTime / batchedTime : 0.0);
+}
+
+void benchmarkWavefront(World *world, const shared_ptr<G3D::Camera>& camera, const G3D::Rect2D& viewport) {
+	int width = (int)viewport.width();
+	int height = (int)viewport.height();
+	const char *names[2] = { "recursive", "wavefront" };
+	std::vector<float> luminance[2];
+	float error = 0.0f;
+
+	for(int mode = 0; mode < 2; mode++){
+		Renderer renderer(width, height);
+		renderer.world = world;
+		renderer.camera = camera;
+		renderer.raysPerPixel = WAVEFRONT_SPP;
+		renderer.wavefront = (mode == 1);
+
+		// An untimed frame first, so both modes start with warm arenas and caches
+		renderer.renderFirstFrame();
+		renderer.pool->waitForCompletion();
+		renderer.resetRayCounts();
+
+		double start = G3D::System::time();
+		renderer.renderFirstFrame();
+		renderer.pool->waitForCompletion();
+		double time = G3D::System::time() - start;
+
+		long long primary, shadow, secondary;
+		renderer.rayCounts(primary, shadow, secondary);
+		long long rays = primary + shadow + secondary;
+		G3D::debugPrintf("%s: %f s, %lld primary, %lld shadow, %lld secondary rays, %.0f rays/s\n", names[mode], time,
+			primary, shadow, secondary, rays / time);
+
+		luminance[mode].resize(width * height);
+		for(int i = 0; i < renderer.tree->point_count(); i++){
+			const QuadTreeNode& point = renderer.tree->points[i];
+			luminance[mode][point.y * width + point.x] = point.color.average();
+		}
+
+		// The renderer's own estimate of the relative noise in a pixel, averaged over the leaves
+		if(mode == 0){
+			int leaves = 0;
+			for(int i = 0; i < renderer.tree->leafCount(); i++){
+				float e = renderer.leafError(renderer.tree->firstLeaf() + i);
+				if(e < (float)G3D::inf()){
+					error += e;
+					leaves++;
+				}
+			}
+			error = (leaves > 0) ? error / leaves : 0.0f;
+		}
+	}
+
+	double sum[2] = { 0.0, 0.0 };
+	double difference = 0.0;
+	for(int i = 0; i < width * height; i++){
+		sum[0] += luminance[0][i];
+		sum[1] += luminance[1][i];
+		difference += fabs(luminance[0][i] - luminance[1][i]);
+	}
+	G3D::debugPrintf("mean luminance %f recursive, %f wavefront; pixels differ by %.2f%% on average, noise %.2f%%\n",
+		sum[0] / (width * height), sum[1] / (width * height), sum[0] > 0.0 ? 100.0 * difference / sum[0] : 0.0, 100.0 * error);
+}
+
+void benchmarkCompactGeometry(World *world, const shared_ptr<G3D::Camera>& camera, const G3D::Rect2D& viewport) {
+	std::vector<G3D::Vector3> original;
+	world->trianglePositions(original);
+	G3D::Vector3 lo(G3D::finf(), G3D::finf(), G3D::finf());
+	G3D::Vector3 hi = -lo;
+	for(int v = 0; v < original.size(); v++){
+		lo = lo.min(original[v]);
+		hi = hi.max(original[v]);
+	}
+
+	// Copies side by side in x and z with a gap between them, the first where the scene is,
+	// so the camera still looks at it but the tree is COMPACT_GRID_SIZE^2 times as large
+	const G3D::Vector3 spacing = (hi - lo) * 1.25f;
+	std::vector<G3D::Vector3> positions;
+	positions.reserve(original.size() * COMPACT_GRID_SIZE * COMPACT_GRID_SIZE);
+	for(int i = 0; i < COMPACT_GRID_SIZE; i++){
+		for(int j = 0; j < COMPACT_GRID_SIZE; j++){
+			G3D::Vector3 offset(spacing.x * i, 0.0f, spacing.z * j);
+			for(int v = 0; v < original.size(); v++){
+				positions.push_back(original[v] + offset);
+			}
+		}
+	}
+	const int triCount = (int)positions.size() / 3;
+
+	int width = (int)viewport.width();
+	int height = (int)viewport.height();
+	std::vector<G3D::Ray> rays;
+	rays.reserve(width * height);
+	for(int ty = 0; ty < height; ty += 2){
+		for(int tx = 0; tx < width; tx += 4){
+			for(int y = ty; y < ty + 2 && y < height; y++){
+				for(int x = tx; x < tx + 4 && x < width; x++){
+					rays.push_back(camera->worldRay(x + 0.5f, y + 0.5f, viewport));
+				}
+			}
+		}
+	}
+
+	// Either mode keeps the scene's G3D::Tris, vertices and material indices for shading, so a
+	// larger scene costs them per triangle on top of its tree
+	const double sceneBytes = world->geometryFootprint() / (double)G3D::max(1, world->uniqueTriangleCount());
+	const char *names[2] = { "full", "compact" };
+	std::vector<BVH::Hit> hits[2];
+	G3D::debugPrintf("%d triangles (%d copies of %d), %d primary rays (%dx%d)\n", triCount, COMPACT_GRID_SIZE * COMPACT_GRID_SIZE,
+		world->triangleCount(), (int)rays.size(), width, height);
+	for(int mode = 0; mode < 2; mode++){
+		BVH bvh;
+		bvh.setCompact(mode == 1);
+		double start = G3D::System::time();
+		bvh.build(positions);
+		double buildTime = G3D::System::time() - start;
+
+		int scalarHits = 0;
+		start = G3D::System::time();
+		for(int i = 0; i < rays.size(); i++){
+			BVH::Hit hit;
+			if(bvh.intersect(rays[i], (float)G3D::inf(), hit)){
+				scalarHits++;
+			}
+		}
+		double scalarTime = G3D::System::time() - start;
+
+		// intersect8 fills in every lane, even past the last ray
+		hits[mode].resize(rays.size() + RayPacket::SIZE);
+		start = G3D::System::time();
+		for(int i = 0; i < rays.size(); i += RayPacket::SIZE){
+			RayPacket packet;
+			for(int lane = 0; lane < RayPacket::SIZE && i + lane < rays.size(); lane++){
+				packet.set(lane, rays[i + lane], (float)G3D::inf());
+				packet.count++;
+			}
+			bvh.intersect8(packet, &hits[mode][i]);
+		}
+		double packetTime = G3D::System::time() - start;
+
+		double bvhBytes = bvh.memoryFootprint() / (double)triCount;
+		G3D::debugPrintf("  %-7s built in %f s, BVH %.1f MB, %.1f bytes/triangle (%.1f with the scene's), scalar %.0f rays/s (%d hits), packets %.0f rays/s\n", names[mode],
+			buildTime, bvh.memoryFootprint() / (1024.0 * 1024.0), bvhBytes, bvhBytes + sceneBytes, rays.size() / scalarTime, scalarHits,
+			rays.size() / packetTime);
+	}
+
+	// Quantization moves vertices by up to 1/65535 of their leaf's bounds, so rays grazing an edge may hit its neighbor
+	int differing = 0;
+	for(int i = 0; i < rays.size(); i++){
+		if(hits[0][i].triIndex != hits[1][i].triIndex){
+			differing++;
+		}
+	}
+	G3D::debugPrintf("  %d rays (%.3f%%) hit a different triangle in the compact BVH\n", differing, 100.0 * differing / G3D::max(1, (int)rays.size()));
+	G3D::debugPrintf("  shading keeps %.1f bytes/triangle in both modes: a %d-byte G3D::Tri, its share of the vertex arrays and a 2-byte material index\n",
+		sceneBytes, (int)sizeof(G3D::Tri));
+}
+
+void benchmarkInstancing(World *world, const shared_ptr<G3D::Camera>& camera, const G3D::Rect2D& viewport) {
+	// What World built before instancing: one tree over every placed triangle in world space
+	std::vector<G3D::Vector3> positions;
+	world->trianglePositions(positions);
+	BVH flat;
+	double start = G3D::System::time();
+	flat.build(positions);
+	double flatBuild = G3D::System::time() - start;
+
+	int width = (int)viewport.width();
+	int height = (int)viewport.height();
+	std::vector<G3D::Ray> rays;
+	rays.reserve(width * height);
+	for(int ty = 0; ty < height; ty += 2){
+		for(int tx = 0; tx < width; tx += 4){
+			for(int y = ty; y < ty + 2 && y < height; y++){
+				for(int x = tx; x < tx + 4 && x < width; x++){
+					rays.push_back(camera->worldRay(x + 0.5f, y + 0.5f, viewport));
+				}
+			}
+		}
+	}
+
+	// intersect8 fills in every lane, even past the last ray
+	std::vector<BVH::Hit> hits[2];
+	double packetTime[2];
+	long long nodes[2];
+	for(int mode = 0; mode < 2; mode++){
+		hits[mode].resize(rays.size() + RayPacket::SIZE);
+		nodes[mode] = 0;
+		start = G3D::System::time();
+		for(int i = 0; i < rays.size(); i += RayPacket::SIZE){
+			RayPacket packet;
+			for(int lane = 0; lane < RayPacket::SIZE && i + lane < rays.size(); lane++){
+				packet.set(lane, rays[i + lane], (float)G3D::inf());
+				packet.count++;
+			}
+			if(mode == 0){
+				flat.intersect8(packet, &hits[mode][i]);
+			} else {
+				world->intersect8(packet, &hits[mode][i]);
+			}
+			nodes[mode] += packet.nodesVisited;
+		}
+		packetTime[mode] = G3D::System::time() - start;
+	}
+
+	// trianglePositions lists the triangles in the order hits number them, so both trees should agree
+	int differing = 0;
+	for(int i = 0; i < rays.size(); i++){
+		if(hits[0][i].triIndex != hits[1][i].triIndex){
+			differing++;
+		}
+	}
+
+	G3D::debugPrintf("%d instances of %d meshes: %d triangles placed, %d stored; %d primary rays (%dx%d)\n", world->instanceCount(),
+		world->meshCount(), world->triangleCount(), world->uniqueTriangleCount(), (int)rays.size(), width, height);
+	G3D::debugPrintf("  flat BVH:     built in %f s, %.1f MB, packets %.0f rays/s, %.1f nodes/packet\n", flatBuild,
+		flat.memoryFootprint() / (1024.0 * 1024.0), rays.size() / packetTime[0], nodes[0] / (double)((rays.size() + RayPacket::SIZE - 1) / RayPacket::SIZE));
+	G3D::debugPrintf("  two-level:    built in %f s, %.1f MB, packets %.0f rays/s, %.1f nodes/packet\n", world->accelerationSeconds(),
+		world->accelerationFootprint() / (1024.0 * 1024.0), rays.size() / packetTime[1], nodes[1] / (double)((rays.size() + RayPacket::SIZE - 1) / RayPacket::SIZE));
+	G3D::debugPrintf("  %d rays (%.3f%%) hit a different triangle\n", differing, 100.0 * differing / G3D::max(1, (int)rays.size()));
+}
+
+void benchmarkDynamicInstances(World *world, const shared_ptr<G3D::Camera>& camera, const G3D::Rect2D& viewport) {
+	if(world->spins.empty()){
+		for(int i = 0; i < world->instanceCount(); i += DYNAMIC_STRIDE){
+			World::Spin spin;
+			spin.instance = i;
+			spin.frame = world->instanceFrame(i);
+			spin.degreesPerSecond = DYNAMIC_DEGREES_PER_SECOND;
+			world->spins.push_back(spin);
+		}
+	}
+
+	int width = (int)viewport.width();
+	int height = (int)viewport.height();
+	Renderer renderer(width, height);
+	renderer.world = world;
+	renderer.camera = camera;
+
+	// A full frame, as after a move with the single BVH, which had to be built again first
+	renderer.renderFirstFrame();
+	renderer.pool->waitForCompletion();
+	renderer.resetRayCounts();
+	double start = G3D::System::time();
+	renderer.renderFirstFrame();
+	renderer.pool->waitForCompletion();
+	double fullFrame = G3D::System::time() - start;
+	long long fullPrimary, shadow, secondary;
+	renderer.rayCounts(fullPrimary, shadow, secondary);
+	renderer.calculateNeighborDiff();
+	renderer.pool->waitForCompletion();
+	renderer.sortRenderOrder();
+
+	std::vector<G3D::Vector3> positions;
+	start = G3D::System::time();
+	world->trianglePositions(positions);
+	BVH flat;
+	flat.build(positions);
+	double flatRebuild = G3D::System::time() - start;
+
+	// Each frame runs the pass App runs after an animation step, tracing only the leaves that saw the moved instances
+	double refit = 0.0, retrace = 0.0;
+	long long leaves = 0;
+	std::vector<G3D::AABox> moved;
+	renderer.resetRayCounts();
+	for(int frame = 1; frame <= DYNAMIC_FRAMES; frame++){
+		moved.clear();
+		start = G3D::System::time();
+		world->animate(frame / 30.0, moved);
+		refit += G3D::System::time() - start;
+
+		start = G3D::System::time();
+		leaves += renderer.discardSeen(moved);
+		renderer.retraceSeen();
+		renderer.pool->waitForCompletion();
+		retrace += G3D::System::time() - start;
+	}
+	long long primary;
+	renderer.rayCounts(primary, shadow, secondary);
+
+	float refitArea = world->instanceBVH().surfaceArea();
+	start = G3D::System::time();
+	world->rebuildInstanceBVH();
+	double instanceRebuild = G3D::System::time() - start;
+	float builtArea = world->instanceBVH().surfaceArea();
+
+	G3D::debugPrintf("%d of %d instances moving for %d frames, %d triangles (%dx%d)\n", (int)world->spins.size(), world->instanceCount(),
+		DYNAMIC_FRAMES, world->triangleCount(), width, height);
+	G3D::debugPrintf("  refit:            %f ms per frame; instance BVH rebuild %f ms, single BVH rebuild %f ms\n",
+		1000.0 * refit / DYNAMIC_FRAMES, 1000.0 * instanceRebuild, 1000.0 * flatRebuild);
+	G3D::debugPrintf("  refit instance BVH boxes have %.2fx the surface area of a new build's\n", refitArea / G3D::max(builtArea, 1e-6f));
+	G3D::debugPrintf("  re-traced:        %.1f%% of leaves, %lld primary rays, %f s per frame\n", 100.0 * leaves / ((double)DYNAMIC_FRAMES * renderer.tree->leafCount()),
+		primary / DYNAMIC_FRAMES, retrace / DYNAMIC_FRAMES);
+	G3D::debugPrintf("  full frame:       %lld primary rays, %f s\n", fullPrimary, fullFrame);
+}
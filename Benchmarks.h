@@ -0,0 +1,55 @@
+#pragma once
+#include <G3D/Rect2D.h>
+#include <GLG3D/Camera.h>
+
+class World;
+
+/**
+  Stand-alone micro-benchmarks, run from the command line instead of the
+  interactive demo.  Results are printed with debugPrintf.
+ */
+
+/** Compares appending to the render order under a mutex against RenderOrderBuffer at 4, 16 and 64 threads. */
+void benchmarkRenderOrderContention();
+
+/** Builds and rebuilds the QuadTree at 720p, 1080p, 4K and 8K and prints the times and memory footprint. */
+void benchmarkQuadTreeBuild();
+
+/** Times ordering the leaves of a 4K QuadTree by neighborColorDiff per pass, with the std::priority_queue
+	the renderer used to rebuild and with RenderQueue, and checks that both give the same order of buckets. */
+void benchmarkRenderOrderSort();
+
+/** Traces one primary ray per pixel of viewport through world, one ray at a time and as
+	RayPacket::SIZE-wide packets of 4x2 pixel tiles, and prints rays/sec for each. */
+void benchmarkPacketTracing(World *world, const shared_ptr<G3D::Camera>& camera, const G3D::Rect2D& viewport);
+
+/** Extracts the triangles of world serially, builds a G3D::TriTree and a BVH (on one thread and on
+	all of them) over them and prints the build time and footprint of each, then rays/sec of one
+	primary ray per pixel and one shadow ray per hit. */
+void benchmarkAccelerationStructures(World *world, const shared_ptr<G3D::Camera>& camera, const G3D::Rect2D& viewport);
+
+/** Casts the shadow rays the renderer would from one primary hit per pixel of viewport, tile by
+	tile, and traces them one at a time as they are made and through a ShadowQueue per tile.
+	Prints shadow rays/sec for each and checks that both find the same lights visible. */
+void benchmarkShadowRays(World *world, const shared_ptr<G3D::Camera>& camera, const G3D::Rect2D& viewport);
+
+/** Renders the first frame of viewport with 4 rays per pixel, once following every
+	path depth first and once as a wavefront, and prints the rays/sec of each and how much the
+	two images differ against the noise of either. */
+void benchmarkWavefront(World *world, const shared_ptr<G3D::Camera>& camera, const G3D::Rect2D& viewport);
+
+/** Builds a BVH over 16 copies of world's triangles, once storing them in full and once quantized to
+	their leaves (see BVH::setCompact), and prints the bytes per triangle and primary rays/sec of each
+	and how many rays hit a different triangle. */
+void benchmarkCompactGeometry(World *world, const shared_ptr<G3D::Camera>& camera, const G3D::Rect2D& viewport);
+
+/** Builds one BVH over every triangle world places, the way World did before instancing, and
+	prints its build time, size and primary rays/sec as packets next to world's mesh and instance
+	BVHs, and how many rays hit a different triangle. */
+void benchmarkInstancing(World *world, const shared_ptr<G3D::Camera>& camera, const G3D::Rect2D& viewport);
+
+/** Turns the world's spinning instances, or every few instances if it has none, for a second of
+	frames, refitting the instance BVH and re-tracing the leaves that saw them each frame, and
+	prints the cost per frame next to building the instance BVH and a single BVH again and to
+	rendering a full frame. */
+void benchmarkDynamicInstances(World *world, const shared_ptr<G3D::Camera>& camera, const G3D::Rect2D& viewport);
@@ -0,0 +1,159 @@
+#include "Framebuffer.h"
+
+#include <string.h>
+#include <new>
+#include <thread>
+#include <xmmintrin.h>
+
+namespace {
+
+const int CACHE_LINE = 64;
+/** The fewest pixels whose colors and sample counts both fill whole cache lines */
+const int ALIGNED_TILE_PIXELS = 32;
+
+template<class T>
+T* allocateAtomics(int count) {
+	T *atomics = (T*)_mm_malloc(G3D::max(1, count) * sizeof(T), CACHE_LINE);
+	for(int i = 0; i < count; i++){
+		new (&atomics[i]) T(0);
+	}
+	return atomics;
+}
+
+inline unsigned int floatBits(float f) {
+	unsigned int bits;
+	memcpy(&bits, &f, sizeof(bits));
+	return bits;
+}
+
+inline float bitsFloat(unsigned int bits) {
+	float f;
+	memcpy(&f, &bits, sizeof(f));
+	return f;
+}
+
+}
+
+Framebuffer::Framebuffer(void) :
+	m_colors(NULL),
+	m_samples(NULL),
+	m_versions(NULL),
+	m_versionStride(1),
+	m_slots(0),
+	m_alignTiles(false)
+{
+}
+
+Framebuffer::~Framebuffer(void)
+{
+	_mm_free(this->m_colors);
+	_mm_free(this->m_samples);
+	_mm_free(this->m_versions);
+}
+
+void Framebuffer::resize(const QuadTree& tree, bool alignTiles) {
+	this->m_alignTiles = alignTiles;
+	const int leaves = tree.leafCount();
+
+	this->m_tileStart.resize(leaves);
+	int slot = 0;
+	for(int leaf = 0; leaf < leaves; leaf++){
+		int node = tree.firstLeaf() + leaf;
+		if(alignTiles){
+			slot = (slot + ALIGNED_TILE_PIXELS - 1) / ALIGNED_TILE_PIXELS * ALIGNED_TILE_PIXELS;
+		}
+		this->m_tileStart[leaf] = slot;
+		slot += tree.pointEnd(node) - tree.pointBegin(node);
+	}
+	this->m_slots = slot;
+
+	const int width = (int)tree.boundary(0).width();
+	this->m_pixelSlot.resize(tree.point_count());
+	for(int leaf = 0; leaf < leaves; leaf++){
+		int node = tree.firstLeaf() + leaf;
+		int begin = tree.pointBegin(node);
+		for(int p = begin; p < tree.pointEnd(node); p++){
+			const QuadTreeNode& point = tree.points[p];
+			this->m_pixelSlot[point.y * width + point.x] = this->m_tileStart[leaf] + p - begin;
+		}
+	}
+
+	_mm_free(this->m_colors);
+	_mm_free(this->m_samples);
+	_mm_free(this->m_versions);
+	this->m_colors = allocateAtomics<std::atomic<unsigned int> >(3 * slot);
+	this->m_samples = allocateAtomics<std::atomic<unsigned short> >(slot);
+	this->m_versionStride = alignTiles ? CACHE_LINE / sizeof(std::atomic<unsigned int>) : 1;
+	this->m_versions = allocateAtomics<std::atomic<unsigned int> >(leaves * this->m_versionStride);
+}
+
+bool Framebuffer::alignTiles() const {
+	return this->m_alignTiles;
+}
+
+void Framebuffer::publish(const QuadTree& tree, int node) {
+	const int leaf = node - tree.firstLeaf();
+	std::atomic<unsigned int>& version = this->m_versions[leaf * this->m_versionStride];
+	unsigned int v = version.load(std::memory_order_relaxed);
+
+	version.store(v + 1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+
+	int slot = this->m_tileStart[leaf];
+	for(int p = tree.pointBegin(node); p < tree.pointEnd(node); p++, slot++){
+		const QuadTreeNode& point = tree.points[p];
+		this->m_colors[3 * slot + 0].store(floatBits(point.color.r), std::memory_order_relaxed);
+		this->m_colors[3 * slot + 1].store(floatBits(point.color.g), std::memory_order_relaxed);
+		this->m_colors[3 * slot + 2].store(floatBits(point.color.b), std::memory_order_relaxed);
+		this->m_samples[slot].store(point.samples, std::memory_order_relaxed);
+	}
+
+	version.store(v + 2, std::memory_order_release);
+}
+
+void Framebuffer::resolve(const QuadTree& tree, int node, G3D::Image3& image) const {
+	const int leaf = node - tree.firstLeaf();
+	const std::atomic<unsigned int>& version = this->m_versions[leaf * this->m_versionStride];
+	const int begin = tree.pointBegin(node);
+	const int end = tree.pointEnd(node);
+
+	while(true){
+		unsigned int v = version.load(std::memory_order_acquire);
+		if(v & 1){
+			std::this_thread::yield();
+			continue;
+		}
+
+		int slot = this->m_tileStart[leaf];
+		for(int p = begin; p < end; p++, slot++){
+			const QuadTreeNode& point = tree.points[p];
+			image.fastSet(point.x, point.y, this->slotColor(slot));
+		}
+
+		// A publication that started while copying leaves the tile torn; copy it again
+		std::atomic_thread_fence(std::memory_order_acquire);
+		if(version.load(std::memory_order_relaxed) == v){
+			return;
+		}
+	}
+}
+
+G3D::Color3 Framebuffer::slotColor(int slot) const {
+	return G3D::Color3(bitsFloat(this->m_colors[3 * slot + 0].load(std::memory_order_relaxed)),
+		bitsFloat(this->m_colors[3 * slot + 1].load(std::memory_order_relaxed)),
+		bitsFloat(this->m_colors[3 * slot + 2].load(std::memory_order_relaxed)));
+}
+
+G3D::Color3 Framebuffer::color(int pixel) const {
+	return this->slotColor(this->m_pixelSlot[pixel]);
+}
+
+int Framebuffer::samples(int pixel) const {
+	return this->m_samples[this->m_pixelSlot[pixel]].load(std::memory_order_relaxed);
+}
+
+size_t Framebuffer::memoryFootprint() const {
+	return this->m_slots * (3 * sizeof(std::atomic<unsigned int>) + sizeof(std::atomic<unsigned short>)) +
+		this->m_tileStart.capacity() * sizeof(int) + this->m_pixelSlot.capacity() * sizeof(int) +
+		this->m_tileStart.size() * this->m_versionStride * sizeof(std::atomic<unsigned int>);
+}
@@ -0,0 +1,68 @@
+#pragma once
+#include <G3D/Color3.h>
+#include <G3D/Image3.h>
+
+#include <atomic>
+#include <vector>
+
+#include "QuadTree.h"
+
+/**
+  The published image of a frame, stored one tile per QuadTree leaf.
+
+  Workers trace into the points of the leaf they own and, once a leaf is
+  done, publish() copies its colors and sample counts here.  Readers on other
+  threads use resolve(), which only ever sees a whole publication of a tile:
+  every tile has a sequence number that is odd while it is being written, and
+  a reader that sees it change copies the tile again.  Writers never wait.
+
+  A pixel with zero samples has not been traced this frame, whatever its color.
+
+  With alignTiles, every tile and its sequence number start on their own
+  64-byte cache line, so workers publishing neighbouring tiles never write to
+  the same line, at the cost of padding each tile to a multiple of 32 pixels.
+ */
+class Framebuffer
+{
+public:
+	Framebuffer(void);
+	~Framebuffer(void);
+
+	/** Lays out one tile per leaf of tree, all untraced.  No pass may be running. */
+	void resize(const QuadTree& tree, bool alignTiles);
+
+	bool alignTiles() const;
+
+	/** Copies the colors and sample counts of the points of a leaf.  Only call from the thread that owns it. */
+	void publish(const QuadTree& tree, int node);
+
+	/** Writes the last publication of a leaf into image, which has the size of the tree */
+	void resolve(const QuadTree& tree, int node, G3D::Image3& image) const;
+
+	/** Published color and sample count of the pixel y * width + x.  Only call while no pass is running. */
+	G3D::Color3 color(int pixel) const;
+	int samples(int pixel) const;
+
+	/** Bytes held by the colors, sample counts and layout */
+	size_t memoryFootprint() const;
+
+private:
+	/** Tile of leaf i starts at m_tileStart[i] in m_colors and m_samples */
+	std::vector<int>				m_tileStart;
+	/** Slot of each pixel, y * width + x, in m_colors and m_samples */
+	std::vector<int>				m_pixelSlot;
+	/** The bits of the red, green and blue of each slot.  Relaxed atomics cost nothing more
+		than plain loads and stores, and keep a reader racing a publication well defined. */
+	std::atomic<unsigned int>		*m_colors;
+	std::atomic<unsigned short>		*m_samples;
+	/** Sequence number of leaf i at m_versions[i * m_versionStride] */
+	std::atomic<unsigned int>		*m_versions;
+	int								m_versionStride;
+	int								m_slots;
+	bool							m_alignTiles;
+
+	G3D::Color3 slotColor(int slot) const;
+
+	Framebuffer(const Framebuffer&);
+	Framebuffer& operator=(const Framebuffer&);
+};
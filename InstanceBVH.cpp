@@ -0,0 +1,457 @@
+#include "InstanceBVH.h"
+
+#include <algorithm>
+
+namespace {
+
+struct CenterLess {
+	const std::vector<G3D::Vector3> *centers;
+	int axis;
+
+	bool operator()(int left, int right) const {
+		return (*centers)[left][axis] < (*centers)[right][axis];
+	}
+};
+
+inline G3D::Point3 transformPoint(const float m[3][4], float x, float y, float z) {
+	return G3D::Point3(m[0][0] * x + m[0][1] * y + m[0][2] * z + m[0][3],
+		m[1][0] * x + m[1][1] * y + m[1][2] * z + m[1][3],
+		m[2][0] * x + m[2][1] * y + m[2][2] * z + m[2][3]);
+}
+
+inline G3D::Vector3 transformVector(const float m[3][4], float x, float y, float z) {
+	return G3D::Vector3(m[0][0] * x + m[0][1] * y + m[0][2] * z,
+		m[1][0] * x + m[1][1] * y + m[1][2] * z,
+		m[2][0] * x + m[2][1] * y + m[2][2] * z);
+}
+
+}
+
+InstanceBVH::InstanceBVH(void)
+{
+}
+
+void InstanceBVH::build(const std::vector<Instance>& instances) {
+	std::vector<Placement> placements;
+	std::vector<int> instanceOf;
+	std::vector<G3D::Vector3> lo, hi, centers;
+	for(int i = 0; i < instances.size(); i++){
+		const Instance& instance = instances[i];
+		Placement placement;
+		placement.mesh = instance.mesh;
+		placement.triangleOffset = instance.triangleOffset;
+		G3D::Vector3 boxLo, boxHi;
+		if(!place(placement, instance.frame, boxLo, boxHi)){
+			continue;
+		}
+		lo.push_back(boxLo);
+		hi.push_back(boxHi);
+		centers.push_back((boxLo + boxHi) * 0.5f);
+		placements.push_back(placement);
+		instanceOf.push_back(i);
+	}
+
+	std::vector<int> order(placements.size());
+	for(int i = 0; i < order.size(); i++){
+		order[i] = i;
+	}
+
+	this->m_nodes.clear();
+	if(!placements.empty()){
+		this->m_nodes.reserve(2 * placements.size());
+		this->buildRecursive(order, lo, hi, centers, 0, (int)placements.size());
+	}
+	this->m_placements.resize(placements.size());
+	this->m_lo.resize(placements.size());
+	this->m_hi.resize(placements.size());
+	this->m_placementOf.assign(instances.size(), -1);
+	for(int i = 0; i < order.size(); i++){
+		this->m_placements[i] = placements[order[i]];
+		this->m_lo[i] = lo[order[i]];
+		this->m_hi[i] = hi[order[i]];
+		this->m_placementOf[instanceOf[order[i]]] = i;
+	}
+
+	// Parents and the leaf of each placement, for refitting the boxes above a moved one
+	this->m_parents.assign(this->m_nodes.size(), -1);
+	this->m_leaves.resize(placements.size());
+	for(int n = 0; n < this->m_nodes.size(); n++){
+		const Node& node = this->m_nodes[n];
+		if(node.count > 0){
+			for(int p = node.offset; p < node.offset + node.count; p++){
+				this->m_leaves[p] = n;
+			}
+		} else {
+			this->m_parents[n + 1] = n;
+			this->m_parents[node.offset] = n;
+		}
+	}
+}
+
+bool InstanceBVH::place(Placement& placement, const G3D::CFrame& frame, G3D::Vector3& lo, G3D::Vector3& hi) {
+	G3D::Vector3 meshLo, meshHi;
+	if(!placement.mesh->bounds(meshLo, meshHi)){
+		return false;
+	}
+
+	// The world box of the mesh's box, from its eight corners
+	for(int c = 0; c < 8; c++){
+		G3D::Point3 corner((c & 1) ? meshHi.x : meshLo.x, (c & 2) ? meshHi.y : meshLo.y, (c & 4) ? meshHi.z : meshLo.z);
+		G3D::Point3 world = frame.pointToWorldSpace(corner);
+		lo = (c == 0) ? world : lo.min(world);
+		hi = (c == 0) ? world : hi.max(world);
+	}
+
+	const G3D::CFrame toMesh = frame.inverse();
+	for(int r = 0; r < 3; r++){
+		for(int c = 0; c < 3; c++){
+			placement.toMesh[r][c] = toMesh.rotation[r][c];
+		}
+		placement.toMesh[r][3] = toMesh.translation[r];
+	}
+	return true;
+}
+
+int InstanceBVH::setFrame(int instance, const G3D::CFrame& frame) {
+	const int p = this->m_placementOf[instance];
+	if(p < 0){
+		return 0;
+	}
+	place(this->m_placements[p], frame, this->m_lo[p], this->m_hi[p]);
+
+	// The leaf's box is the union of its placements', every other node's that of its two
+	// children.  Nodes above one whose box did not change keep theirs.
+	int refit = 0;
+	for(int n = this->m_leaves[p]; n >= 0; n = this->m_parents[n]){
+		Node& node = this->m_nodes[n];
+		G3D::Vector3 boxLo, boxHi;
+		if(node.count > 0){
+			boxLo = this->m_lo[node.offset];
+			boxHi = this->m_hi[node.offset];
+			for(int i = node.offset + 1; i < node.offset + node.count; i++){
+				boxLo = boxLo.min(this->m_lo[i]);
+				boxHi = boxHi.max(this->m_hi[i]);
+			}
+		} else {
+			const Node& left = this->m_nodes[n + 1];
+			const Node& right = this->m_nodes[node.offset];
+			for(int a = 0; a < 3; a++){
+				boxLo[a] = G3D::min(left.lo[a], right.lo[a]);
+				boxHi[a] = G3D::max(left.hi[a], right.hi[a]);
+			}
+		}
+
+		bool changed = false;
+		for(int a = 0; a < 3; a++){
+			changed = changed || node.lo[a] != boxLo[a] || node.hi[a] != boxHi[a];
+			node.lo[a] = boxLo[a];
+			node.hi[a] = boxHi[a];
+		}
+		if(!changed){
+			break;
+		}
+		refit++;
+	}
+	return refit;
+}
+
+bool InstanceBVH::bounds(int instance, G3D::Vector3& lo, G3D::Vector3& hi) const {
+	const int p = this->m_placementOf[instance];
+	if(p < 0){
+		return false;
+	}
+	lo = this->m_lo[p];
+	hi = this->m_hi[p];
+	return true;
+}
+
+float InstanceBVH::surfaceArea() const {
+	float area = 0.0f;
+	for(int n = 0; n < this->m_nodes.size(); n++){
+		const Node& node = this->m_nodes[n];
+		float x = node.hi[0] - node.lo[0], y = node.hi[1] - node.lo[1], z = node.hi[2] - node.lo[2];
+		area += 2.0f * (x * y + y * z + z * x);
+	}
+	return area;
+}
+
+int InstanceBVH::buildRecursive(std::vector<int>& order, const std::vector<G3D::Vector3>& lo, const std::vector<G3D::Vector3>& hi,
+	const std::vector<G3D::Vector3>& centers, int begin, int end) {
+	int index = this->m_nodes.size();
+	this->m_nodes.push_back(Node());
+
+	G3D::Vector3 boxLo = lo[order[begin]], boxHi = hi[order[begin]];
+	G3D::Vector3 centerLo = centers[order[begin]], centerHi = centers[order[begin]];
+	for(int i = begin; i < end; i++){
+		boxLo = boxLo.min(lo[order[i]]);
+		boxHi = boxHi.max(hi[order[i]]);
+		centerLo = centerLo.min(centers[order[i]]);
+		centerHi = centerHi.max(centers[order[i]]);
+	}
+
+	Node node;
+	for(int a = 0; a < 3; a++){
+		node.lo[a] = boxLo[a];
+		node.hi[a] = boxHi[a];
+	}
+
+	if(end - begin <= MAX_LEAF_SIZE){
+		node.offset = begin;
+		node.count = (unsigned short)(end - begin);
+		node.axis = 0;
+		this->m_nodes[index] = node;
+		return index;
+	}
+
+	G3D::Vector3 extent = centerHi - centerLo;
+	CenterLess less;
+	less.centers = &centers;
+	less.axis = (extent.x >= extent.y && extent.x >= extent.z) ? 0 : ((extent.y >= extent.z) ? 1 : 2);
+	int middle = (begin + end) / 2;
+	std::nth_element(order.begin() + begin, order.begin() + middle, order.begin() + end, less);
+
+	node.count = 0;
+	node.axis = (unsigned short)less.axis;
+	this->buildRecursive(order, lo, hi, centers, begin, middle);
+	node.offset = this->buildRecursive(order, lo, hi, centers, middle, end);
+	this->m_nodes[index] = node;
+	return index;
+}
+
+int InstanceBVH::instanceCount() const {
+	return this->m_placements.size();
+}
+
+int InstanceBVH::nodeCount() const {
+	return this->m_nodes.size();
+}
+
+size_t InstanceBVH::memoryFootprint() const {
+	return this->m_nodes.size() * (sizeof(Node) + sizeof(int)) + this->m_placements.size() * (sizeof(Placement) + 2 * sizeof(G3D::Vector3) + sizeof(int))
+		+ this->m_placementOf.size() * sizeof(int);
+}
+
+bool InstanceBVH::intersect(const G3D::Ray& ray, float maxDistance, BVH::Hit& hit, bool anyHit) const {
+	hit.triIndex = -1;
+	if(this->m_nodes.empty()){
+		return false;
+	}
+
+	const G3D::Point3& o = ray.origin();
+	const G3D::Vector3& d = ray.direction();
+	const float inv[3] = { 1.0f / d.x, 1.0f / d.y, 1.0f / d.z };
+	const float origin[3] = { o.x, o.y, o.z };
+	const bool negative[3] = { d.x < 0.0f, d.y < 0.0f, d.z < 0.0f };
+	float tMax = maxDistance;
+
+	int stack[STACK_SIZE];
+	int stackSize = 0;
+	stack[stackSize++] = 0;
+
+	while(stackSize > 0) {
+		int index = stack[--stackSize];
+		const Node& node = this->m_nodes[index];
+
+		float tNear = 0.0f;
+		float tFar = tMax;
+		for(int a = 0; a < 3; a++){
+			float t0 = (node.lo[a] - origin[a]) * inv[a];
+			float t1 = (node.hi[a] - origin[a]) * inv[a];
+			if(t0 > t1){
+				std::swap(t0, t1);
+			}
+			tNear = t0 > tNear ? t0 : tNear;
+			tFar = t1 < tFar ? t1 : tFar;
+		}
+		if(tNear > tFar){
+			continue;
+		}
+
+		if(node.count == 0){
+			debugAssertM(stackSize + 2 <= STACK_SIZE, "InstanceBVH deeper than its traversal stack");
+			if(negative[node.axis]){
+				stack[stackSize++] = index + 1;
+				stack[stackSize++] = node.offset;
+			} else {
+				stack[stackSize++] = node.offset;
+				stack[stackSize++] = index + 1;
+			}
+			continue;
+		}
+
+		for(int i = node.offset; i < node.offset + node.count; i++){
+			const Placement& placement = this->m_placements[i];
+			G3D::Ray local = G3D::Ray::fromOriginAndDirection(transformPoint(placement.toMesh, o.x, o.y, o.z),
+				transformVector(placement.toMesh, d.x, d.y, d.z));
+			BVH::Hit localHit;
+			if(placement.mesh->intersect(local, tMax, localHit, anyHit)){
+				hit = localHit;
+				hit.triIndex += placement.triangleOffset;
+				tMax = localHit.t;
+				if(anyHit){
+					return true;
+				}
+			}
+		}
+	}
+
+	return hit.triIndex >= 0;
+}
+
+int InstanceBVH::enteringLanes(const Node& node, const RayPacket& packet, const float inv[3][RayPacket::SIZE], int allowed) {
+	int lanes = 0;
+	for(int lane = 0; lane < packet.count; lane++){
+		if(!(allowed & (1 << lane))){
+			continue;
+		}
+		const float origin[3] = { packet.ox[lane], packet.oy[lane], packet.oz[lane] };
+		float tNear = 0.0f;
+		float tFar = packet.tMax[lane];
+		for(int a = 0; a < 3; a++){
+			float t0 = (node.lo[a] - origin[a]) * inv[a][lane];
+			float t1 = (node.hi[a] - origin[a]) * inv[a][lane];
+			if(t0 > t1){
+				std::swap(t0, t1);
+			}
+			tNear = t0 > tNear ? t0 : tNear;
+			tFar = t1 < tFar ? t1 : tFar;
+		}
+		if(tNear <= tFar){
+			lanes |= 1 << lane;
+		}
+	}
+	return lanes;
+}
+
+void InstanceBVH::toMesh(const Placement& placement, const RayPacket& packet, int active, RayPacket& local) {
+	local.count = packet.count;
+	for(int lane = 0; lane < packet.count; lane++){
+		G3D::Point3 o = transformPoint(placement.toMesh, packet.ox[lane], packet.oy[lane], packet.oz[lane]);
+		G3D::Vector3 d = transformVector(placement.toMesh, packet.dx[lane], packet.dy[lane], packet.dz[lane]);
+		local.ox[lane] = o.x; local.oy[lane] = o.y; local.oz[lane] = o.z;
+		local.dx[lane] = d.x; local.dy[lane] = d.y; local.dz[lane] = d.z;
+		local.tMax[lane] = (active & (1 << lane)) ? packet.tMax[lane] : -1.0f;
+	}
+}
+
+void InstanceBVH::intersect8(RayPacket& packet, BVH::Hit hits[RayPacket::SIZE]) const {
+	for(int i = 0; i < RayPacket::SIZE; i++){
+		hits[i].triIndex = -1;
+	}
+	packet.nodesVisited = 0;
+	if(this->m_nodes.empty() || packet.count <= 0){
+		return;
+	}
+
+	float inv[3][RayPacket::SIZE];
+	for(int lane = 0; lane < packet.count; lane++){
+		inv[0][lane] = 1.0f / packet.dx[lane];
+		inv[1][lane] = 1.0f / packet.dy[lane];
+		inv[2][lane] = 1.0f / packet.dz[lane];
+	}
+	const int allLanes = (1 << packet.count) - 1;
+	const bool negative[3] = { packet.dx[0] < 0.0f, packet.dy[0] < 0.0f, packet.dz[0] < 0.0f };
+
+	RayPacket local;
+	BVH::Hit localHits[RayPacket::SIZE];
+	int stack[STACK_SIZE];
+	int stackSize = 0;
+	stack[stackSize++] = 0;
+
+	while(stackSize > 0) {
+		int index = stack[--stackSize];
+		const Node& node = this->m_nodes[index];
+		packet.nodesVisited++;
+
+		int active = enteringLanes(node, packet, inv, allLanes);
+		if(active == 0){
+			continue;
+		}
+
+		if(node.count == 0){
+			debugAssertM(stackSize + 2 <= STACK_SIZE, "InstanceBVH deeper than its traversal stack");
+			if(negative[node.axis]){
+				stack[stackSize++] = index + 1;
+				stack[stackSize++] = node.offset;
+			} else {
+				stack[stackSize++] = node.offset;
+				stack[stackSize++] = index + 1;
+			}
+			continue;
+		}
+
+		for(int i = node.offset; i < node.offset + node.count; i++){
+			const Placement& placement = this->m_placements[i];
+			toMesh(placement, packet, active, local);
+			placement.mesh->intersect8(local, localHits);
+			packet.nodesVisited += local.nodesVisited;
+			for(int lane = 0; lane < packet.count; lane++){
+				if(localHits[lane].triIndex >= 0){
+					hits[lane] = localHits[lane];
+					hits[lane].triIndex += placement.triangleOffset;
+					packet.tMax[lane] = localHits[lane].t;
+				}
+			}
+		}
+	}
+}
+
+void InstanceBVH::occluded8(const RayPacket& packet, bool occluded[RayPacket::SIZE]) const {
+	for(int i = 0; i < RayPacket::SIZE; i++){
+		occluded[i] = false;
+	}
+	if(this->m_nodes.empty() || packet.count <= 0){
+		return;
+	}
+
+	float inv[3][RayPacket::SIZE];
+	for(int lane = 0; lane < packet.count; lane++){
+		inv[0][lane] = 1.0f / packet.dx[lane];
+		inv[1][lane] = 1.0f / packet.dy[lane];
+		inv[2][lane] = 1.0f / packet.dz[lane];
+	}
+	// Lanes drop out once they are blocked, and the packet once all of them are
+	int open = (1 << packet.count) - 1;
+	const bool negative[3] = { packet.dx[0] < 0.0f, packet.dy[0] < 0.0f, packet.dz[0] < 0.0f };
+
+	RayPacket local;
+	bool localOccluded[RayPacket::SIZE];
+	int stack[STACK_SIZE];
+	int stackSize = 0;
+	stack[stackSize++] = 0;
+
+	while(stackSize > 0 && open != 0) {
+		int index = stack[--stackSize];
+		const Node& node = this->m_nodes[index];
+
+		int active = enteringLanes(node, packet, inv, open);
+		if(active == 0){
+			continue;
+		}
+
+		if(node.count == 0){
+			debugAssertM(stackSize + 2 <= STACK_SIZE, "InstanceBVH deeper than its traversal stack");
+			if(negative[node.axis]){
+				stack[stackSize++] = index + 1;
+				stack[stackSize++] = node.offset;
+			} else {
+				stack[stackSize++] = node.offset;
+				stack[stackSize++] = index + 1;
+			}
+			continue;
+		}
+
+		for(int i = node.offset; i < node.offset + node.count && active != 0; i++){
+			const Placement& placement = this->m_placements[i];
+			toMesh(placement, packet, active, local);
+			placement.mesh->occluded8(local, localOccluded);
+			for(int lane = 0; lane < packet.count; lane++){
+				if((active & (1 << lane)) && localOccluded[lane]){
+					occluded[lane] = true;
+					active &= ~(1 << lane);
+					open &= ~(1 << lane);
+				}
+			}
+		}
+	}
+}
@@ -0,0 +1,121 @@
+#pragma once
+#include <G3D/Vector3.h>
+#include <G3D/Ray.h>
+#include <G3D/CoordinateFrame.h>
+
+#include <vector>
+
+#include "BVH.h"
+
+/**
+  Top level of the two-level hierarchy World traces: a tree over instances,
+  each a mesh's BVH built once in the mesh's own space and placed in the
+  world by a rigid frame.  However many times a mesh is placed, its
+  triangles and their BVH are stored once.
+
+  A ray reaching an instance is moved into the space of its mesh and traced
+  through the mesh's BVH there.  The frames are rigid, so distances along the
+  ray are the same in both spaces and hits in different instances compare
+  directly.  Hits number the triangles of all instances one after another:
+  instance i's are offset by the triangleOffset it was given.
+
+  Built top-down, splitting the longest axis of the instances' centers at the
+  median.  Nodes are stored depth first, so the left child of a node is the
+  next node in memory.
+
+  An instance can be moved after the build with setFrame(), which refits the
+  boxes from its leaf up to the root in place instead of building again.  The
+  tree keeps the shape it was built with, so after large moves its boxes
+  overlap more than a new build's would; surfaceArea() measures how much.
+ */
+class InstanceBVH
+{
+public:
+	struct Instance {
+		/** Built over the mesh's triangles in its own space; must outlive the tree */
+		const BVH		*mesh;
+		/** Mesh to world; rigid */
+		G3D::CFrame		frame;
+		/** Added to the mesh's triangle indices in hits */
+		int				triangleOffset;
+	};
+
+	InstanceBVH(void);
+
+	/** Instances whose mesh is empty are left out */
+	void build(const std::vector<Instance>& instances);
+
+	/** Moves instance, indexed as given to build(), to frame, which must be rigid, and refits
+		the boxes above it.  Returns the number of nodes whose box changed.  Not safe while
+		another thread traces the tree. */
+	int setFrame(int instance, const G3D::CFrame& frame);
+
+	/** The world box of instance; false if it was left out */
+	bool bounds(int instance, G3D::Vector3& lo, G3D::Vector3& hi) const;
+
+	/** Summed surface area of every node's box, proportional to the expected nodes a ray visits */
+	float surfaceArea() const;
+
+	/** See BVH::intersect */
+	bool intersect(const G3D::Ray& ray, float maxDistance, BVH::Hit& hit, bool anyHit = false) const;
+
+	/** See BVH::intersect8.  nodesVisited counts the nodes of this tree and of every mesh the packet entered. */
+	void intersect8(RayPacket& packet, BVH::Hit hits[RayPacket::SIZE]) const;
+
+	/** See BVH::occluded8 */
+	void occluded8(const RayPacket& packet, bool occluded[RayPacket::SIZE]) const;
+
+	int instanceCount() const;
+	int nodeCount() const;
+	/** This tree only, not the meshes' BVHs */
+	size_t memoryFootprint() const;
+
+private:
+	static const int			MAX_LEAF_SIZE = 2;
+	/** Every node splits at the median, so the tree is never deeper than log2(instances) + 1
+		and a trace holds at most one more entry than that */
+	static const int			STACK_SIZE = 64;
+
+	/** Leaves have count > 0 and hold placements [offset, offset + count).  An internal
+		node's left child directly follows it and offset is its right child; axis is the
+		split axis, used to visit the near child first. */
+	struct Node {
+		float lo[3];
+		float hi[3];
+		int offset;
+		unsigned short count;
+		unsigned short axis;
+	};
+
+	/** An instance as traced: world to mesh space as the rows of a 3x4 matrix */
+	struct Placement {
+		float			toMesh[3][4];
+		const BVH		*mesh;
+		int				triangleOffset;
+	};
+
+	std::vector<Node>			m_nodes;
+	/** In leaf order */
+	std::vector<Placement>		m_placements;
+	/** Per placement, its world box and its leaf */
+	std::vector<G3D::Vector3>	m_lo;
+	std::vector<G3D::Vector3>	m_hi;
+	std::vector<int>			m_leaves;
+	/** Per node, its parent; -1 for the root */
+	std::vector<int>			m_parents;
+	/** Per instance given to build(), its placement; -1 if left out */
+	std::vector<int>			m_placementOf;
+
+	/** Sets placement's transform for frame and returns the world box of its mesh there; false if the mesh is empty */
+	static bool place(Placement& placement, const G3D::CFrame& frame, G3D::Vector3& lo, G3D::Vector3& hi);
+
+	/** Appends the subtree over order[begin, end) and returns its root */
+	int buildRecursive(std::vector<int>& order, const std::vector<G3D::Vector3>& lo, const std::vector<G3D::Vector3>& hi,
+		const std::vector<G3D::Vector3>& centers, int begin, int end);
+
+	/** Lanes of packet, below its count and with allowed set, that enter node's box before their tMax */
+	static int enteringLanes(const Node& node, const RayPacket& packet, const float inv[3][RayPacket::SIZE], int allowed);
+
+	/** The lanes of packet moved into placement's mesh space; lanes not in active get a negative tMax */
+	static void toMesh(const Placement& placement, const RayPacket& packet, int active, RayPacket& local);
+};
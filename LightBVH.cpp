@@ -0,0 +1,161 @@
+#include "LightBVH.h"
+
+#include <math.h>
+#include <algorithm>
+
+namespace {
+
+struct PositionLess {
+	const std::vector<G3D::Vector3> *positions;
+	int axis;
+
+	bool operator()(int left, int right) const {
+		return (*positions)[left][axis] < (*positions)[right][axis];
+	}
+};
+
+}
+
+const float LightBVH::MIN_DISTANCE2 = 1e-4f;
+
+LightBVH::LightBVH(void) :
+	m_lightCount(0)
+{
+}
+
+void LightBVH::build(const G3D::Array<shared_ptr<G3D::Light> >& lights) {
+	std::vector<G3D::Vector3> positions(lights.size());
+	std::vector<float> powers(lights.size());
+	std::vector<int> order(lights.size());
+	for(int i = 0; i < lights.size(); i++){
+		positions[i] = lights[i]->position().xyz();
+		powers[i] = lights[i]->color.average();
+		order[i] = i;
+	}
+
+	this->m_nodes.clear();
+	this->m_lightCount = lights.size();
+	if(lights.size() > 0){
+		this->m_nodes.reserve(2 * lights.size() - 1);
+		this->buildRecursive(order, positions, powers, 0, lights.size());
+	}
+}
+
+int LightBVH::buildRecursive(std::vector<int>& order, const std::vector<G3D::Vector3>& positions, const std::vector<float>& powers, int begin, int end) {
+	int index = this->m_nodes.size();
+	this->m_nodes.push_back(Node());
+
+	Node node;
+	node.lo = node.hi = positions[order[begin]];
+	node.power = 0.0f;
+	for(int i = begin; i < end; i++){
+		node.lo = node.lo.min(positions[order[i]]);
+		node.hi = node.hi.max(positions[order[i]]);
+		node.power += powers[order[i]];
+	}
+
+	if(end - begin == 1){
+		node.light = order[begin];
+		node.offset = -1;
+		this->m_nodes[index] = node;
+		return index;
+	}
+
+	G3D::Vector3 extent = node.hi - node.lo;
+	PositionLess less;
+	less.positions = &positions;
+	less.axis = (extent.x >= extent.y && extent.x >= extent.z) ? 0 : ((extent.y >= extent.z) ? 1 : 2);
+	int middle = (begin + end) / 2;
+	std::nth_element(order.begin() + begin, order.begin() + middle, order.begin() + end, less);
+
+	node.light = -1;
+	this->buildRecursive(order, positions, powers, begin, middle);
+	node.offset = this->buildRecursive(order, positions, powers, middle, end);
+	this->m_nodes[index] = node;
+	return index;
+}
+
+float LightBVH::importance(const Node& node, const G3D::Vector3& point, const G3D::Vector3& normal) const {
+	if(node.light >= 0){
+		// A single light is a point, so its cosine and distance are exact
+		G3D::Vector3 w = node.lo - point;
+		float distance2 = G3D::max(w.squaredLength(), MIN_DISTANCE2);
+		return node.power * G3D::max(0.0f, w.dot(normal)) / (distance2 * sqrt(distance2));
+	}
+
+	// The box is behind the surface if its corner furthest along the normal is
+	G3D::Vector3 center = (node.lo + node.hi) * 0.5f;
+	G3D::Vector3 halfExtent = (node.hi - node.lo) * 0.5f;
+	G3D::Vector3 toCenter = center - point;
+	if(toCenter.dot(normal) + halfExtent.dot(normal.abs()) <= 0.0f){
+		return 0.0f;
+	}
+
+	// Bound the lights by the sphere around the box: none is closer to the point than its
+	// radius is to the center, and none is further from the normal than the direction to
+	// the center less the angle the sphere subtends
+	float distance2 = toCenter.squaredLength();
+	float radius2 = halfExtent.squaredLength();
+	float cosine = 1.0f;
+	if(distance2 > radius2){
+		float cosTheta = toCenter.dot(normal) / sqrt(distance2);
+		float cosSubtended = sqrt(1.0f - radius2 / distance2);
+		if(cosTheta < cosSubtended){
+			float sinTheta = sqrt(G3D::max(0.0f, 1.0f - cosTheta * cosTheta));
+			cosine = G3D::max(0.0f, cosTheta * cosSubtended + sinTheta * sqrt(radius2 / distance2));
+		}
+	}
+	return node.power * cosine / G3D::max(distance2, radius2);
+}
+
+int LightBVH::sample(const G3D::Vector3& point, const G3D::Vector3& normal, float u, float& pdf) const {
+	pdf = 0.0f;
+	if(this->m_nodes.empty()){
+		return -1;
+	}
+
+	const Node *node = &this->m_nodes[0];
+	float probability = 1.0f;
+	while(node->light < 0){
+		const Node *left = node + 1;
+		const Node *right = &this->m_nodes[node->offset];
+		float leftImportance = this->importance(*left, point, normal);
+		float rightImportance = this->importance(*right, point, normal);
+		float total = leftImportance + rightImportance;
+		if(total <= 0.0f){
+			return -1;
+		}
+
+		// Reuse u for the next choice by stretching the half it fell in back to [0, 1)
+		float pLeft = leftImportance / total;
+		if(u < pLeft){
+			u /= pLeft;
+			probability *= pLeft;
+			node = left;
+		} else {
+			u = (u - pLeft) / (1.0f - pLeft);
+			probability *= 1.0f - pLeft;
+			node = right;
+		}
+		u = G3D::min(u, 0.99999994f);
+	}
+
+	// The walk never enters a child that cannot contribute, but the root may be a leaf
+	if(probability == 1.0f && this->importance(*node, point, normal) <= 0.0f){
+		return -1;
+	}
+	pdf = probability;
+	return node->light;
+}
+
+int LightBVH::lightCount() const {
+	return this->m_lightCount;
+}
+
+int LightBVH::nodeCount() const {
+	return this->m_nodes.size();
+}
+
+size_t LightBVH::memoryFootprint() const {
+	return this->m_nodes.capacity() * sizeof(Node);
+}
@@ -0,0 +1,61 @@
+#pragma once
+#include <G3D/Array.h>
+#include <G3D/Vector3.h>
+
+#include <GLG3D/Light.h>
+
+#include <vector>
+
+/**
+  Bounding volume hierarchy over the point lights of a World, for picking one
+  light per shadow ray instead of testing them all.
+
+  Every node bounds the positions of its lights and sums their power.  sample()
+  walks down from the root, choosing between the two children of a node in
+  proportion to an estimate of how much each could light the shading point:
+  its power over the squared distance to its box, and nothing if the box is
+  entirely behind the surface.  Picking a light costs one walk down the tree,
+  however many lights there are, and lights that matter are picked most often.
+
+  Built top-down, splitting the longest axis of the lights' bounds at the
+  median.  Nodes are stored depth first, so the left child of a node is the
+  next node in memory; every leaf holds one light.
+ */
+class LightBVH
+{
+public:
+	LightBVH(void);
+
+	void build(const G3D::Array<shared_ptr<G3D::Light> >& lights);
+
+	/** Picks a light for the point with the given shading normal, using u in [0, 1), and
+		returns its index in the array given to build().  pdf receives the probability it
+		was picked.  Returns -1 if no light can reach the point. */
+	int sample(const G3D::Vector3& point, const G3D::Vector3& normal, float u, float& pdf) const;
+
+	int lightCount() const;
+	int nodeCount() const;
+	size_t memoryFootprint() const;
+
+private:
+	/** Keeps the importance of a node finite when the point is inside or on its box */
+	static const float			MIN_DISTANCE2;
+
+	/** Leaves have light >= 0.  An internal node's left child directly follows it and
+		offset is its right child. */
+	struct Node {
+		G3D::Vector3 lo;
+		G3D::Vector3 hi;
+		float power;
+		int offset;
+		int light;
+	};
+
+	std::vector<Node>			m_nodes;
+	int							m_lightCount;
+
+	float importance(const Node& node, const G3D::Vector3& point, const G3D::Vector3& normal) const;
+
+	/** Appends the subtree over order[begin, end) and returns its root */
+	int buildRecursive(std::vector<int>& order, const std::vector<G3D::Vector3>& positions, const std::vector<float>& powers, int begin, int end);
+};
@@ -0,0 +1,115 @@
+#include "MappedFile.h"
+
+#include <utility>
+
+#ifdef _WIN32
+#	include <windows.h>
+#else
+#	include <sys/mman.h>
+#	include <sys/stat.h>
+#	include <fcntl.h>
+#	include <unistd.h>
+#endif
+
+MappedFile::MappedFile(void) :
+	m_data(NULL),
+	m_size(0)
+#ifdef _WIN32
+	, m_file(NULL),
+	m_mapping(NULL)
+#endif
+{
+}
+
+MappedFile::~MappedFile(void)
+{
+	this->close();
+}
+
+bool MappedFile::open(const std::string& filename) {
+	this->close();
+
+#ifdef _WIN32
+	HANDLE file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if(file == INVALID_HANDLE_VALUE){
+		return false;
+	}
+	LARGE_INTEGER size;
+	if(!GetFileSizeEx(file, &size) || size.QuadPart == 0){
+		CloseHandle(file);
+		return false;
+	}
+	HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+	if(mapping == NULL){
+		CloseHandle(file);
+		return false;
+	}
+	void *data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	if(data == NULL){
+		CloseHandle(mapping);
+		CloseHandle(file);
+		return false;
+	}
+	this->m_file = file;
+	this->m_mapping = mapping;
+	this->m_data = (const unsigned char*)data;
+	this->m_size = (size_t)size.QuadPart;
+#else
+	int fd = ::open(filename.c_str(), O_RDONLY);
+	if(fd < 0){
+		return false;
+	}
+	struct stat info;
+	if(fstat(fd, &info) != 0 || info.st_size == 0){
+		::close(fd);
+		return false;
+	}
+	void *data = mmap(NULL, (size_t)info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	// The mapping keeps the file alive on its own
+	::close(fd);
+	if(data == MAP_FAILED){
+		return false;
+	}
+	this->m_data = (const unsigned char*)data;
+	this->m_size = (size_t)info.st_size;
+#endif
+	return true;
+}
+
+void MappedFile::close() {
+	if(this->m_data == NULL){
+		return;
+	}
+#ifdef _WIN32
+	UnmapViewOfFile(this->m_data);
+	CloseHandle((HANDLE)this->m_mapping);
+	CloseHandle((HANDLE)this->m_file);
+	this->m_mapping = NULL;
+	this->m_file = NULL;
+#else
+	munmap((void*)this->m_data, this->m_size);
+#endif
+	this->m_data = NULL;
+	this->m_size = 0;
+}
+
+void MappedFile::swap(MappedFile& other) {
+	std::swap(this->m_data, other.m_data);
+	std::swap(this->m_size, other.m_size);
+#ifdef _WIN32
+	std::swap(this->m_file, other.m_file);
+	std::swap(this->m_mapping, other.m_mapping);
+#endif
+}
+
+bool MappedFile::isOpen() const {
+	return this->m_data != NULL;
+}
+
+const unsigned char* MappedFile::data() const {
+	return this->m_data;
+}
+
+size_t MappedFile::size() const {
+	return this->m_size;
+}
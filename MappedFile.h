@@ -0,0 +1,36 @@
+#pragma once
+#include <string>
+#include <stddef.h>
+
+/**
+  A whole file mapped read-only into memory.  Processes that map the same
+  file share its pages, and nothing is read until it is touched.
+ */
+class MappedFile
+{
+public:
+	MappedFile(void);
+	~MappedFile(void);
+
+	/** Maps filename, unmapping any previous file.  Returns false if it cannot be opened or is empty. */
+	bool open(const std::string& filename);
+	void close();
+
+	/** Exchanges the files mapped by this and other */
+	void swap(MappedFile& other);
+
+	bool isOpen() const;
+	const unsigned char* data() const;
+	size_t size() const;
+
+private:
+	const unsigned char		*m_data;
+	size_t					m_size;
+#ifdef _WIN32
+	void					*m_file;
+	void					*m_mapping;
+#endif
+
+	MappedFile(const MappedFile&);
+	MappedFile& operator=(const MappedFile&);
+};
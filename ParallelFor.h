@@ -0,0 +1,49 @@
+#pragma once
+#include <thread>
+#include <vector>
+
+/**
+  Splits [begin, end) into contiguous chunks of at least minChunk items and
+  calls function(chunkBegin, chunkEnd) for each on its own thread, the calling
+  thread taking the first chunk.  Returns once every chunk is done.
+
+  Meant for one-off bulk work such as scene loading, where threads are cheap
+  next to the work; render passes, and the bulk steps between them, go through
+  WorkerPool (see WorkerPool::parallelFor) instead.  Zero threads means one per
+  hardware thread.
+ */
+template<class Function>
+void parallelFor(int begin, int end, const Function& function, int minChunk = 1, int numThreads = 0) {
+	if(numThreads <= 0) {
+		numThreads = (int)std::thread::hardware_concurrency();
+	}
+	if(numThreads <= 0) {
+		numThreads = 4;
+	}
+
+	int count = end - begin;
+	if(minChunk < 1) {
+		minChunk = 1;
+	}
+	int chunks = count / minChunk;
+	if(chunks > numThreads) {
+		chunks = numThreads;
+	}
+	if(chunks <= 1) {
+		if(count > 0) {
+			function(begin, end);
+		}
+		return;
+	}
+
+	std::vector<std::thread> threads;
+	for(int c = 1; c < chunks; c++) {
+		int chunkBegin = begin + (int)((long long)count * c / chunks);
+		int chunkEnd = begin + (int)((long long)count * (c + 1) / chunks);
+		threads.push_back(std::thread([&function, chunkBegin, chunkEnd]() { function(chunkBegin, chunkEnd); }));
+	}
+	function(begin, begin + count / chunks);
+	for(int i = 0; i < threads.size(); i++) {
+		threads[i].join();
+	}
+}
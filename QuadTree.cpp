@@ -3,105 +3,195 @@
 #include <stdio.h>
 
 
-QuadTree::QuadTree(float x, float y, float width, float height)
+QuadTree::QuadTree(int width, int height)
 {
-	this->points = std::vector<QuadTreeNode>();
+	this->build(width, height);
+}
 
-	this->boundary = new G3D::Rect2D(G3D::Rect2D::xyxy(G3D::Point2(x, y), G3D::Point2(x + width, y + height)));
+void QuadTree::build(int width, int height) {
+	this->m_width = width;
+	this->m_height = height;
+
+	// Subdivide until a leaf tile is no bigger than MIN_AREA pixels
+	this->m_depth = 0;
+	while(this->m_depth < 15) {
+		int tileWidth = (width + (1 << this->m_depth) - 1) >> this->m_depth;
+		int tileHeight = (height + (1 << this->m_depth) - 1) >> this->m_depth;
+		if(tileWidth * tileHeight <= QuadTree::MIN_AREA){
+			break;
+		}
+		this->m_depth++;
+	}
 
-	nw = NULL;
-	ne = NULL;
-	sw = NULL;
-	se = NULL;
+	Node empty;
+	empty.color = G3D::Color3::black();
+	empty.neighborColorDiff = 0.0f;
+	empty.samples = 0;
+	empty.meanLuminance = 0.0f;
+	empty.luminanceM2 = 0.0f;
+	this->nodes.assign(this->levelOffset(this->m_depth + 1), empty);
+
+	// Walk the leaves in Morton order and emit each tile's pixels, so every
+	// leaf's range is contiguous without any sorting
+	int leaves = this->leafCount();
+	long long n = 1LL << this->m_depth;
+	this->m_leafStart.resize(leaves + 1);
+	this->points.clear();
+	this->points.reserve(width * height);
+	this->m_pointIndex.resize(width * height);
+
+	for(int leaf = 0; leaf < leaves; leaf++){
+		this->m_leafStart[leaf] = this->points.size();
+
+		unsigned int cx, cy;
+		QuadTree::mortonDecode(leaf, cx, cy);
+		int x0 = (int)(width * (long long)cx / n);
+		int x1 = (int)(width * (long long)(cx + 1) / n);
+		int y0 = (int)(height * (long long)cy / n);
+		int y1 = (int)(height * (long long)(cy + 1) / n);
+
+		for(int y = y0; y < y1; y++){
+			for(int x = x0; x < x1; x++){
+				this->m_pointIndex[y * width + x] = this->points.size();
+				this->points.push_back(QuadTreeNode(x, y));
+			}
+		}
+	}
+	this->m_leafStart[leaves] = this->points.size();
+}
 
-	this->neighborColorDiff = 0.0f;
+void QuadTree::resize(int width, int height) {
+	this->build(width, height);
 }
 
-bool QuadTree::insert(const G3D::Point2& point){
-	if(!this->boundary->contains(point)){
-		return false;
-	}
+unsigned int QuadTree::mortonEncode(unsigned int x, unsigned int y) {
+	x &= 0x0000ffff;
+	x = (x | (x << 8)) & 0x00ff00ff;
+	x = (x | (x << 4)) & 0x0f0f0f0f;
+	x = (x | (x << 2)) & 0x33333333;
+	x = (x | (x << 1)) & 0x55555555;
+
+	y &= 0x0000ffff;
+	y = (y | (y << 8)) & 0x00ff00ff;
+	y = (y | (y << 4)) & 0x0f0f0f0f;
+	y = (y | (y << 2)) & 0x33333333;
+	y = (y | (y << 1)) & 0x55555555;
+
+	return x | (y << 1);
+}
 
-	for(int i = 0; i < this->points.size(); i++){
-		if((int)this->points[i].x == (int)point.x && (int)this->points[i].y == (int)point.y){
-			return false;
+static unsigned int compactBits(unsigned int x) {
+	x &= 0x55555555;
+	x = (x | (x >> 1)) & 0x33333333;
+	x = (x | (x >> 2)) & 0x0f0f0f0f;
+	x = (x | (x >> 4)) & 0x00ff00ff;
+	x = (x | (x >> 8)) & 0x0000ffff;
+	return x;
+}
+
+void QuadTree::mortonDecode(unsigned int code, unsigned int& x, unsigned int& y) {
+	x = compactBits(code);
+	y = compactBits(code >> 1);
+}
+
+void QuadTree::updateInternalColors() {
+	// Bottom up, so every child is done before its parent
+	for(int node = this->firstLeaf() - 1; node >= 0; node--){
+		G3D::Color3 sum = G3D::Color3::black();
+		int count = 0;
+		for(int i = 0; i < 4; i++){
+			int c = this->child(node, i);
+			int pixels = this->pointEnd(c) - this->pointBegin(c);
+			sum += this->nodes[c].color * (float)pixels;
+			count += pixels;
 		}
+		this->nodes[node].color = (count > 0) ? sum / (float)count : G3D::Color3::black();
 	}
+}
 
-	if(this->points.size() < QuadTree::MAX_POINTS || this->boundary->area() <= QuadTree::MIN_AREA){
-		this->points.push_back(QuadTreeNode(point));
-		return true;
-	}
+int QuadTree::size() const {
+	return this->nodes.size();
+}
 
-	if(!nw){
-		subdivide();
-	}
+int QuadTree::point_count() const {
+	return this->points.size();
+}
 
-	if(nw->insert(point)) return true;
-	if(ne->insert(point)) return true;
-	if(sw->insert(point)) return true;
-	if(se->insert(point)) return true;
+int QuadTree::depth() const {
+	return this->m_depth;
+}
 
-	return false;
+int QuadTree::levelOffset(int level) const {
+	// 1 + 4 + ... + 4^(level - 1)
+	return ((1 << (2 * level)) - 1) / 3;
 }
 
-void QuadTree::subdivide(){
-	if(!this->nw) {
-		this->nw = new QuadTree(this->boundary->center().x - this->boundary->width() * 0.5, this->boundary->center().y - this->boundary->height() * 0.5, this->boundary->width() / 2, this->boundary->height() / 2);
+int QuadTree::level(int node) const {
+	int l = this->m_depth;
+	while(this->levelOffset(l) > node){
+		l--;
 	}
+	return l;
+}
 
-	if(!this->ne) {
-		this->ne = new QuadTree(this->boundary->center().x, this->boundary->center().y - this->boundary->height() * 0.5, this->boundary->width() / 2, this->boundary->height() / 2);
-	}
+int QuadTree::leafCount() const {
+	return 1 << (2 * this->m_depth);
+}
 
-	if(!this->sw) {
-		this->sw = new QuadTree(this->boundary->center().x - this->boundary->width() * 0.5, this->boundary->center().y, this->boundary->width() / 2, this->boundary->height() / 2);
-	}
+int QuadTree::firstLeaf() const {
+	return this->levelOffset(this->m_depth);
+}
 
-	if(!this->se) {
-		this->se = new QuadTree(this->boundary->center().x, this->boundary->center().y, this->boundary->width() / 2, this->boundary->height() / 2);
-	}
+bool QuadTree::isLeaf(int node) const {
+	return node >= this->firstLeaf();
 }
 
-int QuadTree::size() {
-	int result = 1;
-	if(this->ne){
-		result += this->ne->size();
-		result += this->nw->size();
-		result += this->sw->size();
-		result += this->se->size();
-	}
-	return result;
+int QuadTree::child(int node, int which) const {
+	int l = this->level(node);
+	return this->levelOffset(l + 1) + 4 * (node - this->levelOffset(l)) + which;
 }
 
-int QuadTree::point_count() {
-	int result = this->points.size();
-	if(this->ne){
-		result += this->ne->point_count();
-		result += this->nw->point_count();
-		result += this->sw->point_count();
-		result += this->se->point_count();
-	}
-	return result;
+int QuadTree::parent(int node) const {
+	int l = this->level(node);
+	return this->levelOffset(l - 1) + ((node - this->levelOffset(l)) >> 2);
 }
 
-QuadTree::~QuadTree(void)
-{
-	//if(nw){
-	//	delete nw;
-	//}
+int QuadTree::pointBegin(int node) const {
+	int l = this->level(node);
+	int shift = 2 * (this->m_depth - l);
+	return this->m_leafStart[(node - this->levelOffset(l)) << shift];
+}
 
-	//if(ne){
-	//	delete ne;
-	//}
+int QuadTree::pointEnd(int node) const {
+	int l = this->level(node);
+	int shift = 2 * (this->m_depth - l);
+	return this->m_leafStart[(node - this->levelOffset(l) + 1) << shift];
+}
 
-	//if(sw) {
-	//	delete sw;
-	//}
+G3D::Rect2D QuadTree::boundary(int node) const {
+	int l = this->level(node);
+	unsigned int cx, cy;
+	QuadTree::mortonDecode(node - this->levelOffset(l), cx, cy);
+
+	long long n = 1LL << l;
+	float x0 = (float)(this->m_width * (long long)cx / n);
+	float x1 = (float)(this->m_width * (long long)(cx + 1) / n);
+	float y0 = (float)(this->m_height * (long long)cy / n);
+	float y1 = (float)(this->m_height * (long long)(cy + 1) / n);
+	return G3D::Rect2D::xyxy(G3D::Point2(x0, y0), G3D::Point2(x1, y1));
+}
 
-	//if(se){
-	//	delete sw;
-	//}
+int QuadTree::pointIndex(int x, int y) const {
+	return this->m_pointIndex[y * this->m_width + x];
+}
 
-	//delete boundary;
+size_t QuadTree::memoryFootprint() const {
+	return this->nodes.capacity() * sizeof(Node) + 
+		this->points.capacity() * sizeof(QuadTreeNode) + 
+		this->m_leafStart.capacity() * sizeof(int) +
+		this->m_pointIndex.capacity() * sizeof(int);
+}
+
+QuadTree::~QuadTree(void)
+{
 }
@@ -7,52 +7,95 @@
 
 #include "QuadTreeNode.h"
 
+/**
+  Linear quadtree over the pixels of the screen.
+
+  The tree is complete: every level l holds 4^l nodes stored contiguously in
+  Morton (Z) order, starting at levelOffset(l).  Children, parent and pixel
+  rectangle of a node all follow from its index, so there are no pointers.
+  Only leaves own pixels, and since leaves are Morton ordered too, the pixels
+  of any node form one contiguous range of the points array.
+ */
 class QuadTree
 {
 public:
-	const static int MAX_POINTS = 5;
 	const static int MIN_AREA	= 25;
 
-	QuadTree(float x, float y, float width, float height);
+	struct Node {
+		G3D::Color3 color;
+		float neighborColorDiff;
+		/** Running luminance statistics (Welford) of every sample traced in a leaf this frame */
+		int samples;
+		float meanLuminance;
+		float luminanceM2;
+	};
+
+	QuadTree(int width, int height);
 	~QuadTree(void);
 
+	/** Indexed by node; see levelOffset() */
+	std::vector<Node> nodes;
+	/** Pixels of all leaves, in leaf order */
 	std::vector<QuadTreeNode> points;
-	bool insert(const G3D::Point2& point);
-	int size();
-	int point_count();
-	
-	QuadTree *nw;
-	QuadTree *ne;
-	QuadTree *sw;
-	QuadTree *se;
-	G3D::Rect2D *boundary;
 
-	G3D::Color3 color;
+	/** Rebuilds the tree for a new screen size, reusing the existing allocations where possible */
+	void resize(int width, int height);
 
-	float neighborColorDiff;
+	/** Sets the color of every internal node to the pixel-weighted mean of its children */
+	void updateInternalColors();
 
-	static int compare(const void *left, const void *right){
-		QuadTree *q1 = (QuadTree*)left;
-		QuadTree *q2 = (QuadTree*)right;
+	int size() const;
+	int point_count() const;
 
-		return (q1->neighborColorDiff - q2->neighborColorDiff);
-	}
+	int depth() const;
+	int levelOffset(int level) const;
+	int level(int node) const;
+
+	int leafCount() const;
+	int firstLeaf() const;
+	bool isLeaf(int node) const;
+
+	/** Child 0..3 of an internal node; bit 0 of the child number selects +x, bit 1 selects +y */
+	int child(int node, int which) const;
+	int parent(int node) const;
+
+	/** Range of points covered by a node */
+	int pointBegin(int node) const;
+	int pointEnd(int node) const;
+
+	G3D::Rect2D boundary(int node) const;
+
+	/** Index in points of the pixel (x, y) */
+	int pointIndex(int x, int y) const;
+
+	/** Bytes held by the node, leaf and point arrays */
+	size_t memoryFootprint() const;
+
+	static unsigned int mortonEncode(unsigned int x, unsigned int y);
+	static void mortonDecode(unsigned int code, unsigned int& x, unsigned int& y);
 
 private:
-	void subdivide();
+	int m_width;
+	int m_height;
+	int m_depth;
+
+	/** m_leafStart[i] is the index in points of the first pixel of leaf i; one extra entry marks the end */
+	std::vector<int> m_leafStart;
+	/** m_pointIndex[y * width + x] is the index in points of pixel (x, y) */
+	std::vector<int> m_pointIndex;
+
+	/** Subdivides the screen straight down to leaf tiles and fills in the pixels in one pass */
+	void build(int width, int height);
 };
 
 class QuadTreeDiffComparator {
 public:
-	bool operator()(const QuadTree *left, const QuadTree *right) {
-		return (left->neighborColorDiff <= right->neighborColorDiff);
-	}
-};
+	QuadTreeDiffComparator(const QuadTree *tree) : tree(tree) {}
 
-class QuadTreeCenterComparator {
-public:
-	bool operator()(const QuadTree *left, const QuadTree *right) {
-		return (left->boundary->center() != right->boundary->center());
+	bool operator()(int left, int right) const {
+		return (tree->nodes[left].neighborColorDiff < tree->nodes[right].neighborColorDiff);
 	}
-};
 
+private:
+	const QuadTree *tree;
+};
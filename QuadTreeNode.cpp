@@ -3,13 +3,17 @@
 #include <G3D/Vector2.h>
 
 
-QuadTreeNode::QuadTreeNode(G3D::Point2 point)
+QuadTreeNode::QuadTreeNode(int x, int y)
 {
-	this->x = point.x;
-	this->y = point.y;
+	this->x = (unsigned short)x;
+	this->y = (unsigned short)y;
+	this->samples = 0;
 	this->color = G3D::Color3::black();
 }
 
+G3D::Point2 QuadTreeNode::center() const {
+	return G3D::Point2(this->x + 0.5f, this->y + 0.5f);
+}
 
 QuadTreeNode::~QuadTreeNode(void)
 {
@@ -2,13 +2,22 @@
 #include <G3D/Vector2.h>
 #include <G3D/Color3.h>
 
+/** One pixel of a QuadTree leaf */
 class QuadTreeNode
 {
 public:
-	QuadTreeNode(G3D::Point2 point);
+	QuadTreeNode(int x, int y);
 	~QuadTreeNode(void);
 
-	float x, y;
+	/** Center of the pixel, for generating rays */
+	G3D::Point2 center() const;
+
+	unsigned short x, y;
+	/** Most samples a pixel can hold; Renderer::maxSamplesPerPixel is clamped to it */
+	static const int MAX_SAMPLES = 0xFFFF;
+
+	/** Samples averaged into color this frame; zero until the pixel is first traced */
+	unsigned short samples;
+	/** Mean radiance of the samples */
 	G3D::Color3 color;
 };
-
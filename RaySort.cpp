@@ -0,0 +1,35 @@
+#include "RaySort.h"
+
+#include <G3D/g3dmath.h>
+
+namespace {
+
+/** Spreads the low 10 bits of x three apart */
+unsigned long long spreadBits(unsigned int x) {
+	unsigned long long v = x & 0x3ff;
+	v = (v | (v << 16)) & 0x030000FFULL;
+	v = (v | (v << 8)) & 0x0300F00FULL;
+	v = (v | (v << 4)) & 0x030C30C3ULL;
+	v = (v | (v << 2)) & 0x09249249ULL;
+	return v;
+}
+
+}
+
+unsigned long long morton3(unsigned int x, unsigned int y, unsigned int z) {
+	return spreadBits(x) | (spreadBits(y) << 1) | (spreadBits(z) << 2);
+}
+
+unsigned int quantize(float f, float lo, float scale, int bits) {
+	int q = (int)((f - lo) * scale * (1 << bits));
+	return (unsigned int)G3D::iClamp(q, 0, (1 << bits) - 1);
+}
+
+unsigned int octant(const G3D::Vector3& direction) {
+	return (direction.x < 0.0f ? 1 : 0) | (direction.y < 0.0f ? 2 : 0) | (direction.z < 0.0f ? 4 : 0);
+}
+
+G3D::Vector3 quantizeScale(const G3D::Vector3& lo, const G3D::Vector3& hi) {
+	G3D::Vector3 extent = hi - lo;
+	return G3D::Vector3(1.0f / G3D::max(extent.x, 1e-6f), 1.0f / G3D::max(extent.y, 1e-6f), 1.0f / G3D::max(extent.z, 1e-6f));
+}
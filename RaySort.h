@@ -0,0 +1,21 @@
+#pragma once
+#include <G3D/Vector3.h>
+
+/**
+  Sort keys that put rays likely to visit the same BVH nodes next to each
+  other: rays in the same direction octant, then from nearby origins along a
+  Morton curve.  Used to order batches of rays before they are traced as
+  packets.
+ */
+
+/** Interleaves the low 10 bits of x, y and z */
+unsigned long long morton3(unsigned int x, unsigned int y, unsigned int z);
+
+/** Quantizes f in [lo, lo + 1 / scale] to bits bits */
+unsigned int quantize(float f, float lo, float scale, int bits);
+
+/** One bit per negative component of direction */
+unsigned int octant(const G3D::Vector3& direction);
+
+/** The scale that maps [lo, hi] to [0, 1] on each axis, for quantize() */
+G3D::Vector3 quantizeScale(const G3D::Vector3& lo, const G3D::Vector3& hi);
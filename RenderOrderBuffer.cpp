@@ -0,0 +1,40 @@
+#include "RenderOrderBuffer.h"
+
+#include <G3D/debugPrintf.h>
+
+
+RenderOrderBuffer::RenderOrderBuffer(int capacity) :
+	m_items(capacity, -1),
+	m_count(0)
+{
+}
+
+void RenderOrderBuffer::reset(int capacity) {
+	this->m_items.assign(capacity, -1);
+	this->m_count = 0;
+}
+
+void RenderOrderBuffer::clear() {
+	this->m_count = 0;
+}
+
+void RenderOrderBuffer::append(int node) {
+	int slot = this->m_count++;
+	debugAssertM(slot < (int)this->m_items.size(), "RenderOrderBuffer overflow: a leaf was visited twice in one frame");
+	if(slot < (int)this->m_items.size()){
+		this->m_items[slot] = node;
+	}
+}
+
+int RenderOrderBuffer::size() const {
+	int count = this->m_count;
+	return count < (int)this->m_items.size() ? count : (int)this->m_items.size();
+}
+
+const int* RenderOrderBuffer::begin() const {
+	return this->m_items.data();
+}
+
+const int* RenderOrderBuffer::end() const {
+	return this->m_items.data() + this->size();
+}
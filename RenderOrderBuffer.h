@@ -0,0 +1,34 @@
+#pragma once
+#include <vector>
+#include <atomic>
+
+/**
+  Fixed-capacity list of the QuadTree leaves (node indices) visited during a pass.
+
+  Workers claim a slot with a single atomic increment instead of taking a
+  lock around push_back.  The capacity is the leaf count of the tree, since
+  every leaf is visited at most once per frame.
+ */
+class RenderOrderBuffer
+{
+public:
+	RenderOrderBuffer(int capacity = 0);
+
+	/** Empties the buffer and changes its capacity.  Not thread safe. */
+	void reset(int capacity);
+
+	/** Empties the buffer.  Not thread safe. */
+	void clear();
+
+	/** Thread safe. */
+	void append(int node);
+
+	int size() const;
+
+	const int* begin() const;
+	const int* end() const;
+
+private:
+	std::vector<int>		m_items;
+	std::atomic<int>		m_count;
+};
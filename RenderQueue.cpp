@@ -0,0 +1,86 @@
+#include "RenderQueue.h"
+#include "WorkerPool.h"
+
+#include <G3D/g3dmath.h>
+
+#include <string.h>
+
+namespace {
+
+/** First input index of chunk c of chunks */
+inline int chunkBegin(int count, int c, int chunks) {
+	return (int)((long long)count * c / chunks);
+}
+
+}
+
+
+RenderQueue::RenderQueue(void) :
+	m_counts(2 * NUM_BUCKETS, 0)
+{
+}
+
+int RenderQueue::bucket(float error) {
+	if(!(error > 0.0f)){
+		return 0;
+	}
+	// The bits of a positive float grow with its value, so the exponent and the
+	// leading mantissa bits are a logarithm without calling log()
+	unsigned int bits;
+	memcpy(&bits, &error, sizeof(bits));
+	int b = (int)(bits >> (23 - MANTISSA_BITS)) - ((127 + MIN_OCTAVE) << MANTISSA_BITS) + 1;
+	return b < 1 ? 1 : (b >= NUM_BUCKETS ? NUM_BUCKETS - 1 : b);
+}
+
+void RenderQueue::sort(const QuadTree& tree, const int *begin, const int *end, float threshold, std::vector<int>& order, WorkerPool *pool) {
+	const int count = (int)(end - begin);
+	const int keys = 2 * NUM_BUCKETS;
+	int chunks = (pool != NULL) ? G3D::min(pool->size(), count / MIN_CHUNK) : 1;
+	chunks = G3D::max(chunks, 1);
+	if(this->m_keys.size() < count){
+		this->m_keys.resize(count);
+	}
+	this->m_counts.assign(chunks * keys, 0);
+
+	auto countChunks = [&](int c0, int c1) {
+		for(int c = c0; c < c1; c++){
+			int *counts = &this->m_counts[c * keys];
+			for(int i = chunkBegin(count, c, chunks); i < chunkBegin(count, c + 1, chunks); i++){
+				float error = tree.nodes[begin[i]].neighborColorDiff;
+				int key = 2 * bucket(error) + (error > threshold ? 1 : 0);
+				this->m_keys[i] = (unsigned short)key;
+				counts[key]++;
+			}
+		}
+	};
+	auto scatterChunks = [&](int c0, int c1) {
+		for(int c = c0; c < c1; c++){
+			int *slots = &this->m_counts[c * keys];
+			for(int i = chunkBegin(count, c, chunks); i < chunkBegin(count, c + 1, chunks); i++){
+				order[slots[this->m_keys[i]]++] = begin[i];
+			}
+		}
+	};
+
+	if(chunks > 1){
+		pool->parallelFor(0, chunks, countChunks);
+	} else {
+		countChunks(0, 1);
+	}
+
+	// Highest key first, and within a key the chunks in input order
+	int slot = 0;
+	for(int key = keys - 1; key >= 0; key--){
+		for(int c = 0; c < chunks; c++){
+			int keyCount = this->m_counts[c * keys + key];
+			this->m_counts[c * keys + key] = slot;
+			slot += keyCount;
+		}
+	}
+
+	if(chunks > 1){
+		pool->parallelFor(0, chunks, scatterChunks);
+	} else {
+		scatterChunks(0, 1);
+	}
+}
@@ -0,0 +1,60 @@
+#pragma once
+#include <vector>
+
+#include "QuadTree.h"
+
+class WorkerPool;
+
+/**
+  Bucketed radix queue that orders QuadTree leaves by neighborColorDiff, highest first.
+
+  The keys live in the tree: calc_neighbor_diff updates each leaf's
+  neighborColorDiff in place on the worker that computes it.  sort() then
+  quantizes the keys into logarithmic buckets and places every leaf with one
+  counting pass and one scatter pass, O(n) instead of the O(n log n) of a heap
+  and without allocating once the queue has seen the largest tree.  Leaves in
+  the same bucket are within 1/BUCKETS_PER_OCTAVE of an octave of each other and keep
+  the order they were given in.  Leaves above and below the threshold never
+  share a bucket, so the high contrast leaves are always a prefix of the order.
+
+  Given a WorkerPool, large inputs are split into one contiguous chunk per
+  worker: the workers count their chunks' keys, the caller turns the counts
+  into each chunk's first slot per key, and the workers scatter their chunks.
+  Chunks are placed in input order within a key, so the order is the same as
+  the serial sort's.  Leaves are not kept in per-bucket lists between sorts:
+  every key changes each time calc_neighbor_diff runs over the whole tree, so
+  updating lists would move every leaf anyway, one at a time.
+
+  The sorted order is consumed by the WorkerPool, whose workers pop it
+  concurrently in priority order.
+ */
+class RenderQueue
+{
+public:
+	/** The bucket of an error is its float exponent and this many leading mantissa bits */
+	const static int MANTISSA_BITS = 3;
+	const static int BUCKETS_PER_OCTAVE = 1 << MANTISSA_BITS;
+	/** Errors at or below 2^MIN_OCTAVE share the lowest bucket, and those above 2^MAX_OCTAVE the highest */
+	const static int MIN_OCTAVE = -20;
+	const static int MAX_OCTAVE = 12;
+	const static int NUM_BUCKETS = (MAX_OCTAVE - MIN_OCTAVE) * BUCKETS_PER_OCTAVE + 1;
+
+	RenderQueue(void);
+
+	/** Smallest chunk of leaves counted and scattered by one worker */
+	const static int MIN_CHUNK = 1 << 14;
+
+	/** Writes the leaves [begin, end) to order[0, end - begin), highest neighborColorDiff first.
+		order must be at least that long.  With a pool, whose previous pass must be finished,
+		the counting and scatter run on its workers.  Not thread safe. */
+	void sort(const QuadTree& tree, const int *begin, const int *end, float threshold, std::vector<int>& order, WorkerPool *pool = NULL);
+
+	/** The bucket of an error, 0 for zero and negative errors */
+	static int bucket(float error);
+
+private:
+	/** Key of each input leaf: twice its bucket, plus one above the threshold */
+	std::vector<unsigned short>	m_keys;
+	/** Per chunk, its leaves per key, then the first slot of each key in the order for that chunk */
+	std::vector<int>			m_counts;
+};
@@ -0,0 +1,1074 @@
+#include "Renderer.h"
+#include "World.h"
+#include "BVH.h"
+#include "ParallelFor.h"
+#include "RaySort.h"
+
+#include <G3D/Color3.h>
+#include <G3D/CoordinateFrame.h>
+#include <G3D/debugPrintf.h>
+
+#include <GLG3D/Light.h>
+#include <GLG3D/UniversalSurfel.h>
+
+#include <math.h>
+#include <string.h>
+#include <algorithm>
+#include <functional>
+
+namespace {
+
+/** Hashes a pixel, sample and dimension, so sampling needs no shared random state */
+unsigned int sampleHash(int x, int y, int sample, int dimension) {
+	unsigned int h = ((unsigned int)x * 73856093u) ^ ((unsigned int)y * 19349663u) ^ ((unsigned int)sample * 83492791u) ^ ((unsigned int)dimension * 2654435761u);
+	h ^= h >> 16;
+	h *= 0x7feb352du;
+	h ^= h >> 15;
+	h *= 0x846ca68bu;
+	h ^= h >> 16;
+	return h;
+}
+
+/** sampleHash() in [0, 1) */
+float sampleJitter(int x, int y, int sample, int dimension) {
+	return (sampleHash(x, y, sample, dimension) >> 8) * (1.0f / 16777216.0f);
+}
+
+/** The dimension of sampleHash() that seeds a sample's shading */
+const int SHADING_DIMENSION = 2;
+
+/** Whether ray enters box before maxDistance; slab test */
+bool rayMeetsBox(const G3D::Ray& ray, float maxDistance, const G3D::AABox& box) {
+	float tNear = 0.0f;
+	float tFar = maxDistance;
+	for(int a = 0; a < 3; a++){
+		float inv = 1.0f / ray.direction()[a];
+		float t0 = (box.low()[a] - ray.origin()[a]) * inv;
+		float t1 = (box.high()[a] - ray.origin()[a]) * inv;
+		if(t0 > t1){
+			std::swap(t0, t1);
+		}
+		tNear = G3D::max(tNear, t0);
+		tFar = G3D::min(tFar, t1);
+		if(tNear > tFar){
+			return false;
+		}
+	}
+	return true;
+}
+
+}
+
+const float Renderer::ERROR_BIAS = 0.05f;
+
+Renderer::Renderer(int width, int height, int numThreads) :
+	world(NULL),
+	raysPerPixel(1),
+	maxBounces(3),
+	threshold(0.05f),
+	errorTarget(0.02f),
+	maxSamplesPerPixel(256),
+	reproject(true),
+	batchShadowRays(true),
+	wavefront(false),
+	reorderRays(true),
+	lightSamples(2),
+	smallDiffStart(0),
+	m_maxError(0.0f),
+	m_depthKeys(NULL),
+	m_hasHistory(false),
+	m_waveOrder(NULL),
+	m_waveBegin(0),
+	m_waveEnd(0),
+	m_waveMode(TRACE_ALL),
+	m_waveAppend(false),
+	m_dirtyLeaves(NULL),
+	m_allDirty(true)
+{
+	this->tree = new QuadTree(width, height);
+	this->resetRenderOrder();
+	this->pool = new WorkerPool(numThreads);
+	for(int i = 0; i < this->pool->size(); i++){
+		this->m_arenas.push_back(new ShadingArena());
+	}
+	this->image = G3D::Image3::createEmpty(width, height);
+	this->resizeBuffers();
+}
+
+Renderer::~Renderer(void)
+{
+	delete this->pool;
+	delete[] this->m_depthKeys;
+	delete[] this->m_dirtyLeaves;
+	for(int i = 0; i < this->m_arenas.size(); i++){
+		delete this->m_arenas[i];
+	}
+	delete this->tree;
+}
+
+int Renderer::width() const {
+	return this->image->width();
+}
+
+int Renderer::height() const {
+	return this->image->height();
+}
+
+void Renderer::resize(int width, int height) {
+	this->tree->resize(width, height);
+	this->resetRenderOrder();
+	this->image = G3D::Image3::createEmpty(width, height);
+	this->resizeBuffers();
+}
+
+void Renderer::resizeBuffers() {
+	int pixels = this->width() * this->height();
+	this->m_hitPositions.assign(pixels, G3D::Point3::zero());
+	this->m_hitNormals.assign(pixels, G3D::Vector3::zero());
+	this->m_historyPositions.assign(pixels, G3D::Point3::zero());
+	this->m_historyNormals.assign(pixels, G3D::Vector3::zero());
+	delete[] this->m_depthKeys;
+	this->m_depthKeys = new std::atomic<unsigned long long>[pixels];
+	this->m_hasHistory = false;
+
+	delete[] this->m_dirtyLeaves;
+	this->m_dirtyLeaves = new std::atomic<unsigned char>[this->tree->leafCount()];
+	for(int i = 0; i < this->tree->leafCount(); i++){
+		this->m_dirtyLeaves[i].store(0, std::memory_order_relaxed);
+	}
+	this->framebuffer.resize(*this->tree, this->framebuffer.alignTiles());
+	this->m_allDirty = true;
+}
+
+void Renderer::publishAll() {
+	QuadTree *tree = this->tree;
+	this->pool->parallelFor(tree->firstLeaf(), tree->size(), [&](int begin, int end) {
+		for(int node = begin; node < end; node++){
+			this->framebuffer.publish(*tree, node);
+		}
+	}, 1024);
+	this->m_allDirty = true;
+}
+
+void Renderer::setAlignTiles(bool alignTiles) {
+	if(alignTiles == this->framebuffer.alignTiles()){
+		return;
+	}
+	this->framebuffer.resize(*this->tree, alignTiles);
+	this->publishAll();
+}
+
+void Renderer::markDirty(int node) {
+	this->m_dirtyLeaves[node - this->tree->firstLeaf()].store(1, std::memory_order_release);
+}
+
+void Renderer::updateImage(std::vector<G3D::Rect2D>& rects) {
+	rects.clear();
+	const int leaves = this->tree->leafCount();
+	if(this->m_allDirty){
+		for(int i = 0; i < leaves; i++){
+			this->m_dirtyLeaves[i].store(0, std::memory_order_relaxed);
+			this->framebuffer.resolve(*this->tree, this->tree->firstLeaf() + i, *this->image);
+		}
+		this->m_allDirty = false;
+		rects.push_back(this->image->rect2DBounds());
+		return;
+	}
+
+	// Leaves in the same row of tiles share their top and bottom, so runs of dirty
+	// leaves along a row merge into one rectangle
+	const unsigned int n = 1u << this->tree->depth();
+	for(unsigned int cy = 0; cy < n; cy++){
+		int runStart = -1;
+		G3D::Rect2D run;
+		for(unsigned int cx = 0; cx <= n; cx++){
+			bool dirty = false;
+			G3D::Rect2D tile;
+			if(cx < n){
+				int leaf = (int)QuadTree::mortonEncode(cx, cy);
+				// Cleared before resolving, so a publication racing with it is picked up next time
+				dirty = this->m_dirtyLeaves[leaf].exchange(0, std::memory_order_acquire) != 0;
+				tile = this->tree->boundary(this->tree->firstLeaf() + leaf);
+				dirty = dirty && tile.area() > 0.0f;
+				if(dirty){
+					this->framebuffer.resolve(*this->tree, this->tree->firstLeaf() + leaf, *this->image);
+				}
+			}
+			if(dirty){
+				run = (runStart < 0) ? tile : G3D::Rect2D::xyxy(run.x0y0(), tile.x1y1());
+				if(runStart < 0){
+					runStart = cx;
+				}
+			} else if(runStart >= 0){
+				rects.push_back(run);
+				runStart = -1;
+			}
+		}
+	}
+}
+
+void Renderer::markAllDirty() {
+	this->m_allDirty = true;
+}
+
+void Renderer::recordHit(int x, int y, const G3D::Surfel* surfel) {
+	int pixel = y * this->width() + x;
+	if(surfel != NULL){
+		this->m_hitPositions[pixel] = surfel->location;
+		this->m_hitNormals[pixel] = surfel->geometricNormal;
+	} else {
+		this->m_hitNormals[pixel] = G3D::Vector3::zero();
+	}
+}
+
+ShadingArena& Renderer::shadingArena(int worker) {
+	return *this->m_arenas[worker];
+}
+
+void Renderer::rayCounts(long long& primary, long long& shadow, long long& secondary) const {
+	primary = shadow = secondary = 0;
+	for(int i = 0; i < this->m_arenas.size(); i++){
+		primary += this->m_arenas[i]->primaryRays;
+		shadow += this->m_arenas[i]->shadowRays;
+		secondary += this->m_arenas[i]->secondaryRays;
+	}
+}
+
+void Renderer::resetRayCounts() {
+	for(int i = 0; i < this->m_arenas.size(); i++){
+		this->m_arenas[i]->primaryRays = 0;
+		this->m_arenas[i]->shadowRays = 0;
+		this->m_arenas[i]->secondaryRays = 0;
+		this->m_arenas[i]->primaryNodeVisits = 0;
+		this->m_arenas[i]->secondaryNodeVisits = 0;
+	}
+}
+
+void Renderer::nodeVisits(long long& primary, long long& secondary) const {
+	primary = secondary = 0;
+	for(int i = 0; i < this->m_arenas.size(); i++){
+		primary += this->m_arenas[i]->primaryNodeVisits;
+		secondary += this->m_arenas[i]->secondaryNodeVisits;
+	}
+}
+
+void Renderer::resetRenderOrder() {
+	this->render_order.resize(this->tree->leafCount());
+	for(int i = 0; i < this->render_order.size(); i++){
+		this->render_order[i] = this->tree->firstLeaf() + i;
+	}
+	this->tmp_render_order.reset(this->tree->leafCount());
+	this->smallDiffStart = 0;
+}
+
+int Renderer::highDiffEnd() const {
+	int index = 0;
+	while(index < this->render_order.size() && this->render_order[index] >= 0 && this->tree->nodes[this->render_order[index]].neighborColorDiff > this->threshold){
+		index++;
+	}
+	return index;
+}
+
+void Renderer::sortRenderOrder() {
+	this->render_queue.sort(*this->tree, this->tmp_render_order.begin(), this->tmp_render_order.end(), this->threshold, this->render_order, this->pool);
+}
+
+/** Traces the untraced pixels of the index-th leaf of render_order, for fastColor() and slowColor() */
+void colorLeaf(void *context, int index, int worker) {
+	Renderer *renderer = (Renderer*)context;
+	int node = renderer->render_order[index];
+
+	if(node < 0){
+		return;
+	}
+
+	renderer->tmp_render_order.append(node);
+
+	ShadingArena& arena = renderer->shadingArena(worker);
+	arena.reset();
+	renderer->traceLeaf(node, Renderer::TRACE_UNTRACED, arena);
+}
+
+void Renderer::fastColor(){
+	this->smallDiffStart = this->highDiffEnd();
+	if(this->wavefront){
+		this->submitWaves("fastColor", &this->render_order, 0, this->smallDiffStart, TRACE_UNTRACED, true);
+		return;
+	}
+	this->pool->submit("fastColor", &colorLeaf, this, 0, this->smallDiffStart);
+}
+
+void Renderer::slowColor(){
+	if(this->wavefront){
+		this->submitWaves("slowColor", &this->render_order, this->smallDiffStart, this->render_order.size(), TRACE_UNTRACED, true);
+		return;
+	}
+	this->pool->submit("slowColor", &colorLeaf, this, this->smallDiffStart, this->render_order.size());
+}
+
+void firstFrame(void *context, int index, int worker){
+	Renderer *renderer = (Renderer*)context;
+	QuadTree *tree = renderer->tree;
+	int node = tree->firstLeaf() + index;
+
+	renderer->tmp_render_order.append(node);
+
+	ShadingArena& arena = renderer->shadingArena(worker);
+	arena.reset();
+	renderer->traceLeaf(node, Renderer::TRACE_ALL, arena);
+}
+
+void Renderer::renderFirstFrame() {
+	this->m_hasHistory = true;
+	if(this->wavefront){
+		this->submitWaves("firstFrame", NULL, 0, this->tree->leafCount(), TRACE_ALL, true);
+		return;
+	}
+	this->pool->submit("firstFrame", &firstFrame, this, 0, this->tree->leafCount());
+}
+
+void waveColor(void *context, int index, int worker) {
+	Renderer *renderer = (Renderer*)context;
+
+	ShadingArena& arena = renderer->shadingArena(worker);
+	arena.reset();
+	renderer->traceWave(index, arena);
+}
+
+void Renderer::submitWaves(const char *name, const std::vector<int> *order, int begin, int end, TraceMode mode, bool append) {
+	this->m_waveOrder = order;
+	this->m_waveBegin = begin;
+	this->m_waveEnd = end;
+	this->m_waveMode = mode;
+	this->m_waveAppend = append;
+	this->pool->submit(name, &waveColor, this, 0, (end - begin + WAVEFRONT_LEAVES - 1) / WAVEFRONT_LEAVES);
+}
+
+void Renderer::traceWave(int chunk, ShadingArena& arena) {
+	int nodes[WAVEFRONT_LEAVES];
+	int count = 0;
+	int first = this->m_waveBegin + chunk * WAVEFRONT_LEAVES;
+	int last = G3D::min(first + WAVEFRONT_LEAVES, this->m_waveEnd);
+	for(int i = first; i < last; i++){
+		int node = (this->m_waveOrder != NULL) ? (*this->m_waveOrder)[i] : this->tree->firstLeaf() + i;
+		if(node < 0){
+			continue;
+		}
+		if(this->m_waveAppend){
+			this->tmp_render_order.append(node);
+		}
+		nodes[count++] = node;
+	}
+	this->traceLeaves(nodes, count, this->m_waveMode, arena);
+}
+
+void color_quad(void *context, int index, int worker) {
+	Renderer *renderer = (Renderer*)context;
+	QuadTree *tree = renderer->tree;
+	int node = renderer->render_order[index];
+
+	if(node < 0 || tree->pointBegin(node) == tree->pointEnd(node)){
+		return;
+	}
+
+	ShadingArena& arena = renderer->shadingArena(worker);
+	arena.reset();
+	arena.primaryRays++;
+
+	G3D::Point2 center = tree->boundary(node).center();
+	int x = (int)center.x;
+	int y = (int)center.y;
+
+	// Through the middle of pixel (x, y), the ray its history and hit describe; the center of an
+	// even-sized leaf is a pixel corner
+	G3D::Ray ray = renderer->camera->worldRay(x + 0.5f, y + 0.5f, renderer->image->rect2DBounds());
+	float distance = (float)G3D::inf();
+	BVH::Hit hit;
+	bool hitSomething = renderer->world->intersect(ray, distance, hit);
+
+	QuadTreeNode& point = tree->points[tree->pointIndex(x, y)];
+	if(point.samples > 0){
+		// Reprojected from the last frame.  Warping cannot show surfaces that were not
+		// visible before, so the center ray checks that the history is still in front.
+		if(renderer->historyValid(x, y, ray, hitSomething ? distance : (float)G3D::inf())){
+			return;
+		}
+		renderer->discardHistory(node);
+	}
+
+	G3D::UniversalSurfel *surfel = NULL;
+	if(hitSomething){
+		surfel = &arena.allocateSurfel();
+		renderer->world->surfel(hit, ray, *surfel);
+	}
+	renderer->recordHit(x, y, surfel);
+	arena.seed(sampleHash(x, y, 0, SHADING_DIMENSION));
+	point.color = renderer->shade(ray, surfel, 1, arena);
+	point.samples = 1;
+	renderer->framebuffer.publish(*tree, node);
+	renderer->markDirty(node);
+}
+
+void Renderer::rayTraceImage() {
+	// The points and the framebuffer are rewritten in place below
+	this->pool->waitForCompletion();
+
+	bool reprojected = this->reproject && this->m_hasHistory;
+	if(reprojected){
+		this->reprojectHistory();
+	} else {
+		this->m_hitNormals.assign(this->m_hitNormals.size(), G3D::Vector3::zero());
+		std::vector<QuadTreeNode>& points = this->tree->points;
+		this->pool->parallelFor(0, (int)points.size(), [&](int begin, int end) {
+			for(int p = begin; p < end; p++){
+				points[p].samples = 0;
+				points[p].color = G3D::Color3::black();
+			}
+		}, 1 << 14);
+	}
+	this->publishAll();
+	this->m_hasHistory = true;
+
+	this->smallDiffStart = this->highDiffEnd();
+	// With history, every leaf's center is traced to validate it
+	this->pool->submit("rayTraceImage", &color_quad, this, 0, reprojected ? this->render_order.size() : this->smallDiffStart);
+}
+
+void Renderer::discardAllHistory() {
+	this->m_hasHistory = false;
+}
+
+bool Renderer::historyValid(int x, int y, const G3D::Ray& ray, float distance) const {
+	int pixel = y * this->width() + x;
+	if(this->m_hitNormals[pixel].isZero() || distance == (float)G3D::inf()){
+		return false;
+	}
+	// Within a percent of the distance: the surface reprojected here is the one the ray hits
+	const G3D::Point3 hit = ray.origin() + ray.direction() * distance;
+	return (hit - this->m_hitPositions[pixel]).squaredLength() <= 1e-4f * distance * distance;
+}
+
+void Renderer::discardHistory(int node) {
+	for(int p = this->tree->pointBegin(node); p < this->tree->pointEnd(node); p++){
+		QuadTreeNode& point = this->tree->points[p];
+		point.samples = 0;
+		point.color = G3D::Color3::black();
+		this->m_hitNormals[point.y * this->width() + point.x] = G3D::Vector3::zero();
+	}
+}
+
+int Renderer::discardSeen(const std::vector<G3D::AABox>& boxes) {
+	this->retrace_order.clear();
+	if(boxes.empty()){
+		return 0;
+	}
+
+	// Pixels without a hit are traced again by the next frame anyway.  A hit on the surface
+	// of a box must still count as inside it.
+	const int width = this->width();
+	const G3D::Rect2D viewport = this->image->rect2DBounds();
+	QuadTree *tree = this->tree;
+	this->m_seenLeaves.assign(tree->leafCount(), 0);
+	this->pool->parallelFor(0, tree->leafCount(), [&](int begin, int end) {
+		for(int leaf = begin; leaf < end; leaf++){
+			int node = tree->firstLeaf() + leaf;
+			for(int p = tree->pointBegin(node); p < tree->pointEnd(node); p++){
+				QuadTreeNode& point = tree->points[p];
+				int pixel = point.y * width + point.x;
+				if(this->m_hitNormals[pixel].isZero()){
+					continue;
+				}
+				G3D::Ray ray = this->camera->worldRay(point.x + 0.5f, point.y + 0.5f, viewport);
+				float distance = (this->m_hitPositions[pixel] - ray.origin()).length() * 1.001f;
+				for(int b = 0; b < boxes.size(); b++){
+					if(rayMeetsBox(ray, distance, boxes[b])){
+						point.samples = 0;
+						point.color = G3D::Color3::black();
+						this->m_hitNormals[pixel] = G3D::Vector3::zero();
+						this->m_seenLeaves[leaf] = 1;
+						break;
+					}
+				}
+			}
+		}
+	}, 64);
+
+	for(int leaf = 0; leaf < tree->leafCount(); leaf++){
+		if(this->m_seenLeaves[leaf]){
+			this->retrace_order.push_back(tree->firstLeaf() + leaf);
+		}
+	}
+	return (int)this->retrace_order.size();
+}
+
+void retraceLeaf(void *context, int index, int worker) {
+	Renderer *renderer = (Renderer*)context;
+
+	ShadingArena& arena = renderer->shadingArena(worker);
+	arena.reset();
+	renderer->traceLeaf(renderer->retrace_order[index], Renderer::TRACE_UNTRACED, arena);
+}
+
+void Renderer::retraceSeen() {
+	const int count = (int)this->retrace_order.size();
+	if(this->wavefront){
+		this->submitWaves("retrace", &this->retrace_order, 0, count, TRACE_UNTRACED, false);
+		return;
+	}
+	this->pool->submit("retrace", &retraceLeaf, this, 0, count);
+}
+
+int Renderer::reprojectHistory() {
+	const int width = this->width();
+	const int height = this->height();
+	const int pixels = width * height;
+	std::swap(this->m_hitPositions, this->m_historyPositions);
+	std::swap(this->m_hitNormals, this->m_historyNormals);
+
+	// The screen position of a point follows from the tangents of its camera space
+	// direction, so two corner rays give the whole projection, whatever the field of view
+	const G3D::CFrame frame = this->camera->frame();
+	const G3D::Rect2D viewport = this->image->rect2DBounds();
+	G3D::Vector3 corner0 = frame.vectorToObjectSpace(this->camera->worldRay(0.0f, 0.0f, viewport).direction());
+	G3D::Vector3 corner1 = frame.vectorToObjectSpace(this->camera->worldRay((float)width, (float)height, viewport).direction());
+	float u0 = corner0.x / -corner0.z;
+	float v0 = corner0.y / -corner0.z;
+	float scaleX = width / (corner1.x / -corner1.z - u0);
+	float scaleY = height / (corner1.y / -corner1.z - v0);
+
+	// Splat every old hit into the new view; the nearest one in each pixel wins.  A key
+	// is the depth's float bits above the source pixel, so an atomic minimum picks it.
+	const unsigned long long EMPTY = ~0ULL;
+	std::atomic<unsigned long long> *keys = this->m_depthKeys;
+	this->pool->parallelFor(0, pixels, [&](int begin, int end) {
+		for(int i = begin; i < end; i++){
+			keys[i].store(EMPTY, std::memory_order_relaxed);
+		}
+	}, 1 << 14);
+	this->pool->parallelFor(0, pixels, [&](int begin, int end) {
+		for(int i = begin; i < end; i++){
+			const G3D::Vector3& normal = this->m_historyNormals[i];
+			if(normal.isZero() || this->framebuffer.samples(i) == 0){
+				continue;
+			}
+			const G3D::Point3& position = this->m_historyPositions[i];
+			// Surfaces seen from behind now are hidden by whatever is in front of them
+			if(normal.dot(frame.translation - position) <= 0.0f){
+				continue;
+			}
+			G3D::Point3 p = frame.pointToObjectSpace(position);
+			if(p.z >= 0.0f){
+				continue;
+			}
+			int x = (int)floor((p.x / -p.z - u0) * scaleX);
+			int y = (int)floor((p.y / -p.z - v0) * scaleY);
+			if(x < 0 || y < 0 || x >= width || y >= height){
+				continue;
+			}
+
+			float depth = -p.z;
+			unsigned int depthBits;
+			memcpy(&depthBits, &depth, sizeof(depthBits));
+			unsigned long long key = ((unsigned long long)depthBits << 32) | (unsigned int)i;
+			std::atomic<unsigned long long>& slot = keys[y * width + x];
+			unsigned long long current = slot.load(std::memory_order_relaxed);
+			while(key < current && !slot.compare_exchange_weak(current, key, std::memory_order_relaxed)){
+			}
+		}
+	}, 1 << 14);
+
+	// Pixels nothing landed on are disoccluded, or were sky, and stay untraced.  The
+	// colors come from the framebuffer, which still holds the last frame.
+	QuadTree *tree = this->tree;
+	this->pool->parallelFor(0, pixels, [&](int begin, int end) {
+		for(int i = begin; i < end; i++){
+			QuadTreeNode& point = tree->points[tree->pointIndex(i % width, i / width)];
+			unsigned long long key = keys[i].load(std::memory_order_relaxed);
+			if(key == EMPTY){
+				this->m_hitNormals[i] = G3D::Vector3::zero();
+				point.samples = 0;
+				point.color = G3D::Color3::black();
+				continue;
+			}
+			int source = (int)(key & 0xFFFFFFFFULL);
+			this->m_hitPositions[i] = this->m_historyPositions[source];
+			this->m_hitNormals[i] = this->m_historyNormals[source];
+			point.samples = 1;
+			point.color = this->framebuffer.color(source);
+		}
+	}, 1 << 14);
+
+	// Leaves that are fully covered take their color from the history; the rest are traced first
+	std::atomic<int> disoccluded(0);
+	this->pool->parallelFor(0, tree->leafCount(), [&](int begin, int end) {
+		for(int leaf = begin; leaf < end; leaf++){
+			int node = tree->firstLeaf() + leaf;
+			G3D::Color3 sum = G3D::Color3::black();
+			bool hole = false;
+			for(int p = tree->pointBegin(node); p < tree->pointEnd(node); p++){
+				const QuadTreeNode& point = tree->points[p];
+				if(point.samples == 0){
+					hole = true;
+					break;
+				}
+				sum += point.color;
+			}
+			if(hole){
+				tree->nodes[node].neighborColorDiff = (float)G3D::inf();
+				disoccluded++;
+			} else if(tree->pointEnd(node) > tree->pointBegin(node)){
+				tree->nodes[node].color = sum / (float)(tree->pointEnd(node) - tree->pointBegin(node));
+			}
+		}
+	}, 1024);
+
+	this->m_reorder.clear();
+	for(int i = 0; i < this->render_order.size(); i++){
+		if(this->render_order[i] >= 0){
+			this->m_reorder.push_back(this->render_order[i]);
+		}
+	}
+	this->render_queue.sort(*tree, this->m_reorder.data(), this->m_reorder.data() + this->m_reorder.size(), this->threshold, this->render_order, this->pool);
+	return disoccluded;
+}
+
+void calc_neighbor_diff(void *context, int index, int /*worker*/){
+	Renderer *renderer = (Renderer*)context;
+	QuadTree *tree = renderer->tree;
+
+	if(tree->depth() == 0){
+		tree->nodes[index].neighborColorDiff = 0.0f;
+		return;
+	}
+
+	// A leaf takes the contrast between itself and its siblings: the RMS distance of
+	// the four children from their mean.  Signed differences from the mean would cancel.
+	int node = tree->isLeaf(index) ? tree->parent(index) : index;
+	const G3D::Color3& color = tree->nodes[node].color;
+
+	float sum = 0.0f;
+	for(int c = 0; c < 4; c++){
+		sum += (tree->nodes[tree->child(node, c)].color - color).squaredLength();
+	}
+	tree->nodes[index].neighborColorDiff = sqrt(sum / 4);
+}
+
+void Renderer::calculateNeighborDiff(){
+	this->tree->updateInternalColors();
+	this->pool->submit("neighborDiff", &calc_neighbor_diff, this, 0, this->tree->size());
+}
+
+void refineLeaf(void *context, int index, int worker) {
+	Renderer *renderer = (Renderer*)context;
+
+	ShadingArena& arena = renderer->shadingArena(worker);
+	arena.reset();
+	renderer->traceLeaf(renderer->refine_order[index], Renderer::ADD_SAMPLES, arena);
+}
+
+void Renderer::traceLeaf(int node, TraceMode mode, ShadingArena& arena) {
+	this->traceLeaves(&node, 1, mode, arena);
+}
+
+void Renderer::traceLeaves(const int *nodes, int count, TraceMode mode, ShadingArena& arena) {
+	arena.sampleRadiance.clear();
+	arena.samplePoints.clear();
+	arena.leafSamples.clear();
+	arena.paths.clear();
+	for(int k = 0; k < count; k++){
+		arena.leafSamples.push_back(arena.sampleRadiance.size());
+		this->startSamples(nodes[k], mode, arena);
+	}
+	arena.leafSamples.push_back(arena.sampleRadiance.size());
+
+	if(this->wavefront){
+		this->traceBreadthFirst(arena);
+	} else {
+		this->traceDepthFirst(arena);
+	}
+	arena.shadowQueue.setSample(-1);
+	arena.shadowQueue.trace(*this->world, arena.sampleRadiance.data());
+
+	for(int k = 0; k < count; k++){
+		QuadTree::Node& leaf = this->tree->nodes[nodes[k]];
+		for(int s = arena.leafSamples[k]; s < arena.leafSamples[k + 1]; s++){
+			QuadTreeNode& point = this->tree->points[arena.samplePoints[s]];
+			const G3D::Radiance3& radiance = arena.sampleRadiance[s];
+			addLeafSample(leaf, radiance);
+
+			// Running mean, so the pixel is correct after every sample
+			point.samples++;
+			point.color += (radiance - point.color) / (float)point.samples;
+		}
+
+		const int begin = this->tree->pointBegin(nodes[k]);
+		const int end = this->tree->pointEnd(nodes[k]);
+		G3D::Color3 sum = G3D::Color3::black();
+		for(int p = begin; p < end; p++){
+			sum += this->tree->points[p].color;
+		}
+		if(end > begin){
+			leaf.color = sum / (float)(end - begin);
+		}
+		this->framebuffer.publish(*this->tree, nodes[k]);
+		this->markDirty(nodes[k]);
+	}
+}
+
+void Renderer::startSamples(int node, TraceMode mode, ShadingArena& arena) {
+	QuadTree::Node& leaf = this->tree->nodes[node];
+	const G3D::Rect2D viewport = this->image->rect2DBounds();
+	const int begin = this->tree->pointBegin(node);
+	const int end = this->tree->pointEnd(node);
+
+	if(mode != ADD_SAMPLES){
+		leaf.samples = 0;
+		leaf.meanLuminance = 0.0f;
+		leaf.luminanceM2 = 0.0f;
+	}
+
+	for(int i = begin; i < end; i++){
+		QuadTreeNode& point = this->tree->points[i];
+		if(mode != ADD_SAMPLES){
+			if(mode == TRACE_UNTRACED && point.samples > 0){
+				// Traced or reprojected by rayTraceImage, or kept by discardSeen, possibly after refining.
+				// Its mean stands in for all of its samples, so the leaf's sample count stays that of
+				// its pixels; only the spread within the pixel is lost.
+				addLeafSample(leaf, point.color, point.samples);
+				continue;
+			}
+			point.samples = 0;
+			point.color = G3D::Color3::black();
+		}
+
+		for(int sample = 0; sample < this->raysPerPixel; sample++){
+			// A pixel's first sample goes through its center, so one ray per pixel is not jittered
+			int index = point.samples + sample;
+			float dx = (index == 0) ? 0.5f : sampleJitter(point.x, point.y, index, 0);
+			float dy = (index == 0) ? 0.5f : sampleJitter(point.x, point.y, index, 1);
+
+			PathSegment path;
+			path.ray = this->camera->worldRay(point.x + dx, point.y + dy, viewport);
+			path.weight = G3D::Color3::one();
+			path.sample = arena.sampleRadiance.size();
+			path.seed = sampleHash(point.x, point.y, index, SHADING_DIMENSION);
+			path.bounce = 1;
+			path.center = (index == 0);
+			arena.paths.push_back(path);
+			arena.sampleRadiance.push_back(G3D::Radiance3::zero());
+			arena.samplePoints.push_back(i);
+		}
+	}
+}
+
+void Renderer::traceDepthFirst(ShadingArena& arena) {
+	RayPacket packet;
+	BVH::Hit hits[RayPacket::SIZE];
+
+	for(int first = 0; first < arena.paths.size(); first += RayPacket::SIZE){
+		packet.count = G3D::min((int)RayPacket::SIZE, (int)arena.paths.size() - first);
+		for(int lane = 0; lane < packet.count; lane++){
+			packet.set(lane, arena.paths[first + lane].ray, (float)G3D::inf());
+		}
+		this->world->intersect8(packet, hits);
+		arena.primaryRays += packet.count;
+		arena.primaryNodeVisits += packet.nodesVisited;
+
+		for(int lane = 0; lane < packet.count; lane++){
+			const PathSegment& path = arena.paths[first + lane];
+			G3D::UniversalSurfel *surfel = NULL;
+			if(hits[lane].triIndex >= 0){
+				surfel = &arena.allocateSurfel();
+				this->world->surfel(hits[lane], path.ray, *surfel);
+			}
+			if(path.center){
+				const QuadTreeNode& point = this->tree->points[arena.samplePoints[path.sample]];
+				this->recordHit(point.x, point.y, surfel);
+			}
+			arena.seed(path.seed);
+			arena.shadowQueue.setSample(this->batchShadowRays ? path.sample : -1);
+			arena.sampleRadiance[path.sample] += this->shade(path.ray, surfel, path.bounce, arena, path.weight) * path.weight;
+		}
+	}
+}
+
+void Renderer::traceBreadthFirst(ShadingArena& arena) {
+	const float BUMP_DISTANCE = 0.0001f;
+	RayPacket packet;
+
+	while(!arena.paths.empty()){
+		// Nothing outlives the wave that allocated it
+		arena.reset();
+
+		// Primary rays already come in pixel order; reflections and refractions scatter
+		const bool primary = (arena.paths[0].bounce == 1);
+		if(!primary && this->reorderRays){
+			this->reorderPaths(arena);
+		}
+
+		// Intersect the whole wave first, so the BVH stays in cache
+		arena.hits.resize(arena.paths.size());
+		for(int first = 0; first < arena.paths.size(); first += RayPacket::SIZE){
+			packet.count = G3D::min((int)RayPacket::SIZE, (int)arena.paths.size() - first);
+			for(int lane = 0; lane < packet.count; lane++){
+				packet.set(lane, arena.paths[first + lane].ray, (float)G3D::inf());
+			}
+			this->world->intersect8(packet, &arena.hits[first]);
+			if(primary){
+				arena.primaryNodeVisits += packet.nodesVisited;
+			} else {
+				arena.secondaryNodeVisits += packet.nodesVisited;
+			}
+		}
+		if(primary){
+			arena.primaryRays += arena.paths.size();
+		}
+
+		// Then shade the hits grouped by material, so each material's data and code are
+		// loaded once per wave rather than once per path
+		arena.shadingOrder.clear();
+		for(int i = 0; i < arena.paths.size(); i++){
+			const PathSegment& path = arena.paths[i];
+			if(arena.hits[i].triIndex >= 0){
+				arena.shadingOrder.push_back(std::make_pair(this->world->materialIndex(arena.hits[i].triIndex), i));
+				continue;
+			}
+			// Hit the sky
+			if(path.center){
+				const QuadTreeNode& point = this->tree->points[arena.samplePoints[path.sample]];
+				this->recordHit(point.x, point.y, NULL);
+			}
+			arena.sampleRadiance[path.sample] += this->world->ambient * path.weight;
+		}
+		std::sort(arena.shadingOrder.begin(), arena.shadingOrder.end());
+
+		arena.nextPaths.clear();
+		for(int j = 0; j < arena.shadingOrder.size(); j++){
+			const int i = arena.shadingOrder[j].second;
+			const PathSegment& path = arena.paths[i];
+			G3D::UniversalSurfel *surfel = &arena.allocateSurfel();
+			this->world->surfel(arena.hits[i], path.ray, *surfel);
+			if(path.center){
+				const QuadTreeNode& point = this->tree->points[arena.samplePoints[path.sample]];
+				this->recordHit(point.x, point.y, surfel);
+			}
+			arena.seed(path.seed);
+			arena.shadowQueue.setSample(this->batchShadowRays ? path.sample : -1);
+			arena.sampleRadiance[path.sample] += this->directIllumination(path.ray, surfel, path.weight, arena) * path.weight;
+
+			if(path.bounce < this->maxBounces){
+				// Perfect reflection and refraction, traced with the next wave
+				G3D::Surfel::ImpulseArray& impulseArray = arena.allocateImpulses();
+				surfel->getImpulses(G3D::PathDirection::EYE_TO_SOURCE, -path.ray.direction(), impulseArray);
+
+				for(int k = 0; k < impulseArray.size(); k++){
+					const G3D::Surfel::Impulse& impulse = impulseArray[k];
+					const G3D::Vector3& offset = surfel->geometricNormal * G3D::sign(impulse.direction.dot(surfel->geometricNormal)) * BUMP_DISTANCE;
+					PathSegment next;
+					next.ray = G3D::Ray::fromOriginAndDirection(surfel->location + offset, impulse.direction);
+					next.weight = path.weight * impulse.magnitude;
+					next.sample = path.sample;
+					next.seed = path.seed * 0x9E3779B9u + k + 1;
+					next.bounce = path.bounce + 1;
+					next.center = false;
+					arena.nextPaths.push_back(next);
+					arena.secondaryRays++;
+				}
+			}
+		}
+		arena.paths.swap(arena.nextPaths);
+	}
+}
+
+void Renderer::addLeafSample(QuadTree::Node& leaf, const G3D::Radiance3& radiance, int count) {
+	float luminance = radiance.average();
+	leaf.samples += count;
+	float delta = luminance - leaf.meanLuminance;
+	leaf.meanLuminance += delta * count / leaf.samples;
+	leaf.luminanceM2 += delta * (luminance - leaf.meanLuminance) * count;
+}
+
+float Renderer::leafError(int node) const {
+	const QuadTree::Node& leaf = this->tree->nodes[node];
+	int pixels = this->tree->pointEnd(node) - this->tree->pointBegin(node);
+	if(pixels == 0){
+		return 0.0f;
+	}
+	if(leaf.samples < 2){
+		return (float)G3D::inf();
+	}
+
+	// The standard error of a pixel's mean, relative to the leaf's brightness.  The
+	// variance is over every sample of the leaf, so edges inside it count as error too
+	// and get antialiased.
+	float variance = leaf.luminanceM2 / (leaf.samples - 1);
+	float samplesPerPixel = leaf.samples / (float)pixels;
+	return sqrt(variance / samplesPerPixel) / (leaf.meanLuminance + ERROR_BIAS);
+}
+
+int Renderer::refine() {
+	// A pass adds raysPerPixel samples to every pixel of a leaf, which must still fit in its count
+	const int maxSamples = G3D::max(1, G3D::min(this->maxSamplesPerPixel, QuadTreeNode::MAX_SAMPLES - this->raysPerPixel));
+	this->m_leafErrors.clear();
+	this->m_maxError = 0.0f;
+	for(int i = 0; i < this->tree->leafCount(); i++){
+		int node = this->tree->firstLeaf() + i;
+		float error = this->leafError(node);
+		this->m_maxError = G3D::max(this->m_maxError, error);
+
+		int pixels = this->tree->pointEnd(node) - this->tree->pointBegin(node);
+		if(error > this->errorTarget && this->tree->nodes[node].samples < pixels * maxSamples){
+			this->m_leafErrors.push_back(std::make_pair(error, node));
+		}
+	}
+
+	// Only the worst leaves get samples each pass, so the next pass ranks them
+	// again with the new estimates
+	int count = G3D::min((int)this->m_leafErrors.size(), G3D::max(REFINE_MIN_LEAVES, this->tree->leafCount() / REFINE_FRACTION));
+	std::partial_sort(this->m_leafErrors.begin(), this->m_leafErrors.begin() + count, this->m_leafErrors.end(), std::greater<std::pair<float, int> >());
+	this->refine_order.resize(count);
+	for(int i = 0; i < count; i++){
+		this->refine_order[i] = this->m_leafErrors[i].second;
+	}
+
+	if(count > 0 && this->wavefront){
+		this->submitWaves("refine", &this->refine_order, 0, count, ADD_SAMPLES, false);
+	} else if(count > 0){
+		this->pool->submit("refine", &refineLeaf, this, 0, count);
+	}
+	return count;
+}
+
+float Renderer::maxError() const {
+	return this->m_maxError;
+}
+
+G3D::Radiance3 Renderer::rayTrace(const G3D::Ray& ray, ShadingArena& arena, int bounce, const G3D::Color3& weight) {
+    float dist = (float)G3D::inf();
+	BVH::Hit hit;
+	G3D::UniversalSurfel *surfel = NULL;
+	if(this->world->intersect(ray, dist, hit)){
+		surfel = &arena.allocateSurfel();
+		this->world->surfel(hit, ray, *surfel);
+	}
+
+	return this->shade(ray, surfel, bounce, arena, weight);
+}
+
+G3D::Radiance3 Renderer::shade(const G3D::Ray& ray, const G3D::Surfel* surfel, int bounce, ShadingArena& arena, const G3D::Color3& weight) {
+	World *world = this->world;
+    G3D::Radiance3 radiance = G3D::Radiance3::zero();
+    const float BUMP_DISTANCE = 0.0001f;
+
+    if (surfel != NULL) {
+		// Shade this point (direct illumination)
+		radiance += this->directIllumination(ray, surfel, weight, arena);
+
+        // Specular
+        if (bounce < this->maxBounces) {
+            // Perfect reflection and refraction
+            G3D::Surfel::ImpulseArray& impulseArray = arena.allocateImpulses();
+            surfel->getImpulses(G3D::PathDirection::EYE_TO_SOURCE, -ray.direction(), impulseArray);
+
+            for (int i = 0; i < impulseArray.size(); ++i) {
+                const G3D::Surfel::Impulse& impulse = impulseArray[i];
+                // Bump along normal *in the outgoing ray direction*.
+                const G3D::Vector3& offset = surfel->geometricNormal * G3D::sign(impulse.direction.dot(surfel->geometricNormal)) * BUMP_DISTANCE;
+                const G3D::Ray& secondaryRay = G3D::Ray::fromOriginAndDirection(surfel->location + offset, impulse.direction);
+                debugAssert(secondaryRay.direction().isFinite());
+                arena.secondaryRays++;
+                radiance += rayTrace(secondaryRay, arena, bounce + 1, weight * impulse.magnitude) * impulse.magnitude;
+                debugAssert(radiance.isFinite());
+            }
+        }
+    } else {
+        // Hit the sky
+        radiance = world->ambient;
+    }
+
+    return radiance;
+}
+
+void Renderer::reorderPaths(ShadingArena& arena) {
+	const int count = arena.paths.size();
+	G3D::Vector3 lo = arena.paths[0].ray.origin();
+	G3D::Vector3 hi = lo;
+	for(int i = 1; i < count; i++){
+		lo = lo.min(arena.paths[i].ray.origin());
+		hi = hi.max(arena.paths[i].ray.origin());
+	}
+	G3D::Vector3 scale = quantizeScale(lo, hi);
+
+	arena.rayOrder.resize(count);
+	for(int i = 0; i < count; i++){
+		const G3D::Ray& ray = arena.paths[i].ray;
+		unsigned long long origin = morton3(quantize(ray.origin().x, lo.x, scale.x, 10), quantize(ray.origin().y, lo.y, scale.y, 10),
+			quantize(ray.origin().z, lo.z, scale.z, 10));
+		arena.rayOrder[i] = std::make_pair(((unsigned long long)octant(ray.direction()) << 30) | origin, i);
+	}
+	std::sort(arena.rayOrder.begin(), arena.rayOrder.end());
+
+	// nextPaths is free until shading refills it
+	arena.nextPaths.resize(count);
+	for(int i = 0; i < count; i++){
+		arena.nextPaths[i] = arena.paths[arena.rayOrder[i].second];
+	}
+	arena.paths.swap(arena.nextPaths);
+}
+
+G3D::Radiance3 Renderer::directIllumination(const G3D::Ray& ray, const G3D::Surfel* surfel, const G3D::Color3& weight, ShadingArena& arena) {
+	const World *world = this->world;
+	G3D::Radiance3 radiance = G3D::Radiance3::zero();
+	if (world->lightArray.size() <= this->lightSamples) {
+		for (int L = 0; L < world->lightArray.size(); ++L) {
+			radiance += this->directLight(*world->lightArray[L], ray, surfel, 1.0f, weight, arena);
+		}
+	} else {
+		// Each shadow ray goes to one light picked by importance; dividing by the
+		// probability of the pick keeps the average over samples unbiased
+		const LightBVH& lights = world->lightBVH();
+		for (int s = 0; s < this->lightSamples; ++s) {
+			float pdf;
+			int L = lights.sample(surfel->location, surfel->shadingNormal, arena.random(), pdf);
+			if (L >= 0) {
+				radiance += this->directLight(*world->lightArray[L], ray, surfel, 1.0f / (pdf * this->lightSamples), weight, arena);
+			}
+		}
+	}
+	debugAssert(radiance.isFinite());
+	return radiance;
+}
+
+G3D::Radiance3 Renderer::directLight(const G3D::Light& light, const G3D::Ray& ray, const G3D::Surfel* surfel, float scale, const G3D::Color3& weight, ShadingArena& arena) {
+	const float BUMP_DISTANCE = 0.0001f;
+
+	G3D::Vector3 w_i = light.position().xyz() - surfel->location;
+	const float distance2 = w_i.squaredLength();
+	w_i /= sqrt(distance2);
+
+	// Biradiance
+	const G3D::Biradiance3& B_i = light.color / (4.0f * G3D::pif() * distance2);
+
+	const G3D::Radiance3 radiance = surfel->finiteScatteringDensity(w_i, -ray.direction()) *
+		B_i *
+		G3D::max(0.0f, w_i.dot(surfel->shadingNormal)) * scale;
+	if (radiance.isZero()) {
+		// Facing away from the light; nothing to test
+		return radiance;
+	}
+
+	// Shadow rays
+	arena.shadowRays++;
+	const G3D::Point3 origin = surfel->location + surfel->geometricNormal * BUMP_DISTANCE;
+	ShadowQueue& queue = arena.shadowQueue;
+	if (queue.sample() >= 0) {
+		G3D::Vector3 toLight = light.position().xyz() - origin;
+		float distance = toLight.length();
+		queue.push(origin, toLight / distance, distance, radiance * weight);
+		return G3D::Radiance3::zero();
+	}
+	if (!this->world->lineOfSight(origin, light.position().xyz())) {
+		return G3D::Radiance3::zero();
+	}
+	return radiance;
+}
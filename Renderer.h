@@ -0,0 +1,278 @@
+#pragma once
+#include <G3D/Color3.h>
+#include <G3D/Image3.h>
+#include <G3D/Ray.h>
+#include <G3D/Rect2D.h>
+#include <G3D/AABox.h>
+
+#include <GLG3D/Camera.h>
+#include <GLG3D/Light.h>
+#include <GLG3D/Surfel.h>
+
+#include <vector>
+#include <atomic>
+#include <utility>
+
+#include "QuadTree.h"
+#include "Framebuffer.h"
+#include "WorkerPool.h"
+#include "RenderOrderBuffer.h"
+#include "RenderQueue.h"
+#include "ShadingArena.h"
+
+class World;
+
+/**
+  The progressive ray tracing pipeline, independent of any window.
+
+  A frame is a sequence of passes over the leaves of the QuadTree, each run on
+  the WorkerPool: rayTraceImage() (one ray per leaf), renderFirstFrame() (every
+  pixel), fastColor() and slowColor() (the untraced pixels of the high and low
+  contrast leaves), then calculateNeighborDiff() and sortRenderOrder() to
+  prioritize the next frame.  Once a frame is complete, refine() passes add
+  samples to the leaves with the largest estimated error until it is below
+  errorTarget.  Passes return immediately; the owner waits on pool or polls it.
+  App drives them from onGraphics, the batch mode in order.
+
+  Every pixel remembers where its center ray hit.  When the camera moves,
+  rayTraceImage() splats those hits into the new view and keeps their colors,
+  so only disoccluded pixels start out untraced; the leaves holding them go to
+  the front of render_order.
+ */
+class Renderer
+{
+public:
+	/** Zero threads means one per hardware thread */
+	Renderer(int width, int height, int numThreads = 0);
+	~Renderer(void);
+
+	World						*world;
+	shared_ptr<G3D::Camera>		camera;
+	/** Primary rays per pixel per pass; a pixel's first goes through its center, the rest are jittered */
+	int							raysPerPixel;
+	int							maxBounces;
+	float						threshold;
+	/** refine() stops once no leaf's relative standard error is above this */
+	float						errorTarget;
+	/** refine() leaves alone leaves that have this many samples per pixel, or close enough to
+		QuadTreeNode::MAX_SAMPLES that another pass could overflow a pixel's count */
+	int							maxSamplesPerPixel;
+	/** Seed each new frame with the last one, warped to the new camera */
+	bool						reproject;
+	/** Queue the shadow rays of each leaf and trace them together, sorted, instead of one at a
+		time while shading; see ShadowQueue */
+	bool						batchShadowRays;
+	/** Trace breadth first: each task takes WAVEFRONT_LEAVES leaves, intersects all their rays
+		of one bounce, shades the hits sorted by material and queues the next bounce, instead
+		of following each path depth first with rayTrace() */
+	bool						wavefront;
+	/** With wavefront, sort each wave of secondary rays by direction octant and then by the
+		Morton code of its origin before tracing it, so each packet's rays visit the same nodes.
+		Only change between passes. */
+	bool						reorderRays;
+	/** Shadow rays per hit.  With more lights than this, the lights are picked from the world's
+		LightBVH in proportion to their estimated contribution instead of all being tested. */
+	int							lightSamples;
+
+	QuadTree					*tree;
+	WorkerPool					*pool;
+	/** What the workers have finished, published a leaf at a time */
+	Framebuffer					framebuffer;
+	/** The framebuffer resolved for display by updateImage().  Workers never touch it. */
+	shared_ptr<G3D::Image3>		image;
+	int							smallDiffStart;
+
+	/** Leaves of tree, highest neighborColorDiff first; -1 marks unused slots */
+	std::vector<int>			render_order;
+	/** Nodes in the order they were visited this frame; sorted into render_order between frames */
+	RenderOrderBuffer			tmp_render_order;
+	RenderQueue					render_queue;
+	/** Leaves being traced by the current refine() pass, worst first */
+	std::vector<int>			refine_order;
+	/** Leaves found by the last discardSeen(), in tree order */
+	std::vector<int>			retrace_order;
+
+	enum TraceMode {
+		/** Starts every pixel over */
+		TRACE_ALL,
+		/** Starts over the pixels rayTraceImage() has not traced this frame */
+		TRACE_UNTRACED,
+		/** Adds samples to every pixel */
+		ADD_SAMPLES
+	};
+
+	int width() const;
+	int height() const;
+
+	/** Rebuilds the tree and image for a new size.  No pass may be running. */
+	void resize(int width, int height);
+
+	/** Starts a new frame from the last one reprojected into the camera, or a blank image, and
+		traces one ray at the center of each high contrast leaf.  With history, every leaf's
+		center ray is traced to validate it instead. */
+	void rayTraceImage();
+	/** Makes the next rayTraceImage() start from a blank image, so nothing of the frame is reused */
+	void discardAllHistory();
+	void renderFirstFrame();
+	void fastColor();
+	void slowColor();
+	void calculateNeighborDiff();
+	/** Orders the leaves traced this frame by contrast into render_order, counting and
+		scattering them on the pool's workers.  Blocks; no pass may be running. */
+	void sortRenderOrder();
+
+	/** Starts a pass adding raysPerPixel samples to each pixel of the leaves with the largest
+		error above errorTarget.  Returns the number of leaves, zero once the frame has converged. */
+	int refine();
+
+	/** The largest leafError() seen by the last refine() */
+	float maxError() const;
+
+	/** Estimated relative standard error of the pixels of a leaf, from its running luminance statistics */
+	float leafError(int node) const;
+
+	/** Index of the first entry of render_order whose neighborColorDiff is at or below the threshold */
+	int highDiffEnd() const;
+
+	/** Puts every leaf of tree in render_order, in tree order */
+	void resetRenderOrder();
+
+	/** Trace a single ray backwards.  Surfels come from arena.  weight is what the radiance
+		will be multiplied by on its way to the eye, for the shadow rays shade() defers. */
+	G3D::Radiance3 rayTrace(const G3D::Ray& ray, ShadingArena& arena, int bounce = 1, const G3D::Color3& weight = G3D::Color3::one());
+
+	/** Radiance leaving surfel back along ray; a NULL surfel means the ray hit the sky.  Light
+		sampling draws from arena's random numbers, which the caller seeds per sample.  While
+		arena's shadowQueue has a sample, direct light is queued there instead of returned. */
+	G3D::Radiance3 shade(const G3D::Ray& ray, const G3D::Surfel* surfel, int bounce, ShadingArena& arena, const G3D::Color3& weight = G3D::Color3::one());
+
+	/** Traces raysPerPixel primary rays for each pixel of a leaf, as packets, averages them
+		into the pixels, the leaf's color and its luminance statistics, and publishes the leaf */
+	void traceLeaf(int node, TraceMode mode, ShadingArena& arena);
+
+	/** traceLeaf() for several leaves at once, breadth first when wavefront is set */
+	void traceLeaves(const int *nodes, int count, TraceMode mode, ShadingArena& arena);
+
+	/** Traces the chunk-th group of leaves of the pass started by submitWaves() */
+	void traceWave(int chunk, ShadingArena& arena);
+
+	/** Remembers where the center ray of a pixel hit; a NULL surfel is a miss */
+	void recordHit(int x, int y, const G3D::Surfel* surfel);
+
+	/** Whether the history reprojected to a pixel is the surface ray hits at distance */
+	bool historyValid(int x, int y, const G3D::Ray& ray, float distance) const;
+
+	/** Marks the pixels of a leaf whose history turned out to be wrong untraced */
+	void discardHistory(int node);
+
+	/** For objects that moved from or to boxes while the camera stayed put: marks untraced every
+		pixel whose center ray passes through one of them before reaching its hit, and collects
+		the leaves holding those pixels in retrace_order.  Only surfaces seen directly are found;
+		shadows and reflections of the objects elsewhere are not.  Works with or without
+		reproject.  Returns the number of leaves.  No pass may be running. */
+	int discardSeen(const std::vector<G3D::AABox>& boxes);
+
+	/** Starts a pass tracing the untraced pixels of retrace_order, leaving every other leaf as it
+		is; nothing is reprojected and no other leaf's center is traced */
+	void retraceSeen();
+
+	/** Records that a leaf has been published since the last updateImage().  Thread safe. */
+	void markDirty(int node);
+
+	/** Resolves the leaves published since the last call into image and returns the rectangles
+		that changed, as runs of dirty leaves along each row of tiles.  Safe while a pass is
+		running, but only call from one thread. */
+	void updateImage(std::vector<G3D::Rect2D>& rects);
+
+	/** Makes the next updateImage() resolve the whole image, for a new image or display */
+	void markAllDirty();
+
+	/** Lays framebuffer tiles out on their own cache lines; see Framebuffer.  No pass may be running. */
+	void setAlignTiles(bool alignTiles);
+
+	/** Scratch storage for the shading done by a pool worker */
+	ShadingArena& shadingArena(int worker);
+
+	/** Rays traced by all workers since the last resetRayCounts().  Only call between passes. */
+	void rayCounts(long long& primary, long long& shadow, long long& secondary) const;
+	void resetRayCounts();
+
+	/** BVH nodes the packets of primary and secondary rays were tested against since the last
+		resetRayCounts(), for nodes per ray.  Secondary rays are only traced as packets with wavefront. */
+	void nodeVisits(long long& primary, long long& secondary) const;
+
+private:
+	/** Added to a leaf's mean luminance before dividing by it, so noise in black regions does not look infinite */
+	static const float			ERROR_BIAS;
+	/** refine() traces at least this many leaves per pass, or 1/REFINE_FRACTION of them */
+	static const int			REFINE_MIN_LEAVES = 64;
+	static const int			REFINE_FRACTION = 8;
+	/** Leaves traced together by a wavefront task */
+	static const int			WAVEFRONT_LEAVES = 16;
+
+	/** One per pool worker */
+	std::vector<ShadingArena*>	m_arenas;
+	std::vector<std::pair<float, int> >	m_leafErrors;
+	float						m_maxError;
+
+	/** Per pixel, where its center ray hit in this frame and the last; a zero normal means unknown or sky */
+	std::vector<G3D::Point3>	m_hitPositions;
+	std::vector<G3D::Vector3>	m_hitNormals;
+	std::vector<G3D::Point3>	m_historyPositions;
+	std::vector<G3D::Vector3>	m_historyNormals;
+	/** Per pixel, the nearest history splatted into it; see reprojectHistory() */
+	std::atomic<unsigned long long>	*m_depthKeys;
+	/** Whether the hit buffers describe the current image */
+	bool						m_hasHistory;
+	std::vector<int>			m_reorder;
+	/** Per leaf, whether discardSeen() dropped any of its pixels */
+	std::vector<unsigned char>	m_seenLeaves;
+
+	/** The leaves of the pass submitted by submitWaves(): (*m_waveOrder)[m_waveBegin, m_waveEnd),
+		or every leaf when m_waveOrder is NULL */
+	const std::vector<int>		*m_waveOrder;
+	int							m_waveBegin;
+	int							m_waveEnd;
+	TraceMode					m_waveMode;
+	bool						m_waveAppend;
+
+	/** One flag per leaf, set by markDirty() */
+	std::atomic<unsigned char>	*m_dirtyLeaves;
+	bool						m_allDirty;
+
+	void resizeBuffers();
+
+	/** Publishes every leaf and marks the image dirty */
+	void publishAll();
+
+	/** Warps the last frame's hits and published colors into the pixels for the current
+		camera, seeds the colors of the fully covered leaves and moves the other leaves to the
+		front of render_order.  Returns the number of leaves with holes. */
+	int reprojectHistory();
+
+	/** Adds count samples of radiance to the leaf's running luminance statistics */
+	static void addLeafSample(QuadTree::Node& leaf, const G3D::Radiance3& radiance, int count = 1);
+
+	/** Starts a pass tracing the leaves of order[begin, end) in wavefront tasks, appending them
+		to tmp_render_order if append is set.  A NULL order means every leaf. */
+	void submitWaves(const char *name, const std::vector<int> *order, int begin, int end, TraceMode mode, bool append);
+
+	/** Appends the primary rays of a leaf to arena.paths and resets what mode starts over */
+	void startSamples(int node, TraceMode mode, ShadingArena& arena);
+
+	/** Traces arena.paths depth first, a packet of primary rays at a time */
+	void traceDepthFirst(ShadingArena& arena);
+
+	/** Traces arena.paths breadth first, a bounce at a time */
+	void traceBreadthFirst(ShadingArena& arena);
+
+	/** Sorts arena.paths by direction octant and origin; see reorderRays */
+	void reorderPaths(ShadingArena& arena);
+
+	/** Light arriving directly from the lights, reflected from surfel back along ray; see directLight() */
+	G3D::Radiance3 directIllumination(const G3D::Ray& ray, const G3D::Surfel* surfel, const G3D::Color3& weight, ShadingArena& arena);
+
+	/** Light reflected from surfel back along ray, times scale, if nothing blocks it; one shadow
+		ray.  With a queued sample, the ray is queued carrying weight times that and zero is returned. */
+	G3D::Radiance3 directLight(const G3D::Light& light, const G3D::Ray& ray, const G3D::Surfel* surfel, float scale, const G3D::Color3& weight, ShadingArena& arena);
+};
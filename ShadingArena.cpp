@@ -0,0 +1,63 @@
+#include "ShadingArena.h"
+
+
+ShadingArena::ShadingArena(void) :
+	primaryRays(0),
+	shadowRays(0),
+	secondaryRays(0),
+	primaryNodeVisits(0),
+	secondaryNodeVisits(0),
+	m_surfelsUsed(0),
+	m_impulsesUsed(0),
+	m_rngState(0)
+{
+}
+
+ShadingArena::~ShadingArena(void)
+{
+	for(int i = 0; i < this->m_surfels.size(); i++){
+		delete this->m_surfels[i];
+	}
+	for(int i = 0; i < this->m_impulses.size(); i++){
+		delete this->m_impulses[i];
+	}
+}
+
+void ShadingArena::reset() {
+	this->m_surfelsUsed = 0;
+	this->m_impulsesUsed = 0;
+}
+
+G3D::UniversalSurfel& ShadingArena::allocateSurfel() {
+	if(this->m_surfelsUsed == this->m_surfels.size()){
+		this->m_surfels.push_back(new G3D::UniversalSurfel());
+	}
+	return *this->m_surfels[this->m_surfelsUsed++];
+}
+
+G3D::Surfel::ImpulseArray& ShadingArena::allocateImpulses() {
+	if(this->m_impulsesUsed == this->m_impulses.size()){
+		this->m_impulses.push_back(new G3D::Surfel::ImpulseArray());
+	}
+	G3D::Surfel::ImpulseArray& impulses = *this->m_impulses[this->m_impulsesUsed++];
+	// Keep the capacity so refilling it does not allocate
+	impulses.clear(false);
+	return impulses;
+}
+
+int ShadingArena::capacity() const {
+	return this->m_surfels.size() + this->m_impulses.size();
+}
+
+void ShadingArena::seed(unsigned int seed) {
+	this->m_rngState = seed;
+}
+
+float ShadingArena::random() {
+	// PCG: a linear congruential step, output through a permutation of its own bits
+	unsigned int state = this->m_rngState;
+	this->m_rngState = state * 747796405u + 2891336453u;
+	unsigned int word = ((state >> ((state >> 28u) + 4u)) ^ state) * 277803737u;
+	word = (word >> 22u) ^ word;
+	return (word >> 8) * (1.0f / 16777216.0f);
+}
@@ -0,0 +1,91 @@
+#pragma once
+#include <GLG3D/Surfel.h>
+#include <G3D/Ray.h>
+#include <GLG3D/UniversalSurfel.h>
+
+#include <vector>
+#include <utility>
+
+#include "BVH.h"
+#include "ShadowQueue.h"
+
+/** A ray of a path still to be traced, and what its radiance is worth to its sample */
+struct PathSegment {
+	G3D::Ray		ray;
+	G3D::Color3		weight;
+	/** Index in ShadingArena::sampleRadiance */
+	int				sample;
+	/** Seeds ShadingArena::random() for shading the hit */
+	unsigned int	seed;
+	int				bounce;
+	/** The center ray of a pixel, whose hit is recorded for reprojection */
+	bool			center;
+};
+
+/**
+  Scratch storage for shading on one render thread.
+
+  Surfels and impulse arrays are handed out in order and all released at once
+  by reset(), which the render passes call at the start of every tile.  The
+  arena only allocates while it grows to the largest tile seen so far, so once
+  it is warm, tracing a tile does not touch the heap.
+ */
+class ShadingArena
+{
+public:
+	ShadingArena(void);
+	~ShadingArena(void);
+
+	/** Releases everything handed out since the last reset */
+	void reset();
+
+	G3D::UniversalSurfel& allocateSurfel();
+
+	/** An empty impulse array */
+	G3D::Surfel::ImpulseArray& allocateImpulses();
+
+	/** Surfels and impulse arrays owned, used or not */
+	int capacity() const;
+
+	/** Starts the stream of random numbers for one sample.  Seeding each sample from its
+		pixel and index makes renders repeatable whatever thread traces them. */
+	void seed(unsigned int seed);
+
+	/** The next random number of the stream, in [0, 1) */
+	float random();
+
+	/** Rays traced by the thread that owns this arena.  reset() leaves them alone. */
+	long long									primaryRays;
+	long long									shadowRays;
+	long long									secondaryRays;
+	/** BVH nodes tested by the packets of primary and of secondary rays; see RayPacket::nodesVisited */
+	long long									primaryNodeVisits;
+	long long									secondaryNodeVisits;
+
+	/** Shadow rays deferred by the shading of the tile being traced */
+	ShadowQueue									shadowQueue;
+	/** Radiance of each sample of the tiles being traced, and the index of its point */
+	std::vector<G3D::Radiance3>					sampleRadiance;
+	std::vector<int>							samplePoints;
+	/** The samples of the k-th tile being traced start at leafSamples[k] */
+	std::vector<int>							leafSamples;
+
+	/** The rays of the current and the next wave of a wavefront, and the hits of the current one */
+	std::vector<PathSegment>					paths;
+	std::vector<PathSegment>					nextPaths;
+	std::vector<BVH::Hit>						hits;
+	/** World::materialIndex() and index in paths of every hit, sorted so hits are shaded material by material */
+	std::vector<std::pair<int, int> >			shadingOrder;
+	/** Sort key and index in paths of every ray of a secondary wave; see Renderer::reorderRays */
+	std::vector<std::pair<unsigned long long, int> >	rayOrder;
+
+private:
+	std::vector<G3D::UniversalSurfel*>			m_surfels;
+	std::vector<G3D::Surfel::ImpulseArray*>		m_impulses;
+	int											m_surfelsUsed;
+	int											m_impulsesUsed;
+	unsigned int								m_rngState;
+
+	ShadingArena(const ShadingArena&);
+	ShadingArena& operator=(const ShadingArena&);
+};
@@ -0,0 +1,86 @@
+#include "ShadowQueue.h"
+#include "World.h"
+#include "RaySort.h"
+
+#include <algorithm>
+
+ShadowQueue::ShadowQueue(void) :
+	m_sample(-1)
+{
+}
+
+void ShadowQueue::setSample(int sample) {
+	this->m_sample = sample;
+}
+
+int ShadowQueue::sample() const {
+	return this->m_sample;
+}
+
+void ShadowQueue::push(const G3D::Vector3& origin, const G3D::Vector3& direction, float distance, const G3D::Radiance3& contribution) {
+	Record record;
+	record.origin = origin;
+	record.direction = direction;
+	record.distance = distance;
+	record.contribution = contribution;
+	record.sample = this->m_sample;
+	this->m_records.push_back(record);
+}
+
+int ShadowQueue::size() const {
+	return this->m_records.size();
+}
+
+int ShadowQueue::trace(const World& world, G3D::Radiance3 *radiance) {
+	const int count = this->m_records.size();
+	if(count == 0){
+		return 0;
+	}
+
+	G3D::Vector3 lo = this->m_records[0].origin;
+	G3D::Vector3 hi = lo;
+	for(int i = 1; i < count; i++){
+		lo = lo.min(this->m_records[i].origin);
+		hi = hi.max(this->m_records[i].origin);
+	}
+	G3D::Vector3 scale = quantizeScale(lo, hi);
+
+	// Octant first, since packets of rays with different signs cull boxes badly, then the
+	// direction to 6 bits per axis, then the origin to 10 bits per axis within the batch
+	this->m_order.resize(count);
+	for(int i = 0; i < count; i++){
+		const Record& record = this->m_records[i];
+		const G3D::Vector3& d = record.direction;
+		unsigned long long direction = morton3(quantize(d.x, -1.0f, 0.5f, 6), quantize(d.y, -1.0f, 0.5f, 6), quantize(d.z, -1.0f, 0.5f, 6));
+		unsigned long long origin = morton3(quantize(record.origin.x, lo.x, scale.x, 10), quantize(record.origin.y, lo.y, scale.y, 10),
+			quantize(record.origin.z, lo.z, scale.z, 10));
+		this->m_order[i] = std::make_pair(((unsigned long long)octant(d) << 48) | (direction << 30) | origin, i);
+	}
+	std::sort(this->m_order.begin(), this->m_order.end());
+
+	RayPacket packet;
+	bool occluded[RayPacket::SIZE];
+	for(int first = 0; first < count; first += RayPacket::SIZE){
+		packet.count = G3D::min(RayPacket::SIZE, count - first);
+		for(int lane = 0; lane < packet.count; lane++){
+			const Record& record = this->m_records[this->m_order[first + lane].second];
+			packet.ox[lane] = record.origin.x;
+			packet.oy[lane] = record.origin.y;
+			packet.oz[lane] = record.origin.z;
+			packet.dx[lane] = record.direction.x;
+			packet.dy[lane] = record.direction.y;
+			packet.dz[lane] = record.direction.z;
+			packet.tMax[lane] = record.distance;
+		}
+		world.occluded8(packet, occluded);
+		for(int lane = 0; lane < packet.count; lane++){
+			if(!occluded[lane]){
+				const Record& record = this->m_records[this->m_order[first + lane].second];
+				radiance[record.sample] += record.contribution;
+			}
+		}
+	}
+
+	this->m_records.clear();
+	return count;
+}
@@ -0,0 +1,51 @@
+#pragma once
+#include <G3D/Color3.h>
+#include <G3D/Vector3.h>
+
+#include <vector>
+#include <utility>
+
+class World;
+
+/**
+  Shadow rays deferred by shading on one thread, traced together.
+
+  Instead of tracing each shadow ray as soon as it is known, interleaved with
+  shading, shade() queues the ray with the radiance it carries if the light is
+  visible and the sample it belongs to.  trace() then sorts the queue by
+  direction and origin, so neighbouring rays head the same way from nearby
+  points, and traces it as packets with BVH::occluded8, which only looks for
+  any hit.  The radiance of every unblocked ray is added to its sample.
+ */
+class ShadowQueue
+{
+public:
+	ShadowQueue(void);
+
+	/** Queued rays are added to sample; a negative sample makes the caller trace its shadow rays itself */
+	void setSample(int sample);
+	int sample() const;
+
+	/** Queues a ray from origin along the unit direction for distance, carrying contribution to sample() */
+	void push(const G3D::Vector3& origin, const G3D::Vector3& direction, float distance, const G3D::Radiance3& contribution);
+
+	int size() const;
+
+	/** Traces every queued ray, adds the contribution of each unblocked one to radiance[its sample]
+		and empties the queue.  Returns the number of rays traced. */
+	int trace(const World& world, G3D::Radiance3 *radiance);
+
+private:
+	struct Record {
+		G3D::Vector3	origin;
+		G3D::Vector3	direction;
+		float			distance;
+		G3D::Radiance3	contribution;
+		int				sample;
+	};
+
+	std::vector<Record>									m_records;
+	/** Sort key and index of each record; kept between calls so tracing does not allocate */
+	std::vector<std::pair<unsigned long long, int> >	m_order;
+	int													m_sample;
+};
@@ -0,0 +1,98 @@
+#include "StreamingTexture.h"
+
+#include <G3D/ImageFormat.h>
+
+#include <string.h>
+
+
+StreamingTexture::StreamingTexture(void) :
+	m_next(0),
+	m_bytesUploaded(0)
+{
+	this->m_staging[0] = 0;
+	this->m_staging[1] = 0;
+}
+
+StreamingTexture::~StreamingTexture(void)
+{
+	this->releaseStaging();
+}
+
+void StreamingTexture::releaseStaging() {
+	if(this->m_staging[0] != 0){
+		glDeleteBuffers(2, this->m_staging);
+		this->m_staging[0] = 0;
+		this->m_staging[1] = 0;
+	}
+}
+
+void StreamingTexture::resize(int width, int height) {
+	this->m_texture = G3D::Texture::createEmpty("Source", width, height, G3D::ImageFormat::RGB32F(), G3D::Texture::DIM_2D, false);
+
+	this->releaseStaging();
+	glGenBuffers(2, this->m_staging);
+	for(int i = 0; i < 2; i++){
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, this->m_staging[i]);
+		glBufferData(GL_PIXEL_UNPACK_BUFFER, (GLsizeiptr)width * height * sizeof(G3D::Color3), NULL, GL_STREAM_DRAW);
+	}
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+	this->m_next = 0;
+}
+
+void StreamingTexture::upload(const G3D::Image3& image, const std::vector<G3D::Rect2D>& rects) {
+	this->m_bytesUploaded = 0;
+	if(rects.empty() || !this->m_texture){
+		return;
+	}
+
+	const int width = image.width();
+	const size_t capacity = (size_t)width * image.height() * sizeof(G3D::Color3);
+	GLuint staging = this->m_staging[this->m_next];
+	this->m_next ^= 1;
+
+	// Orphaning the buffer lets the driver hand out fresh memory if the copy that last used it is still pending
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, staging);
+	glBufferData(GL_PIXEL_UNPACK_BUFFER, capacity, NULL, GL_STREAM_DRAW);
+	char *mapped = (char*)glMapBuffer(GL_PIXEL_UNPACK_BUFFER, GL_WRITE_ONLY);
+	if(mapped == NULL){
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+		return;
+	}
+
+	// Pack the rectangles one after another, each row by row
+	const G3D::Color3 *pixels = image.getCArray();
+	std::vector<size_t>& offsets = this->m_offsets;
+	offsets.resize(rects.size());
+	size_t offset = 0;
+	for(int r = 0; r < rects.size(); r++){
+		const G3D::Rect2D& rect = rects[r];
+		int x0 = (int)rect.x0();
+		int rowBytes = (int)rect.width() * sizeof(G3D::Color3);
+		offsets[r] = offset;
+		for(int y = (int)rect.y0(); y < (int)rect.y1(); y++){
+			memcpy(mapped + offset, pixels + y * width + x0, rowBytes);
+			offset += rowBytes;
+		}
+	}
+	glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+
+	glBindTexture(GL_TEXTURE_2D, this->m_texture->openGLID());
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	for(int r = 0; r < rects.size(); r++){
+		const G3D::Rect2D& rect = rects[r];
+		glTexSubImage2D(GL_TEXTURE_2D, 0, (GLint)rect.x0(), (GLint)rect.y0(), (GLsizei)rect.width(), (GLsizei)rect.height(),
+			GL_RGB, GL_FLOAT, (const void*)offsets[r]);
+	}
+	glBindTexture(GL_TEXTURE_2D, 0);
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+	this->m_bytesUploaded = offset;
+}
+
+const shared_ptr<G3D::Texture>& StreamingTexture::texture() const {
+	return this->m_texture;
+}
+
+size_t StreamingTexture::bytesUploaded() const {
+	return this->m_bytesUploaded;
+}
@@ -0,0 +1,49 @@
+#pragma once
+#include <G3D/Image3.h>
+#include <G3D/Rect2D.h>
+
+#include <GLG3D/Texture.h>
+#include <GLG3D/glheaders.h>
+
+#include <vector>
+
+/**
+  A texture that mirrors an Image3 the render threads are writing, updated
+  one dirty rectangle at a time instead of recreated from the whole image.
+
+  Uploads go through two pixel buffer objects used alternately: a frame packs
+  its rectangles into one while the driver may still be copying the other
+  into the texture, so neither the display nor the workers, who only write the
+  Image3, wait for a transfer.  Only call from the thread that owns the
+  OpenGL context.
+ */
+class StreamingTexture
+{
+public:
+	StreamingTexture(void);
+	~StreamingTexture(void);
+
+	/** Recreates the texture and staging buffers for a new size; the texture starts out undefined */
+	void resize(int width, int height);
+
+	/** Copies the rectangles of image, which must have the size of the texture, to the texture */
+	void upload(const G3D::Image3& image, const std::vector<G3D::Rect2D>& rects);
+
+	const shared_ptr<G3D::Texture>& texture() const;
+
+	/** Bytes copied by the last upload() */
+	size_t bytesUploaded() const;
+
+private:
+	shared_ptr<G3D::Texture>	m_texture;
+	GLuint						m_staging[2];
+	int							m_next;
+	size_t						m_bytesUploaded;
+	/** Where each rectangle of an upload starts in the staging buffer, kept to avoid an allocation per frame */
+	std::vector<size_t>			m_offsets;
+
+	void releaseStaging();
+
+	StreamingTexture(const StreamingTexture&);
+	StreamingTexture& operator=(const StreamingTexture&);
+};
@@ -0,0 +1,242 @@
+#include "WorkerPool.h"
+
+#include <G3D/System.h>
+#include <G3D/debugPrintf.h>
+
+
+WorkerPool::WorkerPool(int numWorkers) :
+	m_task(NULL),
+	m_context(NULL),
+	m_passStart(0.0),
+	m_passEnd(0.0),
+	m_firstItemEnd(0.0),
+	m_passGeneration(0),
+	m_recordStats(true),
+	m_generation(0),
+	m_pending(0),
+	m_completed(0),
+	m_pass(0),
+	m_shutdown(false)
+{
+	if(numWorkers <= 0) {
+		numWorkers = (int)std::thread::hardware_concurrency();
+	}
+	if(numWorkers <= 0) {
+		numWorkers = 4;
+	}
+
+	for(int i = 0; i < numWorkers; i++){
+		Worker *worker = new Worker();
+		worker->busyTime = 0.0;
+		worker->processed = 0;
+		worker->stolen = 0;
+		this->m_workers.push_back(worker);
+	}
+
+	// Start the threads only once every worker exists, since they steal from each other
+	for(int i = 0; i < numWorkers; i++){
+		this->m_workers[i]->thread = std::thread(&WorkerPool::workerMain, this, i);
+	}
+}
+
+WorkerPool::~WorkerPool(void)
+{
+	this->waitForCompletion();
+	{
+		std::lock_guard<std::mutex> guard(this->m_wakeLock);
+		this->m_shutdown = true;
+	}
+	this->m_wake.notify_all();
+
+	// A worker may still be trying to steal from the others, so none is deleted before all have stopped
+	for(int i = 0; i < this->m_workers.size(); i++){
+		this->m_workers[i]->thread.join();
+	}
+	for(int i = 0; i < this->m_workers.size(); i++){
+		delete this->m_workers[i];
+	}
+}
+
+int WorkerPool::size() const {
+	return this->m_workers.size();
+}
+
+bool WorkerPool::busy() const {
+	return this->m_pending > 0;
+}
+
+void WorkerPool::submit(const std::string& name, TaskFunction task, void *context, int begin, int end) {
+	debugAssertM(!this->busy(), "WorkerPool::submit called while a pass is running");
+
+	int count = end - begin;
+	for(int i = 0; i < this->m_workers.size(); i++){
+		Worker *worker = this->m_workers[i];
+		worker->busyTime = 0.0;
+		worker->processed = 0;
+		worker->stolen = 0;
+	}
+
+	if(count <= 0){
+		std::lock_guard<std::mutex> guard(this->m_wakeLock);
+		this->m_passName = name;
+		this->m_passStart = this->m_passEnd = G3D::System::time();
+		return;
+	}
+
+	// The task is published before any item, so a worker that pops an item
+	// (under the deque lock) always sees the task belonging to it
+	{
+		std::lock_guard<std::mutex> guard(this->m_wakeLock);
+		this->m_task = task;
+		this->m_context = context;
+		this->m_passName = name;
+		this->m_passStart = G3D::System::time();
+		this->m_firstItemEnd = 0.0;
+		this->m_passGeneration = this->m_generation;
+		this->m_recordStats = true;
+		this->m_completed = 0;
+		this->m_pending = count;
+	}
+
+	for(int i = begin; i < end; i++){
+		Worker *worker = this->m_workers[(i - begin) % this->m_workers.size()];
+		std::lock_guard<std::mutex> guard(worker->lock);
+		worker->items.push_back(i);
+	}
+
+	{
+		std::lock_guard<std::mutex> guard(this->m_wakeLock);
+		this->m_pass++;
+	}
+	this->m_wake.notify_all();
+}
+
+void WorkerPool::run(TaskFunction task, void *context, int count) {
+	debugAssertM(!this->busy(), "WorkerPool::run called while a pass is running");
+	if(count <= 0){
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> guard(this->m_wakeLock);
+		this->m_task = task;
+		this->m_context = context;
+		this->m_passGeneration = this->m_generation;
+		this->m_recordStats = false;
+		this->m_pending = count;
+	}
+
+	for(int i = 0; i < count; i++){
+		Worker *worker = this->m_workers[i % this->m_workers.size()];
+		std::lock_guard<std::mutex> guard(worker->lock);
+		worker->items.push_back(i);
+	}
+
+	{
+		std::lock_guard<std::mutex> guard(this->m_wakeLock);
+		this->m_pass++;
+	}
+	this->m_wake.notify_all();
+	this->waitForCompletion();
+}
+
+void WorkerPool::waitForCompletion() {
+	std::unique_lock<std::mutex> guard(this->m_wakeLock);
+	while(this->m_pending > 0){
+		this->m_done.wait(guard);
+	}
+}
+
+void WorkerPool::cancel() {
+	this->m_generation++;
+}
+
+unsigned int WorkerPool::generation() const {
+	return this->m_generation;
+}
+
+double WorkerPool::firstItemTime() const {
+	std::lock_guard<std::mutex> guard(this->m_wakeLock);
+	return this->m_firstItemEnd;
+}
+
+bool WorkerPool::popLocal(int index, int& item) {
+	Worker *worker = this->m_workers[index];
+	std::lock_guard<std::mutex> guard(worker->lock);
+	if(worker->items.empty()){
+		return false;
+	}
+	item = worker->items.front();
+	worker->items.pop_front();
+	return true;
+}
+
+bool WorkerPool::steal(int index, int& item) {
+	for(int i = 1; i < this->m_workers.size(); i++){
+		Worker *victim = this->m_workers[(index + i) % this->m_workers.size()];
+		std::lock_guard<std::mutex> guard(victim->lock);
+		if(!victim->items.empty()){
+			item = victim->items.back();
+			victim->items.pop_back();
+			this->m_workers[index]->stolen++;
+			return true;
+		}
+	}
+	return false;
+}
+
+void WorkerPool::workerMain(int index) {
+	Worker *self = this->m_workers[index];
+	unsigned int seenPass = 0;
+
+	while(true) {
+		{
+			std::unique_lock<std::mutex> guard(this->m_wakeLock);
+			while(!this->m_shutdown && this->m_pass == seenPass){
+				this->m_wake.wait(guard);
+			}
+			if(this->m_shutdown){
+				return;
+			}
+			seenPass = this->m_pass;
+		}
+
+		int item;
+		while(popLocal(index, item) || steal(index, item)) {
+			// Items of a cancelled pass are still popped, just not run
+			if(this->m_generation == this->m_passGeneration){
+				double start = G3D::System::time();
+				this->m_task(this->m_context, item, index);
+				double end = G3D::System::time();
+				if(this->m_recordStats){
+					self->busyTime += end - start;
+					self->processed++;
+
+					if(this->m_completed++ == 0){
+						std::lock_guard<std::mutex> guard(this->m_wakeLock);
+						this->m_firstItemEnd = end;
+					}
+				}
+			}
+
+			if(--this->m_pending == 0){
+				std::lock_guard<std::mutex> guard(this->m_wakeLock);
+				if(this->m_recordStats){
+					this->m_passEnd = G3D::System::time();
+				}
+				this->m_done.notify_all();
+			}
+		}
+	}
+}
+
+void WorkerPool::printStats() const {
+	std::lock_guard<std::mutex> guard(this->m_wakeLock);
+	double wall = this->m_passEnd - this->m_passStart;
+	G3D::debugPrintf("%s: %f s wall on %d workers\n", this->m_passName.c_str(), wall, (int)this->m_workers.size());
+	for(int i = 0; i < this->m_workers.size(); i++){
+		const Worker *worker = this->m_workers[i];
+		G3D::debugPrintf("  worker %2d: busy %f s (%3.0f%%), %d items, %d stolen\n", i, worker->busyTime,
+			wall > 0.0 ? 100.0 * worker->busyTime / wall : 0.0, worker->processed, worker->stolen);
+	}
+}
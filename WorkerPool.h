@@ -0,0 +1,128 @@
+#pragma once
+#include <vector>
+#include <deque>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+
+/**
+  Persistent pool of render threads.
+
+  A pass is a range of integer work items (usually indices into
+  Renderer::render_order).  The items are dealt round-robin into one deque per
+  worker, so each worker sees them in priority order.  A worker pops from the
+  front of its own deque and, once that is empty, steals from the back of the
+  other workers' deques.
+
+  Passes are stamped with the pool's generation.  cancel() only bumps the
+  generation; workers compare it between items and drop the rest of a stale
+  pass instead of running it, so a new pass can start once the items already
+  in flight (at most one per worker) have finished.
+ */
+class WorkerPool
+{
+public:
+	typedef void (*TaskFunction)(void *context, int item, int worker);
+
+	/** Zero workers means one per hardware thread. */
+	WorkerPool(int numWorkers = 0);
+	~WorkerPool(void);
+
+	/** Queues items [begin, end) and returns immediately.  The previous pass must be finished. */
+	void submit(const std::string& name, TaskFunction task, void *context, int begin, int end);
+
+	/** True while items of the current pass are still queued or running. */
+	bool busy() const;
+
+	void waitForCompletion();
+
+	/** Abandons the current pass.  Does not block; call waitForCompletion() before reusing shared state. */
+	void cancel();
+
+	unsigned int generation() const;
+
+	/** Time at which the first item of the last pass finished, or zero if none has. */
+	double firstItemTime() const;
+
+	int size() const;
+
+	/** Prints the wall time of the last pass and the busy time of every worker. */
+	void printStats() const;
+
+	/** Splits [begin, end) into contiguous chunks of at least minChunk items, calls
+		function(chunkBegin, chunkEnd) for each on the workers and returns once every chunk is
+		done: ::parallelFor() without starting threads, for the bulk steps between passes.  The
+		previous pass must be finished.  Does not count as a pass, so the stats and
+		firstItemTime() of the last one are kept. */
+	template<class Function>
+	void parallelFor(int begin, int end, const Function& function, int minChunk = 1) {
+		int count = end - begin;
+		int chunks = count / ((minChunk < 1) ? 1 : minChunk);
+		if(chunks > this->size()){
+			chunks = this->size();
+		}
+		if(chunks <= 1){
+			if(count > 0){
+				function(begin, end);
+			}
+			return;
+		}
+		RangeContext<Function> context = { &function, begin, count, chunks };
+		this->run(&RangeContext<Function>::task, &context, chunks);
+	}
+
+	/** Runs task on items [0, count) and waits for them, without recording stats.  The previous pass must be finished. */
+	void run(TaskFunction task, void *context, int count);
+
+private:
+	template<class Function>
+	struct RangeContext {
+		const Function	*function;
+		int				begin;
+		int				count;
+		int				chunks;
+
+		static void task(void *context, int chunk, int /*worker*/) {
+			const RangeContext *range = (const RangeContext*)context;
+			(*range->function)(range->begin + (int)((long long)range->count * chunk / range->chunks),
+				range->begin + (int)((long long)range->count * (chunk + 1) / range->chunks));
+		}
+	};
+
+	struct Worker {
+		std::thread			thread;
+		std::mutex			lock;
+		std::deque<int>		items;
+		double				busyTime;
+		int					processed;
+		int					stolen;
+	};
+
+	std::vector<Worker*>	m_workers;
+
+	TaskFunction			m_task;
+	void					*m_context;
+	std::string				m_passName;
+	double					m_passStart;
+	double					m_passEnd;
+	double					m_firstItemEnd;
+	unsigned int			m_passGeneration;
+	/** False while run() is using the workers */
+	bool					m_recordStats;
+
+	std::atomic<unsigned int>	m_generation;
+	std::atomic<int>		m_pending;
+	std::atomic<int>		m_completed;
+	unsigned int			m_pass;
+	bool					m_shutdown;
+
+	mutable std::mutex		m_wakeLock;
+	std::condition_variable	m_wake;
+	std::condition_variable	m_done;
+
+	void workerMain(int index);
+	bool popLocal(int index, int& item);
+	bool steal(int index, int& item);
+};
@@ -4,123 +4,399 @@
 #include <G3D/CoordinateFrame.h>
 #include <G3D/Stopwatch.h>
 #include <G3D/Array.h>
+#include <G3D/Table.h>
+#include <G3D/Random.h>
+#include <G3D/System.h>
+#include <G3D/format.h>
+#include <G3D/debugPrintf.h>
+#include <G3D/FileSystem.h>
 
 #include <GLG3D/Light.h>
 #include <GLG3D/ArticulatedModel.h>
 
 #include "World.h"
+#include "ParallelFor.h"
 
-World::World() : m_mode(TRACE) {
+#include <map>
+#include <algorithm>
+#include <thread>
+#include <cstdio>
+#include <cmath>
+#include <sys/stat.h>
+
+namespace {
+
+typedef std::map<std::string, shared_ptr<G3D::ArticulatedModel> > ModelTable;
+
+const unsigned long long FNV_OFFSET = 14695981039346656037ULL;
+const unsigned long long FNV_PRIME = 1099511628211ULL;
+/** hashPositions() hashes this many slices of the positions on their own, so the key does not
+    depend on the thread count */
+const int HASH_SLICES = 64;
+
+/** 64-bit FNV-1a of size bytes, continuing from hash */
+unsigned long long hashBytes(const void* data, size_t size, unsigned long long hash = FNV_OFFSET) {
+    const unsigned char* bytes = (const unsigned char*)data;
+    for (size_t i = 0; i < size; ++i) {
+        hash = (hash ^ bytes[i]) * FNV_PRIME;
+    }
+    return hash;
+}
+
+/** Cache key of a model's BVH from what it is loaded from: its specification and the path, size
+    and modification time of its file, so the cache is checked without touching the geometry */
+unsigned long long sourceKey(const G3D::Any& specification, const std::string& file) {
+    const std::string text = specification.unparse();
+    unsigned long long hash = hashBytes(text.data(), text.size());
+    hash = hashBytes(file.data(), file.size(), hash);
+    struct stat info;
+    if (stat(file.c_str(), &info) == 0) {
+        long long size = (long long)info.st_size;
+        long long modified = (long long)info.st_mtime;
+        hash = hashBytes(&size, sizeof(size), hash);
+        hash = hashBytes(&modified, sizeof(modified), hash);
+    }
+    return hash;
+}
+
+/** Loads the models of a scene file's models table one at a time, reporting how long each took,
+    and records each one's cache key.  Loading is serial: G3D parses a model and uploads its
+    textures in the same call, and only the thread owning the OpenGL context may upload. */
+void loadModels(const G3D::Any& models, ModelTable& loaded, std::map<const G3D::ArticulatedModel*, unsigned long long>& keys) {
+    std::vector<std::string> names;
+    std::vector<G3D::Any> specifications;
+    const G3D::Table<std::string, G3D::Any>& table = models.table();
+    for (G3D::Table<std::string, G3D::Any>::Iterator it = table.begin(); it.isValid(); ++it) {
+        names.push_back(it->key);
+        specifications.push_back(it->value);
+    }
+    const int count = (int)names.size();
+
+    for (int i = 0; i < count; ++i) {
+        // A model inside a zip file is keyed by the archive
+        std::string file = G3D::System::findDataFile(specifications[i]["filename"].string(), false);
+        std::string zipFile;
+        if (G3D::FileSystem::inZipfile(file, zipFile)) {
+            file = zipFile;
+        }
+
+        double start = G3D::System::time();
+        loaded[names[i]] = G3D::ArticulatedModel::create(G3D::ArticulatedModel::Specification(specifications[i]), names[i]);
+        keys[loaded[names[i]].get()] = sourceKey(specifications[i], file);
+        G3D::debugPrintf("  %-16s loaded in %f s\n", names[i].c_str(), G3D::System::time() - start);
+    }
+}
+
+const shared_ptr<G3D::ArticulatedModel>& findModel(const ModelTable& models, const G3D::Any& name) {
+    ModelTable::const_iterator it = models.find(name.string());
+    name.verify(it != models.end(), "No model of that name in the scene's models table");
+    return it->second;
+}
+
+/** Cache key of the triangles' positions, which is all the BVH depends on, for meshes not loaded
+    from a scene file: FNV-1a over 32-bit words of each of HASH_SLICES slices in parallel, then
+    over the slices' hashes */
+unsigned long long hashPositions(const std::vector<G3D::Vector3>& positions) {
+    const unsigned int* words = (const unsigned int*)positions.data();
+    const size_t count = positions.size() * sizeof(G3D::Vector3) / sizeof(unsigned int);
+    unsigned long long slices[HASH_SLICES];
+    parallelFor(0, HASH_SLICES, [&](int begin, int end) {
+        for (int s = begin; s < end; ++s) {
+            unsigned long long hash = FNV_OFFSET;
+            for (size_t i = count * s / HASH_SLICES; i < count * (s + 1) / HASH_SLICES; ++i) {
+                hash = (hash ^ words[i]) * FNV_PRIME;
+            }
+            slices[s] = hash;
+        }
+    });
+    return hashBytes(slices, sizeof(slices));
+}
+
+/** Appends a PointLight or the lights of a LightGrid to lights */
+void addLights(const G3D::Any& light, G3D::Array<shared_ptr<G3D::Light> >& lights) {
+    if (light.name() == "PointLight") {
+        lights.append(G3D::Light::point(light["name"].string(), G3D::Vector3(light["position"]), G3D::Color3(light["power"])));
+        return;
+    }
+
+    // size^2 lights of random colors, each jittered within its cell of the grid so no
+    // two rows line up, and raised by up to jitterHeight
+    light.verifyName("LightGrid");
+    const int size = (int)light["size"].number();
+    const float spacing = (float)light["spacing"].number();
+    const G3D::Vector3 offset(light["offset"]);
+    const float jitterHeight = (float)light["jitterHeight"].number();
+    const float power = (float)light["power"].number();
+    G3D::Random rng((int)light["seed"].number(), false);
+    for (int i = 0; i < size; ++i) {
+        for (int j = 0; j < size; ++j) {
+            G3D::Vector3 position((i - size / 2 + rng.uniform()) * spacing + offset.x, offset.y + jitterHeight * rng.uniform(),
+                (j - size / 2 + rng.uniform()) * spacing + offset.z);
+            G3D::Color3 color(0.2f + rng.uniform(), 0.2f + rng.uniform(), 0.2f + rng.uniform());
+            lights.append(G3D::Light::point(G3D::format("Light%d", lights.size() + 1), position, color * power));
+        }
+    }
+}
+
+}
+
+const char* const World::CACHE_DIRECTORY = "bvhcache";
+const char* const World::DEFAULT_SCENE = "scene/demo.Any";
+
+World::World(const std::string& sceneFile, bool useCache, bool compact) :
+    m_surfaceMesh(-1), m_triangleCount(0), m_accelerationSeconds(0.0), m_mode(TRACE), m_useCache(useCache), m_compact(compact) {
     begin();
 
-    lightArray.append(G3D::Light::point("Light1", G3D::Vector3(0, 10, 0), G3D::Color3::white() * 1200));
-    lightArray.append(G3D::Light::point("Light2", G3D::Vector3(22.6f, 2.9f,  6.6f), G3D::Color3::fromARGB(0xffe5bd) * 1000));
-
-    ambient = G3D::Radiance3::fromARGB(0x304855) * 0.3f;
-	
-    G3D::Any teapot = G3D::PARSE_ANY
-        ( G3D::ArticulatedModel::Specification {
-            filename = "teapot/teapot.obj";
-            scale = 0.01;
-            stripMaterials = true;
-            preprocess = 
-                ( setMaterial(all(), 
-                             UniversalMaterial::Specification {
-                                 specular = Color3(0.2f);
-                                 shininess = mirror();
-                                 lambertian = Color3(0.7f, 0.5f, 0.1f);
-                             });
-                 );
-         } );
-
-    insert(G3D::ArticulatedModel::create(teapot), G3D::CFrame::fromXYZYPRDegrees(19.4f, -0.2f, 0.94f, 70));
-    G3D::Any sphereOutside = G3D::PARSE_ANY 
-        ( ArticulatedModel::Specification {
-            filename = "sphere.ifs";
-            scale = 0.3;
-            preprocess =
-                ( setTwoSided(all(),  true);
-                    setMaterial(all(), 
-                              UniversalMaterial::Specification {
-                                  specular = Color3(0.1f);
-                                  shininess = mirror();
-                                  lambertian = Color3(0.0f);
-                                  etaTransmit = 1.3f;
-                                  etaReflect = 1.0f;
-                                  transmissive = Color3(0.2f, 0.5f, 0.7f);
-                              });
-                  );
-          });
-
-    G3D::Any sphereInside = G3D::PARSE_ANY 
-        ( G3D::ArticulatedModel::Specification {
-            filename = "sphere.ifs";
-            scale = -0.3;
-            preprocess =
-                ( setTwoSided(all(), true);
-                    setMaterial(all(),
-                              UniversalMaterial::Specification {
-                                  specular = Color3(0.1f);
-                                  shininess = mirror();
-                                  lambertian = Color3(0.0f);
-                                  etaReflect = 1.3f;
-                                  etaTransmit = 1.0f;
-                                  transmissive = Color3(1.0f);
-                              });
-                  );
-          });
-	
-    insert(G3D::ArticulatedModel::create(sphereOutside), G3D::CFrame::fromXYZYPRDegrees(19.7f, 0.2f, -1.1f, 70));
-    insert(G3D::ArticulatedModel::create(sphereInside),  G3D::CFrame::fromXYZYPRDegrees(19.7f, 0.2f, -1.1f, 70));
-	
-    G3D::Any sponza = G3D::PARSE_ANY
-        ( ArticulatedModel::Specification {
-            filename = "dabrovic_sponza/sponza.zip/sponza.obj";
-          } );
     G3D::Stopwatch timer;
-    insert(G3D::ArticulatedModel::create(sponza), G3D::Vector3(8.2f, -6, 0));
-    timer.after("Sponza load");
+    G3D::Any scene;
+    scene.load(sceneFile);
+    scene.verifyName("World");
+    name = scene["name"].string();
+    cameraFrame = scene.containsKey("camera") ? G3D::CFrame(scene["camera"]) : G3D::CFrame();
+    ambient = scene.containsKey("ambient") ? G3D::Color3(scene["ambient"]) : G3D::Color3::black();
+
+    if (scene.containsKey("lights")) {
+        const G3D::Any& lights = scene["lights"];
+        for (int i = 0; i < lights.size(); ++i) {
+            addLights(lights[i], lightArray);
+        }
+    }
+
+    ModelTable models;
+    G3D::debugPrintf("Loading %s\n", sceneFile.c_str());
+    loadModels(scene["models"], models, m_sourceKeys);
+    timer.after("Model loading");
+
+    // Posing one model many times shares its materials
+    const G3D::Any& entities = scene["entities"];
+    for (int e = 0; e < entities.size(); ++e) {
+        const G3D::Any& entity = entities[e];
+        if (entity.name() == "Instance") {
+            const G3D::CFrame frame(entity["frame"]);
+            insert(findModel(models, entity["model"]), frame);
+            if (entity.containsKey("spin")) {
+                Spin spin;
+                spin.instance = instanceCount() - 1;
+                spin.frame = frame;
+                spin.degreesPerSecond = (float)entity["spin"].number();
+                spins.push_back(spin);
+            }
+            continue;
+        }
+
+        // size^2 copies of each model around the origin, each turned yawStep degrees from the last
+        entity.verifyName("Grid");
+        const G3D::Any& gridModels = entity["models"];
+        const int size = (int)entity["size"].number();
+        const float spacing = (float)entity["spacing"].number();
+        const float yawStep = entity.containsKey("yawStep") ? (float)entity["yawStep"].number() : 0.0f;
+        for (int i = 0; i < size; ++i) {
+            for (int j = 0; j < size; ++j) {
+                G3D::CFrame frame = G3D::CFrame::fromXYZYPRDegrees((i - size / 2) * spacing, 0.0f, (j - size / 2) * spacing, yawStep * (i * size + j));
+                for (int m = 0; m < gridModels.size(); ++m) {
+                    insert(findModel(models, gridModels[m]), frame);
+                }
+            }
+        }
+    }
+    timer.after("Posing");
+
     end();
 }
 
 
+World::~World() {
+    for (int m = 0; m < (int)m_meshes.size(); ++m) {
+        delete m_meshes[m];
+    }
+}
+
 void World::begin() {
     debugAssert(m_mode == TRACE);
-    m_surfaceArray.clear();
-    m_triArray.clear();
+    for (int m = 0; m < (int)m_meshes.size(); ++m) {
+        delete m_meshes[m];
+    }
+    m_meshes.clear();
+    m_modelMeshes.clear();
+    m_sourceKeys.clear();
+    m_surfaceMesh = -1;
+    m_instances.clear();
+    m_instanceStart.clear();
+    m_triangleCount = 0;
     m_mode = INSERT;
 }
 
 
+int World::addMesh() {
+    Mesh* mesh = new Mesh();
+    mesh->bvh.setCompact(m_compact);
+    m_meshes.push_back(mesh);
+    return (int)m_meshes.size() - 1;
+}
+
 void World::insert(const shared_ptr<G3D::ArticulatedModel>& model, const G3D::CFrame& frame) {
-    G3D::Array<shared_ptr<G3D::Surface> > posed;
-    model->pose(posed, frame);
-    for (int i = 0; i < posed.size(); ++i) {
-        insert(posed[i]);
+    debugAssert(m_mode == INSERT);
+    std::map<const G3D::ArticulatedModel*, int>::iterator it = m_modelMeshes.find(model.get());
+    if (it == m_modelMeshes.end()) {
+        // Posed where it was modeled, so every instance can share its triangles
+        int mesh = addMesh();
+        m_meshes[mesh]->model = model;
+        model->pose(m_meshes[mesh]->surfaces, G3D::CFrame());
+        it = m_modelMeshes.insert(std::make_pair(model.get(), mesh)).first;
     }
+
+    Instance instance;
+    instance.mesh = it->second;
+    instance.frame = frame;
+    m_instances.push_back(instance);
 }
 
 void World::insert(const shared_ptr<G3D::Surface>& m) {
     debugAssert(m_mode == INSERT);
-    m_surfaceArray.append(m);
+    if (m_surfaceMesh < 0) {
+        m_surfaceMesh = addMesh();
+        Instance instance;
+        instance.mesh = m_surfaceMesh;
+        m_instances.push_back(instance);
+    }
+    m_meshes[m_surfaceMesh]->surfaces.append(m);
 }
 
 
 void World::end() {
-    G3D::Surface::getTris(m_surfaceArray, m_cpuVertexArray, m_triArray);
-    for (int i = 0; i < m_triArray.size(); ++i) {
-        m_triArray[i].material()->setStorage(G3D::MOVE_TO_CPU);
-    }
-
     debugAssert(m_mode == INSERT);
     m_mode = TRACE;
 
-    G3D::TriTree::Settings s;
-    s.algorithm = G3D::TriTree::MEAN_EXTENT;
     G3D::Stopwatch timer;
-    m_triTree.setContents(m_triArray, m_cpuVertexArray, s); 
-    timer.after("TriTree creation");
-    m_triArray.clear();
+
+    // Surface::getTris only appends to the arrays it is given, so each chunk of a mesh's
+    // surfaces can be extracted on its own thread into its own vertex array
+    const int threads = G3D::max(1, (int)std::thread::hardware_concurrency());
+    std::vector<std::pair<int, int> > chunks;
+    for (int m = 0; m < (int)m_meshes.size(); ++m) {
+        Mesh& mesh = *m_meshes[m];
+        int count = G3D::min(mesh.surfaces.size(), threads);
+        mesh.cpuVertexArrays.clear();
+        mesh.cpuVertexArrays.resize(count);
+        mesh.chunkStart.resize(count);
+        mesh.triArray.clear();
+        for (int c = 0; c < count; ++c) {
+            chunks.push_back(std::make_pair(m, c));
+        }
+    }
+    std::vector<G3D::Array<G3D::Tri> > chunkTris(chunks.size());
+    parallelFor(0, (int)chunks.size(), [&](int begin, int end) {
+        for (int k = begin; k < end; ++k) {
+            Mesh& mesh = *m_meshes[chunks[k].first];
+            int c = chunks[k].second;
+            int count = (int)mesh.cpuVertexArrays.size();
+            G3D::Array<shared_ptr<G3D::Surface> > surfaces;
+            for (int i = mesh.surfaces.size() * c / count; i < mesh.surfaces.size() * (c + 1) / count; ++i) {
+                surfaces.append(mesh.surfaces[i]);
+            }
+            G3D::Surface::getTris(surfaces, mesh.cpuVertexArrays[c], chunkTris[k]);
+        }
+    }, 1, threads);
+
+    for (int k = 0; k < (int)chunks.size(); ++k) {
+        Mesh& mesh = *m_meshes[chunks[k].first];
+        mesh.chunkStart[chunks[k].second] = mesh.triArray.size();
+        mesh.triArray.append(chunkTris[k]);
+    }
+    timer.after("Triangle extraction");
+
+    // Materials may have to read their textures back from the GPU, so they are converted
+    // on this thread, but once per material instead of once per triangle
+    std::map<const G3D::Material*, int> converted;
+    m_materials.clear();
+    for (int m = 0; m < (int)m_meshes.size(); ++m) {
+        Mesh& mesh = *m_meshes[m];
+        const G3D::Material* previous = NULL;
+        int previousIndex = 0;
+        mesh.materialIndex.resize(mesh.triArray.size());
+        for (int i = 0; i < mesh.triArray.size(); ++i) {
+            const shared_ptr<G3D::Material>& material = mesh.triArray[i].material();
+            if (material.get() != previous) {
+                std::map<const G3D::Material*, int>::iterator it = converted.find(material.get());
+                if (it == converted.end()) {
+                    alwaysAssertM(m_materials.size() <= 0xFFFF, "More materials than a 16-bit index holds");
+                    material->setStorage(G3D::MOVE_TO_CPU);
+                    it = converted.insert(std::make_pair(material.get(), (int)m_materials.size())).first;
+                    m_materials.push_back(material.get());
+                }
+                previousIndex = it->second;
+            }
+            mesh.materialIndex[i] = (unsigned short)previousIndex;
+            previous = material.get();
+        }
+    }
+    timer.after("Material conversion");
+
+    // Each mesh is built, or mapped from the cache, once however many instances it has
+    double start = G3D::System::time();
+    int mapped = 0;
+    for (int m = 0; m < (int)m_meshes.size(); ++m) {
+        Mesh& mesh = *m_meshes[m];
+        unsigned long long key = 0;
+        std::string cacheFile;
+        auto mapCache = [&]() {
+            cacheFile = G3D::format(m_compact ? "%s/%016llx.compact.bvh" : "%s/%016llx.bvh", CACHE_DIRECTORY, key);
+            return mesh.bvh.load(cacheFile, key) && mesh.bvh.triangleCount() == mesh.triArray.size();
+        };
+
+        // A model from the scene file is looked up by where it came from before its triangles are touched
+        std::map<const G3D::ArticulatedModel*, unsigned long long>::const_iterator source = m_sourceKeys.find(mesh.model.get());
+        if (m_useCache && source != m_sourceKeys.end()) {
+            key = source->second;
+            if (mapCache()) {
+                ++mapped;
+                continue;
+            }
+        }
+
+        std::vector<G3D::Vector3> positions(3 * mesh.triArray.size());
+        parallelFor(0, mesh.triArray.size(), [&](int begin, int end) {
+            for (int i = begin; i < end; ++i) {
+                const G3D::CPUVertexArray& vertexArray = cpuVertexArray(mesh, i);
+                for (int k = 0; k < 3; ++k) {
+                    positions[3 * i + k] = mesh.triArray[i].position(vertexArray, k);
+                }
+            }
+        }, 4096);
+
+        // Any other mesh is keyed by every position, so a file can only be mapped for exactly these triangles
+        if (m_useCache && key == 0) {
+            key = hashPositions(positions);
+            if (mapCache()) {
+                ++mapped;
+                continue;
+            }
+        }
+        mesh.bvh.build(positions);
+        if (m_useCache) {
+            G3D::FileSystem::createDirectory(CACHE_DIRECTORY);
+            if (!mesh.bvh.save(cacheFile, key)) {
+                G3D::debugPrintf("Could not write %s\n", cacheFile.c_str());
+            }
+        }
+    }
+    timer.after("Mesh BVHs");
+
+    m_instanceStart.resize(m_instances.size());
+    long long total = 0;
+    for (int i = 0; i < (int)m_instances.size(); ++i) {
+        m_instanceStart[i] = (int)total;
+        total += m_meshes[m_instances[i].mesh]->triArray.size();
+    }
+    alwaysAssertM(total <= 0x7FFFFFFF, "More instanced triangles than hits can number");
+    m_triangleCount = (int)total;
+    rebuildInstanceBVH();
+    m_accelerationSeconds = G3D::System::time() - start;
+    timer.after("Instance BVH");
+    G3D::debugPrintf("%d instances of %d meshes (%d mapped from the cache), %d triangles stored for %d placed\n",
+        (int)m_instances.size(), (int)m_meshes.size(), mapped, uniqueTriangleCount(), m_triangleCount);
+
+    m_lightBVH.build(lightArray);
 }
 
 
@@ -130,18 +406,208 @@ bool World::lineOfSight(const G3D::Vector3& v0, const G3D::Vector3& v1) const {
     G3D::Vector3 d = v1 - v0;
     float len = d.length();
     G3D::Ray ray = G3D::Ray::fromOriginAndDirection(v0, d / len);
-    float distance = len;
-    G3D::Tri::Intersector intersector;
+    BVH::Hit hit;
 
     // For shadow rays, try to find intersections as quickly as possible, rather
     // than solving for the first intersection
-    static const bool exitOnAnyHit = true, twoSidedTest = true;
-    return ! m_triTree.intersectRay(ray, intersector, distance, exitOnAnyHit, twoSidedTest);
+    static const bool exitOnAnyHit = true;
+    return ! m_instanceBVH.intersect(ray, len, hit, exitOnAnyHit);
+}
 
+bool World::intersect(const G3D::Ray& ray, float& distance, BVH::Hit& hit) const {
+    debugAssert(m_mode == TRACE);
+
+    if (m_instanceBVH.intersect(ray, distance, hit)) {
+        distance = hit.t;
+        return true;
+    }
+    return false;
+}
+
+void World::intersect8(RayPacket& packet, BVH::Hit hits[RayPacket::SIZE]) const {
+    debugAssert(m_mode == TRACE);
+
+    m_instanceBVH.intersect8(packet, hits);
+}
+
+void World::occluded8(const RayPacket& packet, bool occluded[RayPacket::SIZE]) const {
+    debugAssert(m_mode == TRACE);
+
+    m_instanceBVH.occluded8(packet, occluded);
+}
+
+bool World::surfel(const BVH::Hit& hit, const G3D::Ray& ray, G3D::UniversalSurfel& surfel) const {
+    if (hit.triIndex < 0) {
+        return false;
+    }
+
+    const int instance = instanceOf(hit.triIndex);
+    const Mesh& mesh = *m_meshes[m_instances[instance].mesh];
+    const G3D::CFrame& frame = m_instances[instance].frame;
+    const int triIndex = hit.triIndex - m_instanceStart[instance];
+
+    // The BVH uses the same edges and barycentrics as G3D's intersector, so its
+    // result can be handed to the material without intersecting again
+    const G3D::Tri& tri = mesh.triArray[triIndex];
+    const G3D::CPUVertexArray& vertexArray = cpuVertexArray(mesh, triIndex);
+    const G3D::Vector3& p0 = tri.position(vertexArray, 0);
+    G3D::Vector3 normal = (tri.position(vertexArray, 1) - p0).cross(tri.position(vertexArray, 2) - p0);
+
+    G3D::Tri::Intersector intersector;
+    intersector.tri = &tri;
+    intersector.cpuVertexArray = &vertexArray;
+    intersector.u = hit.u;
+    intersector.v = hit.v;
+    intersector.backside = frame.vectorToObjectSpace(ray.direction()).dot(normal) > 0.0f;
+
+    // Every material in the scene is a UniversalMaterial, whose sample() only
+    // allocates a UniversalSurfel and has it sample the intersection itself
+    surfel.sample(intersector);
+
+    // The triangle is in its mesh's space; the frame is rigid, so normals move like directions
+    surfel.location = frame.pointToWorldSpace(surfel.location);
+    surfel.geometricNormal = frame.vectorToWorldSpace(surfel.geometricNormal);
+    surfel.shadingNormal = frame.vectorToWorldSpace(surfel.shadingNormal);
+    surfel.shadingTangent1 = frame.vectorToWorldSpace(surfel.shadingTangent1);
+    surfel.shadingTangent2 = frame.vectorToWorldSpace(surfel.shadingTangent2);
+    return true;
+}
+
+const LightBVH& World::lightBVH() const {
+    return m_lightBVH;
+}
+
+void World::surfaces(G3D::Array<shared_ptr<G3D::Surface> >& posed) const {
+    for (int i = 0; i < (int)m_instances.size(); ++i) {
+        const Mesh& mesh = *m_meshes[m_instances[i].mesh];
+        if (mesh.model) {
+            mesh.model->pose(posed, m_instances[i].frame);
+        } else {
+            posed.append(mesh.surfaces);
+        }
+    }
+}
+
+int World::triangleCount() const {
+    return m_triangleCount;
+}
+
+int World::uniqueTriangleCount() const {
+    int count = 0;
+    for (int m = 0; m < (int)m_meshes.size(); ++m) {
+        count += m_meshes[m]->triArray.size();
+    }
+    return count;
+}
+
+int World::instanceCount() const {
+    return (int)m_instances.size();
+}
+
+int World::meshCount() const {
+    return (int)m_meshes.size();
+}
+
+void World::trianglePositions(std::vector<G3D::Vector3>& positions) const {
+    positions.resize(3 * (size_t)m_triangleCount);
+    parallelFor(0, (int)m_instances.size(), [&](int begin, int end) {
+        for (int i = begin; i < end; ++i) {
+            const Mesh& mesh = *m_meshes[m_instances[i].mesh];
+            const G3D::CFrame& frame = m_instances[i].frame;
+            G3D::Vector3* out = positions.data() + 3 * (size_t)m_instanceStart[i];
+            for (int t = 0; t < mesh.triArray.size(); ++t) {
+                const G3D::CPUVertexArray& vertexArray = cpuVertexArray(mesh, t);
+                for (int k = 0; k < 3; ++k) {
+                    out[3 * t + k] = frame.pointToWorldSpace(mesh.triArray[t].position(vertexArray, k));
+                }
+            }
+        }
+    });
+}
+
+size_t World::accelerationFootprint() const {
+    size_t bytes = m_instanceBVH.memoryFootprint();
+    for (int m = 0; m < (int)m_meshes.size(); ++m) {
+        bytes += m_meshes[m]->bvh.memoryFootprint();
+    }
+    return bytes;
 }
 
-shared_ptr<G3D::Surfel> World::intersect(const G3D::Ray& ray, float& distance) const {
+size_t World::geometryFootprint() const {
+    size_t bytes = 0;
+    for (int m = 0; m < (int)m_meshes.size(); ++m) {
+        const Mesh& mesh = *m_meshes[m];
+        bytes += mesh.triArray.size() * sizeof(G3D::Tri) + mesh.materialIndex.size() * sizeof(unsigned short);
+        for (int c = 0; c < (int)mesh.cpuVertexArrays.size(); ++c) {
+            bytes += mesh.cpuVertexArrays[c].vertex.size() * sizeof(G3D::CPUVertexArray::Vertex);
+        }
+    }
+    return bytes;
+}
+
+double World::accelerationSeconds() const {
+    return m_accelerationSeconds;
+}
+
+void World::setInstanceFrame(int instance, const G3D::CFrame& frame) {
     debugAssert(m_mode == TRACE);
+    m_instances[instance].frame = frame;
+    m_instanceBVH.setFrame(instance, frame);
+}
+
+const G3D::CFrame& World::instanceFrame(int instance) const {
+    return m_instances[instance].frame;
+}
+
+bool World::instanceBounds(int instance, G3D::AABox& bounds) const {
+    G3D::Vector3 lo, hi;
+    if (!m_instanceBVH.bounds(instance, lo, hi)) {
+        return false;
+    }
+    bounds = G3D::AABox(lo, hi);
+    return true;
+}
+
+void World::animate(double seconds, std::vector<G3D::AABox>& moved) {
+    for (int s = 0; s < (int)spins.size(); ++s) {
+        const Spin& spin = spins[s];
+        G3D::AABox bounds;
+        if (instanceBounds(spin.instance, bounds)) {
+            moved.push_back(bounds);
+        }
+        const float degrees = (float)fmod(spin.degreesPerSecond * seconds, 360.0);
+        setInstanceFrame(spin.instance, spin.frame * G3D::CFrame::fromXYZYPRDegrees(0.0f, 0.0f, 0.0f, degrees));
+        if (instanceBounds(spin.instance, bounds)) {
+            moved.push_back(bounds);
+        }
+    }
+}
+
+void World::rebuildInstanceBVH() {
+    std::vector<InstanceBVH::Instance> instances(m_instances.size());
+    for (int i = 0; i < (int)m_instances.size(); ++i) {
+        instances[i].mesh = &m_meshes[m_instances[i].mesh]->bvh;
+        instances[i].frame = m_instances[i].frame;
+        instances[i].triangleOffset = m_instanceStart[i];
+    }
+    m_instanceBVH.build(instances);
+}
+
+const InstanceBVH& World::instanceBVH() const {
+    return m_instanceBVH;
+}
+
+int World::materialIndex(int triIndex) const {
+    const int instance = instanceOf(triIndex);
+    return m_meshes[m_instances[instance].mesh]->materialIndex[triIndex - m_instanceStart[instance]];
+}
+
+int World::instanceOf(int triIndex) const {
+    // Instances of empty meshes share their start with the next one, which upper_bound passes
+    return (int)(std::upper_bound(m_instanceStart.begin(), m_instanceStart.end(), triIndex) - m_instanceStart.begin()) - 1;
+}
 
-    return m_triTree.intersectRay(ray, distance);
+const G3D::CPUVertexArray& World::cpuVertexArray(const Mesh& mesh, int triIndex) {
+    int chunk = (int)(std::upper_bound(mesh.chunkStart.begin(), mesh.chunkStart.end(), triIndex) - mesh.chunkStart.begin()) - 1;
+    return mesh.cpuVertexArrays[chunk];
 }
@@ -12,30 +12,126 @@
 #include <G3D/Vector3.h>
 #include <G3D/CoordinateFrame.h>
 #include <G3D/Ray.h>
+#include <G3D/AABox.h>
 
 #include <GLG3D/Tri.h>
 #include <GLG3D/Surface.h>
-#include <GLG3D/TriTree.h>
+#include <GLG3D/UniversalSurfel.h>
 #include <GLG3D/CPUVertexArray.h>
 #include <GLG3D/Light.h>
 #include <GLG3D/ArticulatedModel.h>
 
-/** \brief The scene.*/
+#include "BVH.h"
+#include "InstanceBVH.h"
+#include "LightBVH.h"
+
+#include <vector>
+#include <string>
+#include <map>
+
+/** \brief The scene.
+
+  Traced as two levels: every distinct model inserted is one mesh, its triangles
+  extracted and a BVH built over them once in the model's own space, and an
+  InstanceBVH places the meshes in the world, once per insert().  Memory and build
+  time grow with the distinct geometry, not with how often it is repeated.
+
+  Loaded from a scene file, a G3D::Any table named World; see scene/demo.Any.  It lists
+  the ArticulatedModel::Specification of each model by name, then the entities posing
+  them (an Instance at a frame, or a Grid of copies around the origin), the lights (a
+  PointLight, or a LightGrid of small colored ones), the ambient light and the starting
+  camera frame.  An Instance may also spin about its own y axis, for animate().
+
+  Instances can be moved between passes without building anything again: the
+  instance BVH is refit above each moved one, and its mesh's BVH is untouched.
+ */
 class World {
 private:
 
-    G3D::Array<G3D::Tri>					m_triArray;
-    G3D::Array<shared_ptr<G3D::Surface> >   m_surfaceArray;
-    G3D::TriTree							m_triTree;
-    G3D::CPUVertexArray						m_cpuVertexArray;
+    /** A model's triangles in its own space, shared by every instance of it, or the surfaces
+        inserted on their own.  The surfaces are split into chunks that are turned into
+        triangles in parallel, each with its own vertex array; the triangles of chunk i start
+        at chunkStart[i]. */
+    struct Mesh {
+        /** NULL for the inserted surfaces */
+        shared_ptr<G3D::ArticulatedModel>		model;
+        G3D::Array<shared_ptr<G3D::Surface> >	surfaces;
+        G3D::Array<G3D::Tri>					triArray;
+        std::vector<G3D::CPUVertexArray>		cpuVertexArrays;
+        std::vector<int>						chunkStart;
+        /** Per triangle, its material's index in m_materials; see materialIndex() */
+        std::vector<unsigned short>				materialIndex;
+        BVH										bvh;
+    };
+
+    /** A mesh placed in the world */
+    struct Instance {
+        int										mesh;
+        G3D::CFrame								frame;
+    };
+
+    std::vector<Mesh*>						m_meshes;
+    std::map<const G3D::ArticulatedModel*, int>	m_modelMeshes;
+    /** The mesh of the surfaces inserted on their own; -1 until there are any */
+    int										m_surfaceMesh;
+    std::vector<Instance>					m_instances;
+    /** Hits number the triangles of every instance one after another, instance i's from
+        m_instanceStart[i] */
+    std::vector<int>						m_instanceStart;
+    int										m_triangleCount;
+    InstanceBVH								m_instanceBVH;
+    double									m_accelerationSeconds;
+    LightBVH								m_lightBVH;
     enum Mode {TRACE, INSERT}				m_mode;
+    /** Whether end() maps the meshes' BVHs from CACHE_DIRECTORY, or saves them there after building them */
+    bool									m_useCache;
+    bool									m_compact;
+    /** Cache keys of the models the scene file loaded, from their specifications and files */
+    std::map<const G3D::ArticulatedModel*, unsigned long long>	m_sourceKeys;
+    std::vector<const G3D::Material*>		m_materials;
+
+    /** Adds an empty mesh and returns its index */
+    int addMesh();
+
+    /** The instance whose triangles include triIndex as numbered by hits */
+    int instanceOf(int triIndex) const;
+
+    /** The vertex array that triangle triIndex of mesh's triArray indexes into */
+    static const G3D::CPUVertexArray& cpuVertexArray(const Mesh& mesh, int triIndex);
 
 public:
 
     G3D::Array<shared_ptr<G3D::Light> >		lightArray;
     G3D::Color3								ambient;
+    /** The scene file's name for the scene, for reports */
+    std::string								name;
+    /** Where the scene file starts the camera */
+    G3D::CFrame								cameraFrame;
+
+    /** An instance the scene file sets turning about its own y axis, from frame */
+    struct Spin {
+        int									instance;
+        G3D::CFrame							frame;
+        float								degreesPerSecond;
+    };
+    std::vector<Spin>						spins;
 
-    World();
+    /** Mesh BVHs are cached here, one file per distinct set of triangles */
+    static const char* const				CACHE_DIRECTORY;
+
+    /** The interactive scene: Sponza with a mirror teapot and a glass sphere.  Next to it in
+        scene/ are the synthetic scenes for benchmarking: teapots.Any and spheres.Any, 16x16
+        grids of the teapot or of the sphere around the origin, and lights.Any, the teapots
+        lit by a 32x32 grid of small colored lights just above them. */
+    static const char* const				DEFAULT_SCENE;
+
+    /** Loads sceneFile, its models one at a time on the calling thread, which must own the OpenGL context.  With useCache, each mesh's BVH is mapped from
+        a file under CACHE_DIRECTORY left by an earlier run instead of being built: for a model,
+        one loaded with the same specification from the same unmodified file; otherwise one that
+        had exactly the same triangles.  With compact, their triangles are quantized to their leaves;
+        see BVH::setCompact().  Throws G3D::ParseError for a malformed scene file. */
+    explicit World(const std::string& sceneFile = DEFAULT_SCENE, bool useCache = true, bool compact = false);
+    ~World();
 
     /** Returns true if there is an unoccluded line of sight from v0
         to v1.  This is sometimes called the visibilty function in the
@@ -43,11 +139,13 @@ public:
     bool lineOfSight(const G3D::Vector3& v0, const G3D::Vector3& v1) const;
 
     void begin();
+    /** Places an instance of model at frame, which must be rigid.  The first insert of a model makes its mesh. */
     void insert(const shared_ptr<G3D::ArticulatedModel>& model, const G3D::CFrame& frame = G3D::CFrame());
+    /** Adds a surface to the mesh of surfaces inserted on their own, placed once as they are */
     void insert(const shared_ptr<G3D::Surface>& m);
     void end();
 
-    /**\brief Trace the ray into the scene and return the first
+    /**\brief Trace the ray into the scene and find the first
        surface hit.
 
        \param ray In world space 
@@ -55,9 +153,74 @@ public:
        \param distance On input, the maximum distance to trace to.  On
        output, the distance to the closest surface.
 
-       \return The surfel hit, or NULL if none.
+       \param hit Receives the closest hit; pass it to surfel() to
+       shade.
+
+       \return False if nothing was hit.
      */
-    shared_ptr<G3D::Surfel> intersect(const G3D::Ray& ray, float& distance) const;
+    bool intersect(const G3D::Ray& ray, float& distance, BVH::Hit& hit) const;
+
+    /**\brief Trace a packet of coherent rays at once.
+
+       \param packet On output, tMax holds the distance to each hit.
+
+       \param hits Receives the closest hit of each ray; pass them to
+       surfel() to shade.
+     */
+    void intersect8(RayPacket& packet, BVH::Hit hits[RayPacket::SIZE]) const;
+
+    /** Whether each ray of the packet is blocked before its tMax; the
+        packet version of lineOfSight(). */
+    void occluded8(const RayPacket& packet, bool occluded[RayPacket::SIZE]) const;
+
+    /** Fills in surfel for a hit returned by intersect() or intersect8(), without
+        allocating.  Returns false for a miss.  Only rays that are shaded pay for it. */
+    bool surfel(const BVH::Hit& hit, const G3D::Ray& ray, G3D::UniversalSurfel& surfel) const;
+
+    /** Hierarchy over lightArray for picking the lights to sample; built by end() */
+    const LightBVH& lightBVH() const;
+
+    /** Every instance posed in the world, the surfaces G3D would flatten into one tree.  Posed
+        on every call. */
+    void surfaces(G3D::Array<shared_ptr<G3D::Surface> >& posed) const;
+
+    /** Triangles in the world, counting every instance's, as numbered by hits */
+    int triangleCount() const;
+    /** Triangles stored, each mesh's once */
+    int uniqueTriangleCount() const;
+    int instanceCount() const;
+    int meshCount() const;
+
+    /** The corners of every triangle in the world, three per triangle, in the order hits number them */
+    void trianglePositions(std::vector<G3D::Vector3>& positions) const;
+
+    /** Bytes of the meshes' BVHs and the instance BVH */
+    size_t accelerationFootprint() const;
+    /** Bytes the meshes keep per unique triangle for shading: the G3D::Tris, their vertex arrays
+        and the material indices.  The materials themselves are shared and not counted. */
+    size_t geometryFootprint() const;
+    /** Seconds end() took to build the meshes' BVHs, or map them from the cache, and the instance BVH */
+    double accelerationSeconds() const;
+
+    /** Moves instance, numbered in the order it was inserted, to frame, which must be rigid,
+        and refits the instance BVH above it.  No pass may be tracing the world. */
+    void setInstanceFrame(int instance, const G3D::CFrame& frame);
+    const G3D::CFrame& instanceFrame(int instance) const;
+    /** World space bounds of instance; false if its mesh is empty */
+    bool instanceBounds(int instance, G3D::AABox& bounds) const;
+
+    /** Turns every instance in spins to where it is seconds after loading, appending the bounds
+        each moved from and to to moved.  No pass may be tracing the world. */
+    void animate(double seconds, std::vector<G3D::AABox>& moved);
+
+    /** Builds the instance BVH again for the current frames, removing the overlap refitting
+        leaves after large moves.  No pass may be tracing the world. */
+    void rebuildInstanceBVH();
+    const InstanceBVH& instanceBVH() const;
+
+    /** Small integer standing for the material of triangle triIndex as numbered by hits, the
+        same for every triangle sharing it; for sorting hits by material without chasing pointers */
+    int materialIndex(int triIndex) const;
 };
 
 #endif